@@ -5,7 +5,6 @@
 //   Professor Steven Gortler
 //
 ////////////////////////////////////////////////////////////////////////
-#include <list>
 #include <vector>
 #include <string>
 #include <memory>
@@ -38,6 +37,13 @@
 #include "sgutils.h"
 #include "geometry.h"
 #include "mesh.h"
+#include "threadpool.h"
+#include "meshpipeline.h"
+#include "meshlod.h"
+#include "meshdeformer.h"
+#include "catmullclark.h"
+#include "keyframestore.h"
+#include "clipstreamer.h"
 
 
 using namespace std;      // for string, vector, iostream, and other standard C++ stuff
@@ -105,8 +111,12 @@ static shared_ptr<SgRbtNode> g_skyNode, g_groundNode, g_robot1Node, g_robot2Node
 static shared_ptr<SgRbtNode> g_currentPickedRbtNode; // used later when you do picking
 
 //////////////////////////////////////////////////////mesh data
-static Mesh g_mesh, g_tempmesh;
-static shared_ptr<SimpleGeometryPN> g_meshsurface;
+static Mesh g_mesh;
+static MeshPipeline g_meshPipeline;       // deforms, subdivides and shades g_mesh every frame
+static MeshLod g_meshLod;                 // subdivision level of g_meshNode from its size on screen
+static MeshDeformer g_meshDeformer;       // as-rigid-as-possible deformation of g_mesh
+static vector<int> g_meshHandles;         // its lowest and highest vertex, which the deformation moves
+static shared_ptr<SimpleIndexedGeometryPN32> g_meshsurface;
 static shared_ptr<SgRbtNode> g_meshNode;
 
 // --------- Scene
@@ -120,6 +130,7 @@ static int world = 1; //added { 0 : sky-sky frame 1:world-sky frame }
 static int pick_mode = 0; //added {1 : picking}
 static int pick_well = 0; //{1 : picked well)
 static int animating = 0;
+static int streaming = 0; // {1 : animating plays animation.clip from disk instead of the keyframes}
 static int is_flat = 0;
 
 static int g_msBetweenKeyFrames = 2000; // 2 seconds between keyframes(initialized)
@@ -127,6 +138,11 @@ static int g_animateFramesPerSecond = 60; // frames to render per second during
 
 static float deform_factor = 1.0;
 static int g_numSubdiv = 0;
+static int use_stencils = 1; // refine the deformed mesh with precomputed stencils instead of subdivide()
+static int angle_normals = 0; // {0 : area weighted, 1 : angle weighted vertex normals}
+static int use_lod = 0; // {1 : pick the subdivision level from the screen size, up to g_numSubdiv}
+static int use_adaptive = 0; // {1 : only subdivide around extraordinary vertices and sharp bends}
+static int use_arap = 0; // {1 : swing the top of the mesh with an as-rigid-as-possible deformation instead of the wobble}
 
 
 static shared_ptr<SgRbtNode> give_eyeRbtNode() {
@@ -193,10 +209,9 @@ static RigTForm g_arcballRbt;
 
 
 //////////////////////////////////////////////////////////////////////////////
-static list<vector<RigTForm>> keyframes;
-static list<vector<RigTForm>>::iterator cur_iter = keyframes.end();
+static KeyframeStore keyframes;    // frame_number indexes it directly
 static int frame_number = -1;
-static int numRbtNodes = 25;
+static ClipStreamer g_clipStreamer;    // for clips too long to load, leaves the keyframes alone
 
 
 static void copy_curFrame_to_Scene();
@@ -249,77 +264,32 @@ static void initArcball() {
 }
 
 
-static vector<int> give_valence(Mesh& m) {
-    vector<int> valence(m.getNumVertices());
-
-    for (int i = 0; i < m.getNumFaces(); ++i) {
-
-        Mesh::Face f = m.getFace(i);
-        for (int j = 0; j < f.getNumVertices(); j++) {
-            int ind = f.getVertex(j).getIndex();
-            valence[ind] += 1;
-        }
-    }
-    return valence;
-}
-
-static vector<VertexPN> do_shading(Mesh& m) {
-    vector<VertexPN> vertex_info;
-
-    if (is_flat == 0) {
-        for (int i = 0; i < m.getNumFaces(); ++i) {
-            Mesh::Face f = m.getFace(i);
-            Cvec3 normal = f.getNormal();
-            for (int j = 0; j < f.getNumVertices() - 2; j++) {
-                vertex_info.push_back(VertexPN(f.getVertex(0).getPosition(), normal));
-                vertex_info.push_back(VertexPN(f.getVertex(j + 1).getPosition(), normal));
-                vertex_info.push_back(VertexPN(f.getVertex(j + 2).getPosition(), normal));
-            }
-        }
-    }
-    else {
-        for (int i = 0; i < m.getNumVertices(); ++i) {
-            m.getVertex(i).setNormal(Cvec3());
-        }
-        for (int i = 0; i < m.getNumFaces(); ++i) {
-
-            Mesh::Face f = m.getFace(i);
-            Cvec3 normal = f.getNormal();
-
-            for (int j = 0; j < f.getNumVertices(); j++) {
-                Mesh::Vertex v = f.getVertex(j);
-                v.setNormal(v.getNormal() + normal);
-            }
-        }
-        vector<int> valence = give_valence(m);
-
-        for (int i = 0; i < m.getNumVertices(); i++) {
-            Mesh::Vertex v = m.getVertex(i);
-            v.setNormal(v.getNormal() / 1.0 / valence[i]);
-        }
-
-        for (int i = 0; i < m.getNumFaces(); ++i) {
-            Mesh::Face f = m.getFace(i);
-
-            for (int j = 0; j < f.getNumVertices() - 2; j++) {
-                vertex_info.push_back(VertexPN(f.getVertex(0).getPosition(), f.getVertex(0).getNormal()));
-                vertex_info.push_back(VertexPN(f.getVertex(j + 1).getPosition(), f.getVertex(j + 1).getNormal()));
-                vertex_info.push_back(VertexPN(f.getVertex(j + 2).getPosition(), f.getVertex(j + 2).getNormal()));
-            }
-        }
-    }
-    return vertex_info;
-}
-
-
-
-
 static void initMesh() {
     g_mesh = Mesh();
     g_mesh.load("cube.mesh");
-    g_tempmesh = Mesh(g_mesh);
-    vector<VertexPN> vertex_info = do_shading(g_tempmesh);
-    g_meshsurface.reset(new SimpleGeometryPN(&vertex_info[0], vertex_info.size()));
+    g_meshPipeline.setMesh(g_mesh);
+    g_meshLod.setMesh(g_mesh, 1.5);       // the deformation moves vertices up to 1.5 times as far out
+    StencilTable::AdaptiveOptions adaptive;
+    adaptive.maxNormalAngle = 10;
+    g_meshPipeline.setAdaptiveOptions(adaptive);
+    if (g_mesh.getNumFaces() >= 20000) {  // heavy (e.g. scanned) meshes get cheaper versions for when they are far away
+        vector<MeshDecimator::Level> chain;
+        MeshDecimator().buildChain(g_mesh, 6, 0.25, chain);
+        vector<double> errors;
+        for (size_t i = 0; i < chain.size(); i++) {
+            errors.push_back(chain[i].error);
+        }
+        g_meshPipeline.setDecimatedMeshes(chain);
+        g_meshLod.setDecimationErrors(errors);
+    }
+    g_meshDeformer.setMesh(g_mesh);
+    g_meshHandles.assign(2, 0);
+    for (int i = 0; i < g_mesh.getNumVertices(); i++) {
+        if (g_mesh.getPositions()[i][1] < g_mesh.getPositions()[g_meshHandles[0]][1]) g_meshHandles[0] = i;
+        if (g_mesh.getPositions()[i][1] > g_mesh.getPositions()[g_meshHandles[1]][1]) g_meshHandles[1] = i;
+    }
+    g_meshDeformer.setHandles(g_meshHandles);
+    g_meshsurface.reset(new SimpleIndexedGeometryPN32());
     animatemeshTimerCallback(0);
 
 }
@@ -565,6 +535,13 @@ static void keyboard(const unsigned char key, const int x, const int y) {
     << "f\t\tToggle flat shading on/off.\n"
     << "o\t\tCycle object to edit\n"
     << "v\t\tCycle view\n"
+    << "t\t\tToggle stencil table / direct subdivision\n"
+    << "a\t\tToggle area / angle weighted vertex normals\n"
+    << "b\t\tPrint the time spent in each stage of the last mesh frame and its vertex cache misses\n"
+    << "l\t\tToggle screen size level of detail for the mesh\n"
+    << "r\t\tToggle adaptive / uniform subdivision of the mesh\n"
+    << "g\t\tToggle as-rigid-as-possible / wobble deformation of the mesh\n"
+    << "e\t\tExport the keyframes as text to animation.txt\n"
     << "drag left mouse to rotate\n" << endl;
     break;
   case 's':
@@ -633,12 +610,11 @@ static void keyboard(const unsigned char key, const int x, const int y) {
             cout << "cannot operate when playing animation" << endl;
             break;
         }
-        if (keyframes.empty() || frame_number == keyframes.size()-1) { //++cur_iter == keyframes.end()
+        if (keyframes.empty() || frame_number == keyframes.getNumFrames()-1) {
             cout << "cannot move to the next frame" << endl;
         }
         else {
             frame_number++;
-            cur_iter++;
             copy_curFrame_to_Scene();
         }
         break;
@@ -652,7 +628,6 @@ static void keyboard(const unsigned char key, const int x, const int y) {
         }
         else {
             frame_number--;
-            cur_iter--;
             copy_curFrame_to_Scene();
         }
         break;
@@ -667,17 +642,52 @@ static void keyboard(const unsigned char key, const int x, const int y) {
         else delete_curFrame();
         break;
     case 'w':
-        write_file("animation.txt");
+        write_file("animation.clip");
+        break;
+    case 'e':
+        write_file("animation.txt");     // text export, for editing by hand or older builds
         break;
     case 'i':
         if (animating == 1) {
             cout << "cannot operate when playing animation" << endl;
             break;
         }
-        read_file("animation.txt");
+        read_file(ifstream("animation.clip") ? "animation.clip" : "animation.txt");   // the text format is still read
+        break;
+    case 'c':
+        if (animating == 1) {
+            if (streaming == 1) {
+                animating = 0;
+                cout << "Stopping streamed animation..." << endl;
+            }
+            else cout << "cannot operate when playing animation" << endl;
+            break;
+        }
+        try {
+            g_clipStreamer.open("animation.clip");
+        }
+        catch (const runtime_error& e) {
+            cout << e.what() << endl;
+            break;
+        }
+        {
+            vector<shared_ptr<SgRbtNode>> rbtNodes;
+            dumpSgRbtNodes(g_world, rbtNodes);
+            if (g_clipStreamer.getNumNodes() != (int)rbtNodes.size() || g_clipStreamer.getNumFrames() < 4) {
+                cout << "animation.clip does not fit the scene or has less than 4 keyframes." << endl;
+                g_clipStreamer.close();
+                break;
+            }
+        }
+        g_clipStreamer.setPrecision(keyframes.getPrecision());
+        animating = 1;
+        streaming = 1;
+        cout << "Streaming animation from animation.clip..." << endl;
+        animateTimerCallback(0);
         break;
     case 'y': //animation    ȵǰ ϴ° ߰
-        if (keyframes.size() < 4) cout << "Cannot play animation with less than 4 keyframes." << endl;
+        if (streaming == 1) cout << "cannot operate when streaming animation" << endl;
+        else if (keyframes.getNumFrames() < 4) cout << "Cannot play animation with less than 4 keyframes." << endl;
         else if (animating == 0) {
             animating = 1;
             cout << "Playing animation..." << endl;
@@ -688,12 +698,9 @@ static void keyboard(const unsigned char key, const int x, const int y) {
             vector<shared_ptr<SgRbtNode>> rbtNodes;
             dumpSgRbtNodes(g_world, rbtNodes);
 
-            cur_iter = keyframes.end();
-            cur_iter--;
-            cur_iter--;
-            frame_number = keyframes.size() - 2;
+            frame_number = keyframes.getNumFrames() - 2;
             for (int i = 0; i < rbtNodes.size(); i++) {
-                rbtNodes[i]->setRbt((*cur_iter)[i]);
+                rbtNodes[i]->setRbt(keyframes.getRbt(frame_number, i));
             }
             cout << "Stopping animation..." << endl;
         }
@@ -718,6 +725,65 @@ static void keyboard(const unsigned char key, const int x, const int y) {
             cout << "Now using flat shading" << endl;
         }
         break;
+    case 't':
+        if (use_stencils == 0) {
+            use_stencils = 1;
+            cout << "Refining the mesh with stencil tables" << endl;
+        }
+        else {
+            use_stencils = 0;
+            cout << "Refining the mesh with direct subdivision" << endl;
+        }
+        break;
+    case 'a':
+        if (angle_normals == 0) {
+            angle_normals = 1;
+            cout << "Now using angle weighted vertex normals" << endl;
+        }
+        else {
+            angle_normals = 0;
+            cout << "Now using area weighted vertex normals" << endl;
+        }
+        break;
+    case 'b': {
+        const MeshPipeline::Timings& timings = g_meshPipeline.getTimings();
+        const IndexOptimizer& optimizer = g_meshPipeline.getIndexOptimizer();
+        cout << "deform " << timings.deform << " ms, refine " << timings.refine
+            << " ms, shade " << timings.shade << " ms" << endl;
+        cout << "ACMR " << optimizer.getAcmrBefore() << " before and " << optimizer.getAcmrAfter()
+            << " after reordering the triangles" << endl;
+        break;
+    }
+    case 'l':
+        if (use_lod == 0) {
+            use_lod = 1;
+            cout << "Subdividing the mesh according to its size on screen, up to " << g_numSubdiv << " steps" << endl;
+        }
+        else {
+            use_lod = 0;
+            cout << "Subdividing the mesh " << g_numSubdiv << " steps" << endl;
+        }
+        break;
+    case 'r':
+        if (use_adaptive == 0) {
+            use_adaptive = 1;
+            cout << "Subdividing the mesh only around extraordinary vertices and sharp bends" << endl;
+        }
+        else {
+            use_adaptive = 0;
+            cout << "Subdividing the whole mesh" << endl;
+        }
+        break;
+    case 'g':
+        if (use_arap == 0) {
+            use_arap = 1;
+            cout << "Swinging the top of the mesh, which deforms as rigidly as possible" << endl;
+        }
+        else {
+            use_arap = 0;
+            cout << "Wobbling the mesh vertices" << endl;
+        }
+        break;
     case '7':
         deform_factor /= 2;
         cout << "Half the speed at which the cube deforms" << endl;
@@ -960,6 +1026,7 @@ int main(int argc, char * argv[]) {
     initMaterials();
     initGeometry();
     initScene();
+    keyframes.setPrecision(QuatBatch::POLYNOMIAL);        // within float rounding of exact, and vectorized
 
     glutMainLoop();
     return 0;
@@ -974,7 +1041,7 @@ static void copy_curFrame_to_Scene() {
     vector<shared_ptr<SgRbtNode>> rbtNodes;
     dumpSgRbtNodes(g_world, rbtNodes);
     for (int i = 0; i < rbtNodes.size(); i++) {
-        rbtNodes[i]->setRbt((*cur_iter)[i]);
+        rbtNodes[i]->setRbt(keyframes.getRbt(frame_number, i));
     }
     cout << "Loading current key frame [";
     cout << frame_number;
@@ -984,7 +1051,7 @@ static void copy_Scene_to_curFrame() {
     vector<shared_ptr<SgRbtNode>> rbtNodes;
     dumpSgRbtNodes(g_world, rbtNodes);
     for (int i = 0; i < rbtNodes.size(); i++) {
-        (*cur_iter)[i] = rbtNodes[i]->getRbt();
+        keyframes.setRbt(frame_number, i, rbtNodes[i]->getRbt());
     }
     cout << "Copying scene graph to current frame [";
     cout << frame_number;
@@ -992,9 +1059,7 @@ static void copy_Scene_to_curFrame() {
 }
 
 static void create_newFrame_set_as_curFrame() {
-    vector<RigTForm> temp((*cur_iter).size(), RigTForm());
-    keyframes.insert(++cur_iter, temp);
-    --cur_iter;
+    keyframes.insertFrame(frame_number + 1);
     cout << "Create new frame[";
     cout << ++frame_number;
     cout << "]." << endl;
@@ -1005,31 +1070,24 @@ static void create_newFrame_set_as_curFrame_when_empty() {
     vector<shared_ptr<SgRbtNode>> rbtNodes;
     dumpSgRbtNodes(g_world, rbtNodes);
 
-    vector<RigTForm> temp(rbtNodes.size(), RigTForm());
-    for (int i = 0; i < temp.size(); i++) {
-        temp[i] = rbtNodes[i]->getRbt();
-    }
-    keyframes.insert(cur_iter, temp);
-    --cur_iter;
+    keyframes.clear(rbtNodes.size());
+    keyframes.insertFrame(0);
     ++frame_number;
+    for (int i = 0; i < rbtNodes.size(); i++) {
+        keyframes.setRbt(frame_number, i, rbtNodes[i]->getRbt());
+    }
     cout << "Create new frame[0].\nCopying scene graph to current frame[0]" << endl;
 }
 
 static void delete_curFrame() {
-    list<vector<RigTForm>>::iterator temp_iter;
-
-    if (keyframes.size() == 1) {
+    if (keyframes.getNumFrames() == 1) {
+        keyframes.eraseFrame(frame_number);
         frame_number--;
-        keyframes.erase(cur_iter);
-        cur_iter = keyframes.end();
         cout << "delete current frame[0]" << endl;
     }
 
     else if (frame_number == 0) {
-        temp_iter = cur_iter;
-        ++temp_iter;
-        keyframes.erase(cur_iter);
-        cur_iter = temp_iter;
+        keyframes.eraseFrame(frame_number);
         cout << "delete current frame[";
         cout << frame_number;
         cout << "]" << endl;
@@ -1039,10 +1097,7 @@ static void delete_curFrame() {
     }
 
     else {
-        temp_iter = cur_iter;
-        --temp_iter;
-        keyframes.erase(cur_iter);
-        cur_iter = temp_iter;
+        keyframes.eraseFrame(frame_number);
 
         cout << "delete current frame[";
         cout << frame_number;
@@ -1053,117 +1108,90 @@ static void delete_curFrame() {
     }
 }
 
+// Writes a keyframe clip, or a text animation file if the name ends in .txt
 static void write_file(const char *filename) {
-    ofstream f(filename, ios::binary);
-    f << keyframes.size() << ' ' << numRbtNodes << '\n';
-
-    for (list<vector<RigTForm>>::iterator iter = keyframes.begin(), end = keyframes.end(); iter != end; ++iter) {
-        for (int j = 0; j < numRbtNodes; j++) {
-            Quat r = (*iter)[j].getRotation();
-            Cvec3 t = (*iter)[j].getTranslation();
-            f << r[0] << ' ' << r[1] << ' ' << r[2] << ' ' << r[3] << ' ' << t[0] << ' ' << t[1] << ' ' << t[2] << '\n';
-        }
+    const string name(filename);
+    try {
+        if (name.size() >= 4 && name.compare(name.size() - 4, 4, ".txt") == 0) keyframes.saveText(filename);
+        else keyframes.save(filename);
+    }
+    catch (const runtime_error& e) {
+        cout << e.what() << endl;
+        return;
     }
-    f.close();
     cout << "Writing animation to ";
     cout << filename << endl;
 }
 
+// Reads a keyframe clip or a text animation file, keeping the current keyframes when
+// the file cannot be read or does not fit the scene
 static void read_file(const char* filename) {
-    int numFrames, numRbtsPerFrame;
-
-    ifstream f(filename, ios::binary);
-    string line;
-
-    if (f.is_open()) {
-        getline(f, line);
-        numFrames = stoi(line.substr(0, line.find(" ")));
-        numRbtsPerFrame = stoi(line.erase(0, line.find(" ") + 1));
+    KeyframeStore loaded;
+    try {
+        loaded.load(filename);
     }
-
-    keyframes.clear();
-    cur_iter = keyframes.end();
+    catch (const runtime_error& e) {
+        cout << e.what() << endl;
+        return;
+    }
+    vector<shared_ptr<SgRbtNode>> rbtNodes;
+    dumpSgRbtNodes(g_world, rbtNodes);
+    if (!loaded.empty() && loaded.getNumNodes() != (int)rbtNodes.size()) {
+        cout << filename << " animates " << loaded.getNumNodes() << " nodes, the scene has " << rbtNodes.size() << endl;
+        return;
+    }
+    loaded.setPrecision(keyframes.getPrecision());
+    keyframes = std::move(loaded);
     frame_number = -1;
-    numRbtNodes = numRbtsPerFrame;
 
-    if (numFrames == 0) { // if 0 frames are exits
-        cout << "Reading animation from ";
-        cout << filename << endl;
-        cout << "0 frames read." << endl;
-    }
+    cout << "Reading animation from ";
+    cout << filename << endl;
+    cout << keyframes.getNumFrames();
+    cout << " frames read." << endl;
 
-    else {
-        for (int k = 0; k < numFrames; k++) {
-            vector<RigTForm> RBTs;
-            for (int l = 0; l < numRbtsPerFrame; l++) {
-                getline(f, line);
-                int pos = 0;
-                Quat r = Quat();
-                Cvec3 t = Cvec3();
-
-                for (int i = 0; i < 4; i++) {
-                    pos = line.find(" ");
-                    r[i] = stod(line.substr(0, pos));
-                    line.erase(0, pos + 1);
-                }
-                for (int i = 0; i < 3; i++) {
-                    pos = line.find(" ");
-                    t[i] = stod(line.substr(0, pos));
-                    line.erase(0, pos + 1);
-                }
-                RBTs.push_back(RigTForm(t, r));
-            }
-            keyframes.insert(cur_iter, RBTs);
-        }
+    if (!keyframes.empty()) {
         frame_number = 0;
-        cur_iter = keyframes.begin();
-
-        cout << "Reading animation from ";
-        cout << filename << endl;
-        cout << numFrames;
-        cout << " frames read." << endl;
-
         copy_curFrame_to_Scene();
     }
-    f.close();
 }
 // Given t in the range [0, n], perform interpolation and draw the scene
 // for the particular t. Returns true if we are at the end of the animation
 // sequence, or false otherwise.
 
-static void iterator_move(int n) {
-    if (n > 0) for (int i = 0; i < n; i++) cur_iter++;
-    else for (int i = 0; i < abs(n); i++) cur_iter--;
-}
-static bool interpolateAndDisplay(float t) {
+static bool interpolateAndDisplay(double t) {
     vector<shared_ptr<SgRbtNode>> rbtNodes;
     dumpSgRbtNodes(g_world, rbtNodes);
     if (animating == 0) return false;
 
+    const int numFrames = streaming == 1 ? g_clipStreamer.getNumFrames() : keyframes.getNumFrames();
+    if (t >= numFrames - 3) {
+        if (streaming == 1) return true;   // stays at the last interpolated pose
 
-    if (t >= keyframes.size() - 3) {
-
-        cur_iter = keyframes.end();
-        iterator_move(-2);
-        frame_number = keyframes.size() - 2;
+        frame_number = keyframes.getNumFrames() - 2;
         for (int i = 0; i < rbtNodes.size(); i++) {
-            rbtNodes[i]->setRbt((*cur_iter)[i]);
+            rbtNodes[i]->setRbt(keyframes.getRbt(frame_number, i));
         }
         glutPostRedisplay();
         return true;
     }
     else {
-        cur_iter = keyframes.begin();
-        iterator_move((int)t);
-        vector<RigTForm> c0 = (*cur_iter);
-        vector<RigTForm> c1 = (*(++cur_iter));
-        vector<RigTForm> c2 = (*(++cur_iter));
-        vector<RigTForm> c3 = (*(++cur_iter));
+        // segment (int)t runs between keyframes (int)t + 1 and (int)t + 2
+        static vector<RigTForm> interpolated;
+        if (streaming == 1) {
+            try {
+                g_clipStreamer.interpolate(t, interpolated);
+            }
+            catch (const runtime_error& e) {
+                cout << e.what() << endl;
+                return true;
+            }
+        }
+        else keyframes.interpolate(t, interpolated);
 
-        for (int i = 0; i < c1.size(); i++) {
+        for (int i = 0; i < interpolated.size(); i++) {
 
             //rbtNodes[i] ->setRbt(interpolate(prev[i], next[i], t - (int)t));
-            rbtNodes[i]->setRbt(CRS_interpolate(c0[i], c1[i], c2[i], c3[i], t - (int)t));
+            rbtNodes[i]->setRbt(interpolated[i]);
         }
 
         glutPostRedisplay();
@@ -1172,20 +1200,24 @@ static bool interpolateAndDisplay(float t) {
 }
 // Interpret "ms" as milliseconds into the animation
 static void animateTimerCallback(int ms) {
-    float t = (float)ms / (float)g_msBetweenKeyFrames;
+    const double t = (double)ms / g_msBetweenKeyFrames;
     bool endReached = interpolateAndDisplay(t);
     if (!endReached && animating==1) {
         glutTimerFunc(1000 / g_animateFramesPerSecond, animateTimerCallback, ms + 1000 / g_animateFramesPerSecond);
     }
+    else if (streaming == 1) {
+        animating = 0;
+        streaming = 0;
+        g_clipStreamer.close();
+        cout << "Finished streaming animation" << endl;
+    }
     else  {
         animating = 0;
         vector<shared_ptr<SgRbtNode>> rbtNodes;
         dumpSgRbtNodes(g_world, rbtNodes);
-        cur_iter = keyframes.end();
-        iterator_move(-2);
-        frame_number = keyframes.size() - 2;
+        frame_number = keyframes.getNumFrames() - 2;
         for (int i = 0; i < rbtNodes.size(); i++) {
-            rbtNodes[i]->setRbt((*cur_iter)[i]);
+            rbtNodes[i]->setRbt(keyframes.getRbt(frame_number, i));
         }
         glutPostRedisplay();
         cout << "Finished playing animation\nNow at frame [";
@@ -1193,66 +1225,37 @@ static void animateTimerCallback(int ms) {
         cout << "]" << endl;
     }
 }
-static void subdivide(Mesh& m, const int num) {
-    for (int i = 0; i < num; i++) {
-        //1. loop over all of the faces of the mesh and compute faceVertex values
-        for (int j = 0; j < m.getNumFaces(); j++) {
-            Mesh::Face f = m.getFace(j);
-            Cvec3 faceVertex = Cvec3();
-            for (int k = 0; k < f.getNumVertices(); k++) {
-                faceVertex += f.getVertex(k).getPosition();
-            }
-            m.setNewFaceVertex(f, faceVertex / 1.0 / f.getNumVertices());
-        }
-        //2. loop over all of the edges and compute edgeVertex values
-        for (int j = 0; j < m.getNumEdges(); j++) {
-            Mesh::Edge e = m.getEdge(j);
-            Cvec3 edgeVertex = Cvec3();
-            for (int k = 0; k < 2; k++) {
-                edgeVertex += e.getVertex(k).getPosition();
-                edgeVertex += m.getNewFaceVertex(e.getFace(k));
-            }
-            m.setNewEdgeVertex(e, edgeVertex / 4.0);
-        }
-        //3. loop over all of the vertices and compute vertexVertex values
-        //use vertexIterator to walk around the neighber
-        for (int j = 0; j < m.getNumVertices(); j++) {
-            Mesh::Vertex v = m.getVertex(j);
-            Mesh::VertexIterator it(v.getIterator()), it0(it);
-
-            Cvec3 v_0, v_f = Cvec3();
-            int valence = 0;
-
-            do {
-                valence++;
-                v_0 += it.getVertex().getPosition();
-                v_f += m.getNewFaceVertex(it.getFace());
-            } while (++it != it0);
-
-            Cvec3 vertexVertex = v.getPosition() * ((valence - 2) * 1.0 / valence) +
-                (v_0+v_f) * 1.0 / valence / valence;
-            
-            m.setNewVertexVertex(v, vertexVertex);
-        }
-        //4.subdivide
-        m.subdivide();
-    }
-}
 
 
+// The topology of g_mesh never changes, so g_meshPipeline only builds the stencils of
+// each level once and rebuilds its index buffer when the level or shading mode changes.
 static void animatemeshTimerCallback(int ms) {
-    
-    g_tempmesh = Mesh(g_mesh);
-    for (int i = 0; i < g_tempmesh.getNumVertices(); i++) {
-        Mesh::Vertex v = g_tempmesh.getVertex(i);
-        Cvec3 position = v.getPosition();
-        v.setPosition(position + position*0.5*(sin(i+ ms *8*atan(1)/1000)));
+    int level = g_numSubdiv;
+    if (use_lod == 1 && g_meshNode) {
+        const Cvec3 center = (inv(give_eyeRbt()) * getPathAccumRbt(g_world, g_meshNode)).getTranslation();
+        level = g_meshLod.update(center, g_numSubdiv, g_frustFovY, g_windowWidth, g_windowHeight, g_frustNear, g_frustFar);
     }
-
-    subdivide(g_tempmesh, g_numSubdiv);
-
-    vector<VertexPN> vertex_info = do_shading(g_tempmesh);
-    g_meshsurface->upload(&vertex_info[0], vertex_info.size());
+    g_meshPipeline.setLevels(level);
+    g_meshPipeline.setUseStencils(use_stencils == 1);
+    g_meshPipeline.setFlatShading(is_flat == 0);
+    g_meshPipeline.setAdaptive(use_adaptive == 1);
+    g_meshPipeline.setNormalWeighting(angle_normals == 1 ? VertexNormals::ANGLE_WEIGHTED : VertexNormals::AREA_WEIGHTED);
+    const double t = ms * 8 * atan(1) / 1000;
+    const bool arap = use_arap == 1 && level >= 0;   // decimated levels have other vertices
+    if (arap) {
+        vector<Cvec3f> handles;
+        handles.push_back(g_mesh.getPositions()[g_meshHandles[0]]);
+        handles.push_back(g_mesh.getPositions()[g_meshHandles[1]] + Cvec3f(0.5 * sin(t), 0, 0));
+        g_meshDeformer.deform(handles);
+    }
+    const Cvec3f* arapPositions = g_meshDeformer.getPositions();
+    g_meshPipeline.update(
+        [t, arap, arapPositions](int i, const Cvec3f& position) {
+            return arap ? arapPositions[i] : position * (float)(1 + 0.5 * sin(i + t));
+        },
+        subdivideCatmullClark);
+    g_meshsurface->upload(g_meshPipeline.getVertices(), g_meshPipeline.getIndices(),
+        g_meshPipeline.getNumVertices(), g_meshPipeline.getNumIndices());
 
     glutPostRedisplay();
 
@@ -0,0 +1,67 @@
+#ifndef CATMULLCLARK_H
+#define CATMULLCLARK_H
+
+#include "cvec.h"
+#include "mesh.h"
+#include "threadpool.h"
+
+// Subdivides m num times with Catmull-Clark through the Mesh interface: the new face,
+// edge and vertex points are set, then Mesh::subdivide() refines the topology. Each
+// pass only writes the new vertex of its own face/edge/vertex, so the passes are split
+// across the thread pool and give the same result as a serial loop.
+inline void subdivideCatmullClark(Mesh& m, const int num) {
+  ThreadPool& pool = getThreadPool();
+  for (int i = 0; i < num; i++) {
+    //1. loop over all of the faces of the mesh and compute faceVertex values
+    pool.parallelFor(m.getNumFaces(), [&](int, int begin, int end) {
+      for (int j = begin; j < end; j++) {
+        Mesh::Face f = m.getFace(j);
+        Cvec3 faceVertex = Cvec3();
+        for (int k = 0; k < f.getNumVertices(); k++) {
+          faceVertex += f.getVertex(k).getPosition();
+        }
+        m.setNewFaceVertex(f, faceVertex / 1.0 / f.getNumVertices());
+      }
+    });
+    //2. loop over all of the edges and compute edgeVertex values
+    pool.parallelFor(m.getNumEdges(), [&](int, int begin, int end) {
+      for (int j = begin; j < end; j++) {
+        Mesh::Edge e = m.getEdge(j);
+        Cvec3 edgeVertex = Cvec3();
+        for (int k = 0; k < 2; k++) {
+          edgeVertex += e.getVertex(k).getPosition();
+          edgeVertex += m.getNewFaceVertex(e.getFace(k));
+        }
+        m.setNewEdgeVertex(e, edgeVertex / 4.0);
+      }
+    });
+    //3. loop over all of the vertices and compute vertexVertex values
+    //each one-ring is a contiguous range of the mesh's adjacency arrays
+    m.buildAdjacency();
+    const int* ring = m.getVertexRingOffsets();
+    const int* neighbors = m.getVertexNeighbors();
+    const int* faces = m.getVertexRingFaces();
+    pool.parallelFor(m.getNumVertices(), [&](int, int begin, int end) {
+      for (int j = begin; j < end; j++) {
+        Mesh::Vertex v = m.getVertex(j);
+
+        Cvec3 v_0, v_f = Cvec3();
+        const int valence = ring[j+1] - ring[j];
+
+        for (int k = ring[j]; k < ring[j+1]; k++) {
+          v_0 += m.getVertex(neighbors[k]).getPosition();
+          v_f += m.getNewFaceVertex(m.getFace(faces[k]));
+        }
+
+        Cvec3 vertexVertex = v.getPosition() * ((valence - 2) * 1.0 / valence) +
+          (v_0+v_f) * 1.0 / valence / valence;
+
+        m.setNewVertexVertex(v, vertexVertex);
+      }
+    });
+    //4.subdivide
+    m.subdivide();
+  }
+}
+
+#endif
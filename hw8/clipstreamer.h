@@ -0,0 +1,198 @@
+#ifndef CLIPSTREAMER_H
+#define CLIPSTREAMER_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cassert>
+
+#include "rigtform.h"
+#include "quatbatch.h"
+#include "keyframestore.h"
+
+// Plays a keyframe clip (see KeyframeStore::save()) of any length from disk. Only a
+// window of frames is in memory: the four around the playhead that a Catmull-Rom
+// segment needs, and up to getPrefetch() after them, in a ring that a reader thread
+// keeps filled ahead of the playhead. Playback can start once the first four frames
+// are in, and memory stays the same whatever the length of the clip.
+//
+// The playhead should mostly move forward. Moving it back, or too far ahead, drops the
+// window and waits for the reader to start over there. The checksum of the clip is not
+// verified, since that would need the whole file; KeyframeStore::load() does.
+class ClipStreamer {
+public:
+  ClipStreamer()
+    : numNodes_(0), numFrames_(0), prefetch_(256), capacity_(0), base_(0), loaded_(0), generation_(0),
+      error_(false), quit_(false), current_(-1) {}
+
+  ~ClipStreamer() {
+    close();
+  }
+
+  // Frames read ahead of the four in use, 256 by default. Takes effect at open().
+  void setPrefetch(const int frames) {
+    prefetch_ = std::max(frames, 0);
+  }
+
+  int getPrefetch() const {
+    return prefetch_;
+  }
+
+  // How interpolate() evaluates rotations, as in KeyframeStore
+  void setPrecision(const QuatBatch::Precision precision) {
+    segment_.setPrecision(precision);
+  }
+
+  // Starts reading the clip. Throws runtime_error if it is not a keyframe clip or is
+  // truncated.
+  void open(const char filename[]) {
+    close();
+    file_.open(filename, std::ios::binary);
+    if (!file_)
+      throw std::runtime_error(std::string("Cannot open file ") + filename);
+    KeyframeStore::clip_header_t header;
+    file_.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file_ || std::memcmp(header.magic, KeyframeStore::clip_magic__(), 8) != 0) {
+      file_.close();
+      throw std::runtime_error(std::string("Not a keyframe clip: ") + filename);
+    }
+    file_.seekg(0, std::ios::end);
+    const std::size_t size = (std::size_t)std::max(header.numFrames, 0) * KeyframeStore::NUM_COMPONENTS * std::max(header.numNodes, 0);
+    if (header.version != KeyframeStore::CLIP_VERSION || header.numNodes < 0 || header.numFrames < 0 ||
+        (std::size_t)file_.tellg() != sizeof(header) + size * sizeof(float)) {
+      file_.close();
+      throw std::runtime_error(std::string("Corrupt keyframe clip ") + filename);
+    }
+    filename_ = filename;
+    numNodes_ = header.numNodes;
+    numFrames_ = header.numFrames;
+    frameSize_ = KeyframeStore::NUM_COMPONENTS * numNodes_;
+    capacity_ = 4 + prefetch_;
+    ring_.assign((std::size_t)capacity_ * frameSize_, 0);
+    base_ = loaded_ = 0;
+    error_ = quit_ = false;
+    current_ = -1;
+    segment_.clear(numNodes_);
+    for (int j = 0; j < 4; ++j) {
+      segment_.insertFrame(j);
+    }
+    reader_ = std::thread(&ClipStreamer::read__, this);
+  }
+
+  // Stops the reader and frees the window
+  void close() {
+    if (!isOpen())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    wake_.notify_all();
+    reader_.join();
+    file_.close();
+    std::vector<float>().swap(ring_);
+    segment_.clear(0);
+    numNodes_ = numFrames_ = 0;
+  }
+
+  bool isOpen() const {
+    return reader_.joinable();
+  }
+
+  int getNumNodes() const {
+    return numNodes_;
+  }
+
+  int getNumFrames() const {
+    return numFrames_;
+  }
+
+  // As KeyframeStore::interpolate(), for t in [0, getNumFrames() - 3). Waits for the
+  // reader if it has not read the frames of the segment yet. Throws runtime_error if
+  // reading failed.
+  void interpolate(const double t, std::vector<RigTForm>& out) {
+    const int k = (int)t;
+    assert(isOpen() && k >= 0 && k + 3 < numFrames_);
+    if (k != current_) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (k < base_ || k > loaded_) {
+          base_ = loaded_ = k;                              // start over at k
+          ++generation_;
+        }
+        else {
+          base_ = k;                                        // frees the slots before k
+        }
+        wake_.notify_all();
+        ready_.wait(lock, [&]() { return loaded_ >= k + 4 || error_; });
+        if (error_)
+          throw std::runtime_error(std::string("Cannot read keyframe clip ") + filename_);
+      }
+      // frames k to k+3 are in, and the reader only writes frames after them
+      for (int j = 0; j < 4; ++j) {
+        std::memcpy(segment_.getFrame(j), &ring_[(std::size_t)((k + j) % capacity_) * frameSize_], frameSize_ * sizeof(float));
+      }
+      current_ = k;
+    }
+    segment_.interpolate(t - k, out);
+  }
+
+private:
+  enum {
+    MAX_READ = 32                                           // frames per read, so that the first ones come in early
+  };
+
+  std::string filename_;
+  std::ifstream file_;                                      // used by the reader only, after open()
+  int numNodes_, numFrames_, frameSize_;
+  int prefetch_, capacity_;
+  std::vector<float> ring_;                                 // capacity_ frames, frame i in slot i % capacity_
+  KeyframeStore segment_;                                   // frames current_ to current_ + 3
+  std::thread reader_;
+  std::mutex mutex_;                                        // guards the members below
+  std::condition_variable wake_, ready_;                    // for the reader, for interpolate()
+  int base_, loaded_;                                       // frames base_ to loaded_ - 1 are in the ring
+  int generation_;                                          // counts restarts, so that reads from before one are dropped
+  bool error_, quit_;
+  int current_;                                             // the frame segment_ starts at, or -1
+
+  // Reads frames from loaded_ on, until the ring holds base_ to base_ + capacity_ - 1.
+  // Waits until a batch of slots is free, unless interpolate() waits for frames.
+  void read__() {
+    const int batch = std::max(std::min((int)MAX_READ, capacity_ / 2), 1);
+    int next = -1;                                          // the frame the file is at, if known
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      wake_.wait(lock, [&]() {
+        const int end = std::min(base_ + capacity_, numFrames_);
+        return quit_ || (!error_ && loaded_ < end && (end - loaded_ >= batch || end == numFrames_ || loaded_ < base_ + 4));
+      });
+      if (quit_)
+        return;
+      const int first = loaded_, generation = generation_, slot = first % capacity_;
+      const int n = std::min(std::min(base_ + capacity_, numFrames_) - first, std::min(capacity_ - slot, (int)MAX_READ));
+      lock.unlock();
+      if (first != next)
+        file_.seekg(sizeof(KeyframeStore::clip_header_t) + (std::size_t)first * frameSize_ * sizeof(float));
+      next = first + n;
+      file_.read(reinterpret_cast<char*>(&ring_[(std::size_t)slot * frameSize_]), (std::size_t)n * frameSize_ * sizeof(float));
+      const bool ok = !file_.fail();
+      lock.lock();
+      if (generation != generation_)
+        continue;
+      if (ok)
+        loaded_ += n;
+      else
+        error_ = true;
+      ready_.notify_all();
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,432 @@
+#ifndef KEYFRAMESTORE_H
+#define KEYFRAMESTORE_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <cstring>
+#include <cctype>
+#include <charconv>
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+#include <cmath>
+
+#include "cvec.h"
+#include "quat.h"
+#include "rigtform.h"
+#include "quatbatch.h"
+#include "mappedfile.h"
+
+// Keyframes of an animation: for every frame, one RigTForm per scene graph node.
+// All frames live in one flat array of floats, frame after frame. Within a frame the
+// nodes are stored as structure of arrays, one run of getNumNodes() values per
+// component (the quaternion's w, x, y, z, then the translation's x, y, z), so the
+// nodes of a frame can be processed a vector register at a time. Frame f is found by
+// an index computation, and inserting or deleting a frame moves the frames after it in
+// one memmove. Keyframes are kept in single precision, which is also all the text
+// animation files hold.
+//
+// Keyframe clips (see save()) hold the frames in this same layout, so load() maps
+// the file and plays the frames in place; the first edit copies them into memory.
+//
+// interpolate() plays the Catmull-Rom spline through the keyframes. What a segment's
+// Bezier curve needs beyond its two keyframes (the control points d and e, and the
+// rotations between consecutive control points, as rotation vectors) is computed once
+// per segment and cached in the same layout, so a playback frame only runs the de
+// Casteljau evaluation, over all nodes at once with QuatBatch. Editing a frame
+// invalidates the segments around it.
+class KeyframeStore {
+  friend class ClipStreamer;                                // reads the clip format
+
+public:
+  enum Component {
+    QW, QX, QY, QZ,                                          // rotation
+    TX, TY, TZ,                                              // translation
+    NUM_COMPONENTS
+  };
+
+  KeyframeStore() : numNodes_(0), mapped_(NULL), precision_(QuatBatch::EXACT) {}
+
+  // Removes all frames and sets the number of nodes per frame
+  void clear(const int numNodes) {
+    numNodes_ = numNodes;
+    file_.reset();
+    mapped_ = NULL;
+    data_.clear();
+    segment_.clear();
+    valid_.clear();
+  }
+
+  int getNumNodes() const {
+    return numNodes_;
+  }
+
+  int getNumFrames() const {
+    return valid_.size();
+  }
+
+  bool empty() const {
+    return valid_.empty();
+  }
+
+  // Floats per frame
+  int getFrameSize() const {
+    return NUM_COMPONENTS * numNodes_;
+  }
+
+  void reserve(const int numFrames) {
+    own__();
+    data_.reserve((std::size_t)numFrames * getFrameSize());
+    segment_.reserve((std::size_t)numFrames * SEGMENT_SIZE * numNodes_);
+    valid_.reserve(numFrames);
+  }
+
+  // Inserts a frame of identity transforms before frame f (at the end for f = getNumFrames())
+  void insertFrame(const int f) {
+    assert(f >= 0 && f <= getNumFrames());
+    own__();
+    std::vector<float> frame(getFrameSize(), 0);
+    std::fill(frame.begin() + QW * numNodes_, frame.begin() + (QW + 1) * numNodes_, 1.0f);
+    data_.insert(data_.begin() + (std::size_t)f * getFrameSize(), frame.begin(), frame.end());
+    if (!segment_.empty())
+      segment_.insert(segment_.begin() + (std::size_t)f * SEGMENT_SIZE * numNodes_, SEGMENT_SIZE * numNodes_, 0.0f);
+    valid_.insert(valid_.begin() + f, 0);
+    invalidate__(f);
+  }
+
+  void eraseFrame(const int f) {
+    assert(f >= 0 && f < getNumFrames());
+    own__();
+    const std::vector<float>::iterator begin = data_.begin() + (std::size_t)f * getFrameSize();
+    data_.erase(begin, begin + getFrameSize());
+    if (!segment_.empty()) {
+      const std::vector<float>::iterator segment = segment_.begin() + (std::size_t)f * SEGMENT_SIZE * numNodes_;
+      segment_.erase(segment, segment + SEGMENT_SIZE * numNodes_);
+    }
+    valid_.erase(valid_.begin() + f);
+    invalidate__(f);
+  }
+
+  // The getFrameSize() floats of frame f. The non const versions invalidate the
+  // cached segments around f, so they are for writing.
+  const float* getFrame(const int f) const {
+    return frames__() + (std::size_t)f * getFrameSize();
+  }
+
+  float* getFrame(const int f) {
+    own__();
+    invalidate__(f);
+    return &data_[(std::size_t)f * getFrameSize()];
+  }
+
+  // The getNumNodes() values of component c in frame f
+  const float* getComponent(const int f, const Component c) const {
+    return getFrame(f) + c * numNodes_;
+  }
+
+  float* getComponent(const int f, const Component c) {
+    return getFrame(f) + c * numNodes_;
+  }
+
+  RigTForm getRbt(const int f, const int node) const {
+    const float* const p = getFrame(f) + node;
+    const int n = numNodes_;
+    return RigTForm(Cvec3(p[TX*n], p[TY*n], p[TZ*n]), Quat(p[QW*n], p[QX*n], p[QY*n], p[QZ*n]));
+  }
+
+  void setRbt(const int f, const int node, const RigTForm& rbt) {
+    float* const p = getFrame(f) + node;
+    const int n = numNodes_;
+    const Quat r = rbt.getRotation();
+    const Cvec3 t = rbt.getTranslation();
+    for (int i = 0; i < 4; ++i) {
+      p[(QW + i) * n] = r[i];
+    }
+    for (int i = 0; i < 3; ++i) {
+      p[(TX + i) * n] = t[i];
+    }
+  }
+
+  // How interpolate() evaluates rotations, QuatBatch::EXACT by default
+  void setPrecision(const QuatBatch::Precision precision) {
+    precision_ = precision;
+  }
+
+  QuatBatch::Precision getPrecision() const {
+    return precision_;
+  }
+
+  // The Catmull-Rom spline at t in [0, getNumFrames() - 3), for every node: segment
+  // (int)t runs from keyframe (int)t + 1 to (int)t + 2. Gives what CRS_interpolate()
+  // gives on these keyframes and their neighbours. t is a double, since a float only
+  // resolves 1/32 of a segment beyond 2^18 frames.
+  void interpolate(const double t, std::vector<RigTForm>& out) {
+    const int f = (int)t + 1, n = numNodes_;
+    const float i = (float)(t - (int)t);
+    assert(f >= 1 && f + 2 < getNumFrames());
+    out.resize(n);
+    if (std::abs(i - 0) < CS175_EPS || std::abs(i - 1) < CS175_EPS) {
+      for (int node = 0; node < n; ++node) {
+        out[node] = getRbt(i < 0.5 ? f : f + 1, node);
+      }
+      return;
+    }
+    if (!valid_[f])
+      build_segment__(f);
+    const float* const s = &segment_[(std::size_t)f * SEGMENT_SIZE * n];
+    const float* const c1 = frames__() + (std::size_t)f * getFrameSize();
+    const float* const c2 = c1 + getFrameSize();
+
+    // de Casteljau on the rotations c1, d, e, c2 of all nodes
+    scratch_.resize(20 * n);
+    float* const p01 = &scratch_[0];
+    float* const p12 = p01 + 4 * n;
+    float* const p23 = p12 + 4 * n;
+    float* const p012 = p23 + 4 * n;
+    float* const p123 = p012 + 4 * n;
+    QuatBatch::exp(n, s + W01X*n, n, i, p01, n, precision_);
+    QuatBatch::multiply(n, p01, n, c1 + QW*n, n, p01, n);
+    QuatBatch::exp(n, s + W12X*n, n, i, p12, n, precision_);
+    QuatBatch::multiply(n, p12, n, s + DW*n, n, p12, n);
+    QuatBatch::exp(n, s + W23X*n, n, i, p23, n, precision_);
+    QuatBatch::multiply(n, p23, n, s + EW*n, n, p23, n);
+    QuatBatch::slerp(n, p01, n, p12, n, i, p012, n, precision_);
+    QuatBatch::slerp(n, p12, n, p23, n, i, p123, n, precision_);
+    QuatBatch::slerp(n, p012, n, p123, n, i, p01, n, precision_);
+
+    const float u = 1 - i;
+    const float b0 = u*u*u, b1 = 3*i*u*u, b2 = 3*u*i*i, b3 = i*i*i;
+    for (int node = 0; node < n; ++node) {
+      Cvec3 translation;
+      for (int k = 0; k < 3; ++k) {
+        translation[k] = c1[(TX + k)*n + node] * b0 + s[(DTX + k)*n + node] * b1 + s[(ETX + k)*n + node] * b2 + c2[(TX + k)*n + node] * b3;
+      }
+      out[node] = RigTForm(translation, Quat(p01[node], p01[n + node], p01[2*n + node], p01[3*n + node]));
+    }
+  }
+
+  // Reads a keyframe clip, or a text animation file as written by saveText(). Throws
+  // runtime_error, leaving the keyframes as they were, if the file cannot be read.
+  void load(const char filename[]) {
+    KeyframeStore loaded;
+    const std::shared_ptr<MappedFile> file(new MappedFile(filename));
+    if (file->size() >= sizeof(clip_header_t) && std::memcmp(file->data(), clip_magic__(), 8) == 0)
+      loaded.load_clip__(file, filename);
+    else
+      loaded.load_text__(*file, filename);
+    loaded.precision_ = precision_;
+    *this = std::move(loaded);
+  }
+
+  // Writes a keyframe clip. A clip mapped by load() is copied into memory first, so
+  // that it can be saved over the file it came from.
+  void save(const char filename[]) {
+    own__();
+    clip_header_t header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, clip_magic__(), 8);
+    header.version = CLIP_VERSION;
+    header.numNodes = numNodes_;
+    header.numFrames = getNumFrames();
+    checksum__(frames__(), data_.size(), header.checksum);
+
+    std::ofstream f(filename, std::ios::binary);
+    if (!f)
+      throw std::runtime_error(std::string("Cannot open file ") + filename);
+    f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!data_.empty())
+      f.write(reinterpret_cast<const char*>(&data_[0]), data_.size() * sizeof(float));
+    if (!f)
+      throw std::runtime_error(std::string("Cannot write file ") + filename);
+  }
+
+  // Writes the text animation format: the frame and node counts, then a line
+  // "w x y z tx ty tz" per frame and node, each value in the fewest digits that read
+  // back the same float
+  void saveText(const char filename[]) const {
+    std::ofstream f(filename, std::ios::binary);
+    if (!f)
+      throw std::runtime_error(std::string("Cannot open file ") + filename);
+    f << getNumFrames() << ' ' << numNodes_ << '\n';
+    std::vector<char> line(NUM_COMPONENTS * 16);
+    for (int k = 0; k < getNumFrames(); ++k) {
+      const float* const p = getFrame(k);
+      for (int node = 0; node < numNodes_; ++node) {
+        char* q = &line[0];
+        for (int c = 0; c < NUM_COMPONENTS; ++c) {
+          q = std::to_chars(q, &line[0] + line.size(), p[c * numNodes_ + node]).ptr;
+          *q++ = c + 1 < NUM_COMPONENTS ? ' ' : '\n';
+        }
+        f.write(&line[0], q - &line[0]);
+      }
+    }
+    if (!f)
+      throw std::runtime_error(std::string("Cannot write file ") + filename);
+  }
+
+private:
+  // Keyframe clip: a clip_header_t followed by numFrames frames of getFrameSize()
+  // little endian floats, laid out as in memory. checksum holds Fletcher style sums
+  // of the frames as 32 bit words.
+  enum {
+    CLIP_VERSION = 1
+  };
+  struct clip_header_t {
+    char magic[8];                                          // "KEYCLIP" and a terminating zero
+    unsigned version;
+    int numNodes, numFrames;
+    unsigned checksum[2];
+    unsigned reserved[3];
+  };
+
+  // What interpolate() needs per node for the segment from keyframe f to f+1, besides
+  // the keyframes: the rotations and translations of the Bezier control points d and e,
+  // and the rotations d c1^-1, e d^-1 and c2 e^-1 as rotation vectors (axis times angle)
+  enum SegmentComponent {
+    DW, DX, DY, DZ,
+    EW, EX, EY, EZ,
+    W01X, W01Y, W01Z,
+    W12X, W12Y, W12Z,
+    W23X, W23Y, W23Z,
+    DTX, DTY, DTZ,
+    ETX, ETY, ETZ,
+    SEGMENT_SIZE
+  };
+
+  int numNodes_;
+  std::vector<float> data_;                                 // getNumFrames() * getFrameSize() floats, unless mapped
+  std::shared_ptr<MappedFile> file_;                        // the clip the frames are mapped from, if any
+  const float* mapped_;                                     // its frames
+  std::vector<float> segment_;                              // SEGMENT_SIZE * numNodes_ floats per frame, for the segment it starts; allocated by build_segment__
+  std::vector<char> valid_;                                 // whether each frame's segment_ entry is up to date
+  std::vector<float> scratch_;                              // interpolate()'s de Casteljau levels
+  QuatBatch::Precision precision_;
+
+  const float* frames__() const {
+    return file_ ? mapped_ : data_.data();
+  }
+
+  // Copies mapped frames into data_, before they are changed
+  void own__() {
+    if (!file_)
+      return;
+    data_.assign(mapped_, mapped_ + (std::size_t)getNumFrames() * getFrameSize());
+    file_.reset();
+    mapped_ = NULL;
+  }
+
+  static const char* clip_magic__() {
+    return "KEYCLIP";
+  }
+
+  static void checksum__(const float* data, const std::size_t n, unsigned checksum[2]) {
+    unsigned a = 0, b = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      unsigned w;
+      std::memcpy(&w, data + i, sizeof(w));
+      a += w;
+      b += a;
+    }
+    checksum[0] = a;
+    checksum[1] = b;
+  }
+
+  void load_clip__(const std::shared_ptr<MappedFile>& file, const char filename[]) {
+    clip_header_t header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (header.version != CLIP_VERSION)
+      throw std::runtime_error(std::string("Unsupported keyframe clip version in ") + filename);
+    const std::size_t size = (std::size_t)std::max(header.numFrames, 0) * NUM_COMPONENTS * std::max(header.numNodes, 0);
+    if (header.numNodes < 0 || header.numFrames < 0 || file->size() - sizeof(header) != size * sizeof(float))
+      throw std::runtime_error(std::string("Corrupt keyframe clip ") + filename);
+    const float* const frames = reinterpret_cast<const float*>(file->data() + sizeof(header));
+    unsigned checksum[2];
+    checksum__(frames, size, checksum);
+    if (checksum[0] != header.checksum[0] || checksum[1] != header.checksum[1])
+      throw std::runtime_error(std::string("Corrupt keyframe clip ") + filename);
+    clear(header.numNodes);
+    file_ = file;
+    mapped_ = frames;
+    valid_.assign(header.numFrames, 0);
+  }
+
+  template<typename T>
+  static bool number__(const char*& p, const char* end, T& value) {
+    while (p < end && std::isspace((unsigned char)*p)) {
+      ++p;
+    }
+    const std::from_chars_result r = std::from_chars(p, end, value);
+    p = r.ptr;
+    return r.ec == std::errc();
+  }
+
+  void load_text__(const MappedFile& file, const char filename[]) {
+    const char* p = file.data();
+    const char* const end = p + file.size();
+    int numFrames, numNodes;
+    if (!number__(p, end, numFrames) || !number__(p, end, numNodes) || numFrames < 0 || numNodes < 0 ||
+        (double)numFrames * NUM_COMPONENTS * numNodes > file.size())  // every value takes two characters at least
+      throw std::runtime_error(std::string("Malformed animation file ") + filename);
+    clear(numNodes);
+    data_.resize((std::size_t)numFrames * getFrameSize());
+    valid_.assign(numFrames, 0);
+    for (int k = 0; k < getNumFrames(); ++k) {
+      float* const frame = &data_[(std::size_t)k * getFrameSize()];
+      for (int node = 0; node < numNodes_; ++node) {
+        for (int c = 0; c < NUM_COMPONENTS; ++c) {
+          if (!number__(p, end, frame[c * numNodes_ + node]))
+            throw std::runtime_error(std::string("Malformed animation file ") + filename);
+        }
+      }
+    }
+  }
+
+  // Segment f depends on keyframes f-1 to f+2
+  void invalidate__(const int f) {
+    for (int s = std::max(f - 2, 0); s <= f + 1 && s < getNumFrames(); ++s) {
+      valid_[s] = 0;
+    }
+  }
+
+  void build_segment__(const int f) {
+    const int n = numNodes_;
+    segment_.resize((std::size_t)getNumFrames() * SEGMENT_SIZE * n);
+    float* const s = &segment_[(std::size_t)f * SEGMENT_SIZE * n];
+    for (int node = 0; node < n; ++node) {
+      float* const p = s + node;
+      const RigTForm c0 = getRbt(f - 1, node), c1 = getRbt(f, node), c2 = getRbt(f + 1, node), c3 = getRbt(f + 2, node);
+      const Cvec3 d_t = (c2.getTranslation() - c0.getTranslation()) / 6.0 + c1.getTranslation();
+      const Cvec3 e_t = (c1.getTranslation() - c3.getTranslation()) / 6.0 + c2.getTranslation();
+      Quat q = c2.getRotation() * inv(c0.getRotation());
+      const Quat d = power(cn(q), 1 / 6.0) * c1.getRotation();
+      q = c1.getRotation() * inv(c3.getRotation());
+      const Quat e = power(cn(q), 1 / 6.0) * c2.getRotation();
+      for (int k = 0; k < 4; ++k) {
+        p[(DW + k) * n] = d[k];
+        p[(EW + k) * n] = e[k];
+      }
+      for (int k = 0; k < 3; ++k) {
+        p[(DTX + k) * n] = d_t[k];
+        p[(ETX + k) * n] = e_t[k];
+      }
+      log__(d * inv(c1.getRotation()), p + W01X*n, n);
+      log__(e * inv(d), p + W12X*n, n);
+      log__(c2.getRotation() * inv(e), p + W23X*n, n);
+    }
+    valid_[f] = 1;
+  }
+
+  // Rotation vector of q, taken the short way round like cn() does, into w[0], w[stride], w[2*stride]
+  static void log__(Quat q, float* w, const int stride) {
+    q = cn(q);
+    const double s = std::sqrt(q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    const double k = s > 0 ? 2 * std::atan2(s, q[0]) / s : 0;
+    for (int i = 0; i < 3; ++i) {
+      w[i * stride] = q[i+1] * k;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+#include <stdexcept>
+
+#ifdef _WIN32
+#   ifndef NOMINMAX
+#       define NOMINMAX                                     // keeps std::min and std::max usable in the headers that include this one
+#   endif
+#   ifndef WIN32_LEAN_AND_MEAN
+#       define WIN32_LEAN_AND_MEAN
+#   endif
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+
+// Read only memory mapping of a whole file. The contents stay valid until the
+// MappedFile is destroyed. Throws runtime_error if the file cannot be mapped.
+class MappedFile {
+public:
+  explicit MappedFile(const char filename[]) : data_(NULL), size_(0) {
+#ifdef _WIN32
+    file_ = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file_ == INVALID_HANDLE_VALUE)
+      throw std::runtime_error(std::string("Cannot open file ") + filename);
+    LARGE_INTEGER size;
+    GetFileSizeEx(file_, &size);
+    size_ = (std::size_t)size.QuadPart;
+    mapping_ = size_ ? CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    if (mapping_)
+      data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (size_ && !data_) {
+      close__();
+      throw std::runtime_error(std::string("Cannot map file ") + filename);
+    }
+#else
+    fd_ = open(filename, O_RDONLY);
+    if (fd_ < 0)
+      throw std::runtime_error(std::string("Cannot open file ") + filename);
+    struct stat st;
+    fstat(fd_, &st);
+    size_ = st.st_size;
+    if (size_) {
+      void* p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (p == MAP_FAILED) {
+        close__();
+        throw std::runtime_error(std::string("Cannot map file ") + filename);
+      }
+      data_ = static_cast<const char*>(p);
+      madvise(p, size_, MADV_SEQUENTIAL);
+    }
+#endif
+  }
+
+  ~MappedFile() {
+    close__();
+  }
+
+  const char* data() const {
+    return data_;
+  }
+
+  std::size_t size() const {
+    return size_;
+  }
+
+private:
+  const char* data_;
+  std::size_t size_;
+#ifdef _WIN32
+  HANDLE file_, mapping_;
+#else
+  int fd_;
+#endif
+
+  MappedFile(const MappedFile&);
+  MappedFile& operator = (const MappedFile&);
+
+  void close__() {
+#ifdef _WIN32
+    if (data_)
+      UnmapViewOfFile(data_);
+    if (mapping_)
+      CloseHandle(mapping_);
+    CloseHandle(file_);
+#else
+    if (data_)
+      munmap(const_cast<char*>(data_), size_);
+    close(fd_);
+#endif
+    data_ = NULL;
+  }
+};
+
+// Read-write mapping of a file created with a given size, one window at a time, so
+// files larger than the address space (or RAM) can be written piecewise. Written pages
+// go back to the file as the OS sees fit, and stay in the file once the window is
+// unmapped. Throws runtime_error if the file cannot be created or mapped.
+class WritableMappedFile {
+public:
+  WritableMappedFile(const char filename[], const std::size_t size) : filename_(filename), window_(NULL), windowSize_(0), size_(size) {
+#ifdef _WIN32
+    file_ = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE)
+      throw std::runtime_error(std::string("Cannot create file ") + filename);
+    LARGE_INTEGER s;
+    s.QuadPart = size;
+    mapping_ = size ? CreateFileMappingA(file_, NULL, PAGE_READWRITE, s.HighPart, s.LowPart, NULL) : NULL;
+    if (size && !mapping_) {
+      close__();
+      throw std::runtime_error(std::string("Cannot map file ") + filename);
+    }
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    granularity_ = info.dwAllocationGranularity;
+#else
+    fd_ = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+      throw std::runtime_error(std::string("Cannot create file ") + filename);
+    if (ftruncate(fd_, size) != 0) {
+      close__();
+      throw std::runtime_error(std::string("Cannot resize file ") + filename);
+    }
+    granularity_ = sysconf(_SC_PAGESIZE);
+#endif
+  }
+
+  ~WritableMappedFile() {
+    close__();
+  }
+
+  std::size_t size() const {
+    return size_;
+  }
+
+  // Maps bytes [offset, offset + length) of the file, unmapping the previous window,
+  // and returns a pointer to the byte at offset
+  char* map(const std::size_t offset, const std::size_t length) {
+    unmap();
+    if (length == 0)
+      return NULL;
+    const std::size_t start = offset / granularity_ * granularity_;
+    windowSize_ = offset + length - start;
+#ifdef _WIN32
+    void* p = MapViewOfFile(mapping_, FILE_MAP_WRITE, (DWORD)((unsigned long long)start >> 32), (DWORD)start, windowSize_);
+    if (!p)
+      throw std::runtime_error(std::string("Cannot map file ") + filename_);
+#else
+    void* p = mmap(NULL, windowSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, start);
+    if (p == MAP_FAILED)
+      throw std::runtime_error(std::string("Cannot map file ") + filename_);
+#endif
+    window_ = static_cast<char*>(p);
+    return window_ + (offset - start);
+  }
+
+  void unmap() {
+    if (!window_)
+      return;
+#ifdef _WIN32
+    UnmapViewOfFile(window_);
+#else
+    munmap(window_, windowSize_);
+#endif
+    window_ = NULL;
+  }
+
+private:
+  std::string filename_;
+  char* window_;
+  std::size_t windowSize_, size_, granularity_;
+#ifdef _WIN32
+  HANDLE file_, mapping_;
+#else
+  int fd_;
+#endif
+
+  WritableMappedFile(const WritableMappedFile&);
+  WritableMappedFile& operator = (const WritableMappedFile&);
+
+  void close__() {
+    unmap();
+#ifdef _WIN32
+    if (mapping_)
+      CloseHandle(mapping_);
+    CloseHandle(file_);
+#else
+    close(fd_);
+#endif
+  }
+};
+
+#endif
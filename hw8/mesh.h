@@ -4,86 +4,268 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
 #include <utility>
+#include <string>
+#include <stdexcept>
+#include <cassert>
+#include <cmath>
+#include <cstring>
 
 #include "cvec.h"
+#include "threadpool.h"
+#include "mappedfile.h"
+#include "meshimport.h"
+#include "meshcodec.h"
 
+// Half-edge mesh stored as a structure of arrays.
+//
+// Every face owns a contiguous range of halfedges [fhalfedge_[f], fhalfedge_[f+1]),
+// one per corner, in counter clockwise order. Halfedge h starts at vertex hvertex_[h],
+// next_[h] is the following halfedge of the same face and twin_[h] is the opposite
+// halfedge in the neighbouring face (-1 on a boundary). All indices are plain ints,
+// so nothing is packed and no tri/quad test is needed to walk the connectivity.
+//
+// The connectivity is immutable and shared between copies of a mesh; only the
+// positions and normals belong to each Mesh. Subdividing a topology caches the
+// refined topology, so refining a mesh whose positions changed but whose
+// connectivity did not only computes new positions.
 class Mesh {
+  friend class StreamingSubdivider;                         // reads the topology and writes the binary format
+
   typedef int vertex_index;
   typedef int edge_index;
   typedef int face_index;
+  typedef int halfedge_index;
 
-  struct face_t {
-    Cvec <int, 4> vertex_;                               
-    // this will be either a tri or a quad (face_t::vertex[3] == -1  => this is a tri)
-    Cvec <int, 4> edge_;
-  };
-  struct vertex_t {
-    Cvec3 position_;
-    Cvec3 normal_;
-    int halfedge_;
+  // One-ring of every vertex in compressed sparse row form: vertex v has the entries
+  // [offset_[v], offset_[v+1]), each a neighbour and the face of the halfedge from v to it
+  struct adjacency_t {
+    std::vector <int> offset_;
+    std::vector <vertex_index> vertex_;
+    std::vector <face_index> face_;
   };
-  struct edge_t {
-    Cvec <int, 2> halfedge_;
+
+  struct topology_t {
+    // per halfedge
+    std::vector <halfedge_index> next_;
+    std::vector <halfedge_index> twin_;
+    std::vector <vertex_index> hvertex_;
+    std::vector <face_index> hface_;
+    std::vector <edge_index> hedge_;
+
+    // per face (getNumFaces()+1 offsets), per edge, per vertex
+    std::vector <halfedge_index> fhalfedge_;
+    std::vector <halfedge_index> ehalfedge_;                // ehalfedge_[e] is the halfedge edge e was first seen on
+    std::vector <halfedge_index> vhalfedge_;                // one halfedge leaving each vertex
+
+    bool not_manifold_;
+    bool with_boundary_;
+
+    mutable std::shared_ptr <const topology_t> refined_;   // this topology after one subdivision step, once computed
+    mutable std::shared_ptr <const adjacency_t> adjacency_; // built by the first buildAdjacency()
+    mutable std::once_flag adjacency_once_;
+
+    topology_t() : fhalfedge_(1, 0), not_manifold_(false), with_boundary_(false) {}
   };
 
-  std::vector <face_t> face_;
-  std::vector <vertex_t> vertex_;
-  std::vector <edge_t> edge_;
+  std::shared_ptr <const topology_t> topology_;
+
+  std::vector <Cvec3f> position_;
+  std::vector <Cvec3f> normal_;
+  std::vector <Cvec3f> refined_position_;                  // scratch for subdivide__, keeps its capacity across calls
+
+  std::vector <Cvec3f> f_;
+  std::vector <Cvec3f> e_;
+  std::vector <Cvec3f> v_;
 
-  std::vector <Cvec3> f_;
-  std::vector <Cvec3> e_;
-  std::vector <Cvec3> v_;
+  Cvec3f center_;                                           // normalization done by load(): stored position = (file position - center_) / scale_
+  float scale_;
 
-  bool not_manifold_;
-  bool with_boundary_;
+  static Cvec3 d__(const Cvec3f& v) {
+    return Cvec3(v[0], v[1], v[2]);
+  }
+  static Cvec3f f__(const Cvec3& v) {
+    return Cvec3f(v[0], v[1], v[2]);
+  }
 
   int fn__(const int i) const {
-    return face_[i].vertex_[3] == -1 ? 3 : 4;
-  }
-  void init_topology__() {
-    std::map <std::pair <int, int>, Cvec <int, 2> > E;
-    for (std::size_t i = 0; i < face_.size(); ++i) {
-      const int n = fn__(i);
-      for (int j = 0; j < n; ++j) {
-        const int vj = i | (j<<28);
-        const int k = (j+1) % n;
-        std::pair <int, int> e(face_[i].vertex_[j], face_[i].vertex_[k]);
-        if (e.first < e.second) {
-          const int t = e.first;
-          e.first = e.second;
-          e.second = t;
-        }
-        if (E.find(e) == E.end()) {
-          E[e] = Cvec <int, 2> (vj, -1);
+    return topology_->fhalfedge_[i+1] - topology_->fhalfedge_[i];
+  }
+  // links the halfedges of every face into a cycle and records their face
+  static void init_faces__(topology_t& t) {
+    t.next_.resize(t.hvertex_.size());
+    t.hface_.resize(t.hvertex_.size());
+    for (std::size_t i = 0; i + 1 < t.fhalfedge_.size(); ++i) {
+      for (int h = t.fhalfedge_[i]; h < t.fhalfedge_[i+1]; ++h) {
+        t.next_[h] = h+1;
+        t.hface_[h] = i;
+      }
+      t.next_[t.fhalfedge_[i+1]-1] = t.fhalfedge_[i];
+    }
+  }
+  // Matches every halfedge with its twin in linear time: two stable counting sorts,
+  // by the larger endpoint and then by the smaller one, bucket the halfedges by their
+  // smaller endpoint with each bucket ordered by the larger, so the halfedges of an
+  // edge are adjacent and are paired up in one scan. Edges are numbered in the order
+  // of their lowest halfedge. Sets not_manifold_ if an edge has more than two
+  // halfedges or two halfedges running the same way, and with_boundary_ if an edge
+  // has one.
+  static void init_topology__(topology_t& t) {
+    ThreadPool& pool = getThreadPool();
+    const std::vector <int>& next_ = t.next_;
+    const std::vector <int>& hvertex_ = t.hvertex_;
+    std::vector <int>& twin_ = t.twin_;
+    std::vector <int>& hedge_ = t.hedge_;
+    std::vector <int>& ehalfedge_ = t.ehalfedge_;
+    const int nh = hvertex_.size(), nv = t.vhalfedge_.size();
+    std::vector <int> offset(nv+1, 0), bucket(nh);
+    {
+      std::vector <int> fill(nv+1, 0), byLarger(nh);
+      for (int h = 0; h < nh; ++h) {
+        ++fill[std::max(hvertex_[h], hvertex_[next_[h]]) + 1];
+        ++offset[std::min(hvertex_[h], hvertex_[next_[h]]) + 1];
+      }
+      for (int v = 0; v < nv; ++v) {
+        fill[v+1] += fill[v];
+        offset[v+1] += offset[v];
+      }
+      for (int h = 0; h < nh; ++h) {
+        byLarger[fill[std::max(hvertex_[h], hvertex_[next_[h]])]++] = h;
+      }
+      std::copy(offset.begin(), offset.end() - 1, fill.begin());
+      for (int i = 0; i < nh; ++i) {
+        const int h = byLarger[i];
+        bucket[fill[std::min(hvertex_[h], hvertex_[next_[h]])]++] = h;
+      }
+    }
+
+    std::atomic <bool> not_manifold(false), with_boundary(false);
+    twin_.assign(nh, -1);
+    pool.parallelFor(nv, [&](int, int begin, int end) {
+      for (int v = begin; v < end; ++v) {
+        int* const b = &bucket[0] + offset[v];
+        const int n = offset[v+1] - offset[v];
+        for (int i = 0, j; i < n; i = j) {
+          const int o = std::max(hvertex_[b[i]], hvertex_[next_[b[i]]]);
+          for (j = i+1; j < n && std::max(hvertex_[b[j]], hvertex_[next_[b[j]]]) == o; ++j) {}
+          if (j - i >= 2) {
+            twin_[b[i]] = b[i+1];
+            twin_[b[i+1]] = b[i];
+            if (j - i > 2 || hvertex_[b[i]] == hvertex_[b[i+1]])
+              not_manifold = true;
+          }
         }
-        else {
-          Cvec <int, 2>& v = E[e];
-          if (v[1] != -1)
-            not_manifold_ = true;
+      }
+    });
 
-          v[1] = vj;
+    std::vector <int> count(pool.getNumChunks(nh) + 1, 0);
+    pool.parallelFor(nh, [&](int c, int begin, int end) {
+      for (int h = begin; h < end; ++h) {
+        if (twin_[h] == -1)
+          with_boundary = true;
+        count[c+1] += twin_[h] == -1 || h < twin_[h];
+      }
+    });
+    for (std::size_t c = 1; c < count.size(); ++c) {
+      count[c] += count[c-1];
+    }
+    hedge_.resize(nh);
+    ehalfedge_.resize(count.back());
+    pool.parallelFor(nh, [&](int c, int begin, int end) {
+      for (int h = begin, e = count[c]; h < end; ++h) {
+        if (twin_[h] == -1 || h < twin_[h]) {
+          ehalfedge_[e] = h;
+          hedge_[h] = e;
+          if (twin_[h] != -1)
+            hedge_[twin_[h]] = e;
+          ++e;
         }
       }
+    });
+    t.not_manifold_ = not_manifold;
+    t.with_boundary_ = with_boundary;
+  }
+  void resize__() {
+    v_.resize(position_.size());
+    f_.resize(getNumFaces());
+    e_.resize(getNumEdges());
+  }
+  // FNV-1a over the vertex count and the face vertex lists
+  static unsigned long long hash__(const topology_t& t) {
+    unsigned long long h = 14695981039346656037ULL;
+    const int nv = t.vhalfedge_.size();
+    const int* const data[3] = {&nv, t.fhalfedge_.empty() ? NULL : &t.fhalfedge_[0], t.hvertex_.empty() ? NULL : &t.hvertex_[0]};
+    const std::size_t size[3] = {1, t.fhalfedge_.size(), t.hvertex_.size()};
+    for (int k = 0; k < 3; ++k) {
+      for (std::size_t i = 0; i < size[k]; ++i) {
+        h = (h ^ (unsigned)data[k][i]) * 1099511628211ULL;
+      }
     }
-    edge_.resize(E.size());
-    int e = 0;
-    for (std::map <std::pair <int, int>, Cvec <int, 2> >::iterator i = E.begin(); i != E.end(); ++i, ++e) {
-      edge_[e].halfedge_ = i->second;
-      for (int j = 0; j < 2; ++j) {
-        if (i->second[j] != -1)
-          face_[i->second[j] & ((1<<28)-1)].edge_[i->second[j] >> 28] = e | (j<<28);
+    return h;
+  }
+  // Returns the shared copy of t: meshes loaded with identical connectivity use one
+  // topology_t, keyed on hash__, and with it one chain of cached refinements. Entries
+  // whose topology is gone are swept whenever the cache has doubled since the last
+  // sweep, so it stays within twice the number of live topologies.
+  static std::shared_ptr <const topology_t> share__(const std::shared_ptr <topology_t>& t) {
+    typedef std::map <unsigned long long, std::weak_ptr <const topology_t> > cache_t;
+    static std::mutex mutex;
+    static cache_t cache;
+    static std::size_t sweep_at = 16;
+    const unsigned long long key = hash__(*t);
+    std::lock_guard <std::mutex> lock(mutex);
+    std::shared_ptr <const topology_t> cached = cache[key].lock();
+    if (cached && cached->vhalfedge_.size() == t->vhalfedge_.size() &&
+        cached->fhalfedge_ == t->fhalfedge_ && cached->hvertex_ == t->hvertex_)
+      return cached;
+    cache[key] = t;
+    if (cache.size() >= sweep_at) {
+      for (cache_t::iterator i = cache.begin(); i != cache.end(); ) {
+        if (i->second.expired())
+          cache.erase(i++);
         else
-          with_boundary_ = true;
+          ++i;
       }
+      sweep_at = std::max(2 * cache.size(), (std::size_t)16);
     }
+    return t;
   }
-  void resize__() {
-    v_.resize(vertex_.size());
-    f_.resize(face_.size());
-    e_.resize(edge_.size());
+  // Centers the positions on their centroid and scales them to unit RMS distance,
+  // with one pass for both sums and one pass to apply them
+  void normalize__() {
+    ThreadPool& pool = getThreadPool();
+    const int nv = position_.size();
+    std::vector <Cvec3> sum(pool.getNumChunks(nv), Cvec3(0));
+    std::vector <double> sum2(sum.size(), 0);
+    pool.parallelFor(nv, [&](int c, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        const Cvec3 p = d__(position_[i]);
+        sum[c] += p;
+        sum2[c] += dot(p, p);
+      }
+    });
+    Cvec3 center(0);
+    double rms = 0;
+    for (std::size_t c = 0; c < sum.size(); ++c) {
+      center += sum[c];
+      rms += sum2[c];
+    }
+    center /= nv;
+    rms = std::sqrt(std::max(0.0, rms / nv - dot(center, center)));  // E|p - c|^2 = E|p|^2 - |c|^2
+    const double s = 1/rms;
+    pool.parallelFor(nv, [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        position_[i] = f__((d__(position_[i]) - center) * s);
+      }
+    });
+    center_ = f__(center);
+    scale_ = rms;
   }
-  void load__(const char filename[]) {
+  void load_text__(const char filename[]) {
     using namespace std;
 
     ifstream f(filename);
@@ -96,146 +278,743 @@ class Mesh {
 
     int nv, nt, nq;  // number of: vertices, tris, quads
     f >> nv >> nt >> nq;
-    vertex_.resize(nv);
-    face_.resize(nt+nq);
+    std::shared_ptr <topology_t> t(new topology_t());
+    std::vector <int>& fhalfedge_ = t->fhalfedge_;
+    std::vector <int>& hvertex_ = t->hvertex_;
+    position_.resize(nv);
+    fhalfedge_.resize(nt+nq+1);
+    hvertex_.resize(3*nt+4*nq);
     for (int i = 0; i < nv; ++i) {
-      f >> vertex_[i].position_[0] >> vertex_[i].position_[1] >> vertex_[i].position_[2];
+      f >> position_[i][0] >> position_[i][1] >> position_[i][2];
     }
     for (int i = 0; i < nt; ++i) {
-      f >> face_[i].vertex_[0] >> face_[i].vertex_[1] >> face_[i].vertex_[2];
-      face_[i].vertex_[3] = -1;
+      fhalfedge_[i] = 3*i;
+      f >> hvertex_[3*i] >> hvertex_[3*i+1] >> hvertex_[3*i+2];
     }
     for (int i = 0; i < nq; ++i) {
-      f >> face_[nt+i].vertex_[0] >> face_[nt+i].vertex_[1] >> face_[nt+i].vertex_[2] >> face_[nt+i].vertex_[3];
+      fhalfedge_[nt+i] = 3*nt + 4*i;
+      f >> hvertex_[3*nt+4*i] >> hvertex_[3*nt+4*i+1] >> hvertex_[3*nt+4*i+2] >> hvertex_[3*nt+4*i+3];
     }
-    for (int i = 0; i < nt; ++i) {
-      for (int j = 0; j < 3; ++j) {
-        vertex_[face_[i].vertex_[j]].halfedge_ = i | (j<<28);
-      }
+    fhalfedge_[nt+nq] = hvertex_.size();
+    build_topology__(*t, nv);
+    topology_ = share__(t);
+    normalize__();
+    finish_load__();
+  }
+  // derives all the connectivity of t from fhalfedge_ and hvertex_
+  static void build_topology__(topology_t& t, const int nv) {
+    t.vhalfedge_.resize(nv);
+    for (std::size_t h = 0; h < t.hvertex_.size(); ++h) {
+      t.vhalfedge_[t.hvertex_[h]] = h;
     }
-    for (int i = 0; i < nq; ++i) {
-      for (int j = 0; j < 4; ++j) {
-        vertex_[face_[nt+i].vertex_[j]].halfedge_ = i | (j<<28);
-      }
+    init_faces__(t);
+    init_topology__(t);
+  }
+  // true if fhalfedge_ and hvertex_ describe faces of at least 3 vertices in [0, nv)
+  static bool valid_faces__(const topology_t& t, const int nv) {
+    const int nf = t.fhalfedge_.size() - 1;
+    bool valid = t.fhalfedge_[0] == 0 && t.fhalfedge_[nf] == (int)t.hvertex_.size();
+    for (int i = 0; valid && i < nf; ++i) {
+      valid = t.fhalfedge_[i+1] - t.fhalfedge_[i] >= 3;
+    }
+    for (std::size_t h = 0; valid && h < t.hvertex_.size(); ++h) {
+      valid = t.hvertex_[h] >= 0 && t.hvertex_[h] < nv;
+    }
+    return valid;
+  }
+  // true if every value of a is in [lo, hi)
+  static bool in_range__(const std::vector <int>& a, const int lo, const int hi) {
+    for (std::size_t i = 0; i < a.size(); ++i) {
+      if (a[i] < lo || a[i] >= hi)
+        return false;
     }
-    init_topology__();
+    return true;
+  }
+  // true if the stored connectivity of t only refers to elements that exist, so that a
+  // corrupt file cannot make it index out of bounds
+  static bool valid_connectivity__(const topology_t& t, const int numEdges) {
+    const int nh = t.hvertex_.size(), nf = t.fhalfedge_.size() - 1;
+    // build_topology__ leaves vhalfedge_ at 0 for unused vertices, even without halfedges
+    return in_range__(t.next_, 0, nh) && in_range__(t.twin_, -1, nh) && in_range__(t.hface_, 0, nf) &&
+           in_range__(t.hedge_, 0, numEdges) && in_range__(t.ehalfedge_, 0, nh) &&
+           in_range__(t.vhalfedge_, 0, std::max(nh, 1));
+  }
+  void build__(const std::vector <Cvec3f>& positions, const std::vector <int>& offsets, const std::vector <int>& indices) {
+    std::shared_ptr <topology_t> t(new topology_t());
+    t->fhalfedge_ = offsets;
+    t->hvertex_ = indices;
+    if (offsets.empty() || !valid_faces__(*t, positions.size()))
+      throw std::runtime_error("Invalid face list");
+    build_topology__(*t, positions.size());
+    topology_ = share__(t);
+    position_ = positions;
+    center_ = Cvec3f(0);
+    scale_ = 1;
+    finish_load__();
+  }
+  void finish_load__() {
     resize__();
-    Cvec3 center(0);
-    for (std::size_t i = 0; i < vertex_.size(); ++i) {
-      center += vertex_[i].position_;
+    clear_normals__();
+  }
+  // marks every normal as not set, see Vertex::getNormal() and save_compressed__
+  void clear_normals__() {
+    normal_.assign(position_.size(), Cvec3f(0));
+    for (std::size_t i = 0; i < normal_.size(); ++i) {
+      normal_[i][0] = -5e37;
     }
-    center /= vertex_.size();
-    for (std::size_t i = 0; i < vertex_.size(); ++i) {
-      vertex_[i].position_ -= center;
+  }
+
+  // Binary mesh file: a binary_header_t followed by little endian 32 bit arrays,
+  //   position      float[3*numVertices]    (already normalized)
+  //   fhalfedge_    int[numFaces+1]
+  //   hvertex_      int[numHalfedges]
+  // and, if BINARY_CONNECTIVITY is set,
+  //   next_, twin_, hface_, hedge_    int[numHalfedges] each
+  //   ehalfedge_    int[numEdges]
+  //   vhalfedge_    int[numVertices]
+  // Without the connectivity arrays it is rebuilt by init_topology__ on load.
+  enum {
+    BINARY_VERSION = 1,
+    BINARY_CONNECTIVITY = 1,
+    BINARY_NOT_MANIFOLD = 2,
+    BINARY_WITH_BOUNDARY = 4
+  };
+  struct binary_header_t {
+    char magic[8];                                          // "MESHBIN" and a terminating zero
+    unsigned version;
+    unsigned flags;
+    int numVertices, numFaces, numHalfedges, numEdges;
+    float center[3];                                        // original position = position * scale + center
+    float scale;
+    unsigned reserved[4];
+  };
+
+  static const char* binary_magic__() {
+    return "MESHBIN";
+  }
+  static bool is_binary__(const MappedFile& file) {
+    return file.size() >= sizeof(binary_header_t) && std::memcmp(file.data(), binary_magic__(), 8) == 0;
+  }
+  // copies n values of type T from the mapped file, advancing offset
+  template <typename T>
+  static void read_array__(const MappedFile& file, std::size_t& offset, std::vector <T>& out, const std::size_t n) {
+    if (file.size() - offset < n * sizeof(T))
+      throw std::runtime_error("Binary mesh file is truncated");
+    out.resize(n);
+    if (n)
+      std::memcpy(&out[0], file.data() + offset, n * sizeof(T));
+    offset += n * sizeof(T);
+  }
+  template <typename T>
+  static void write_array__(std::ofstream& f, const std::vector <T>& in) {
+    if (!in.empty())
+      f.write(reinterpret_cast<const char*>(&in[0]), in.size() * sizeof(T));
+  }
+  void load_binary__(const MappedFile& file, const char filename[]) {
+    binary_header_t header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.version != BINARY_VERSION)
+      throw std::runtime_error(std::string("Unsupported binary mesh version in ") + filename);
+    if (header.numVertices < 0 || header.numFaces < 0 || header.numHalfedges < 0 || header.numEdges < 0)
+      throw std::runtime_error(std::string("Corrupt binary mesh file ") + filename);
+
+    std::shared_ptr <topology_t> t(new topology_t());
+    std::size_t offset = sizeof(header);
+    read_array__(file, offset, position_, header.numVertices);
+    read_array__(file, offset, t->fhalfedge_, header.numFaces + 1);
+    read_array__(file, offset, t->hvertex_, header.numHalfedges);
+    if (!valid_faces__(*t, header.numVertices))
+      throw std::runtime_error(std::string("Corrupt binary mesh file ") + filename);
+
+    if (header.flags & BINARY_CONNECTIVITY) {
+      read_array__(file, offset, t->next_, header.numHalfedges);
+      read_array__(file, offset, t->twin_, header.numHalfedges);
+      read_array__(file, offset, t->hface_, header.numHalfedges);
+      read_array__(file, offset, t->hedge_, header.numHalfedges);
+      read_array__(file, offset, t->ehalfedge_, header.numEdges);
+      read_array__(file, offset, t->vhalfedge_, header.numVertices);
+      if (!valid_connectivity__(*t, header.numEdges))
+        throw std::runtime_error(std::string("Corrupt binary mesh file ") + filename);
+      t->not_manifold_ = (header.flags & BINARY_NOT_MANIFOLD) != 0;
+      t->with_boundary_ = (header.flags & BINARY_WITH_BOUNDARY) != 0;
     }
-    double rms = 0;
-    for (std::size_t i = 0; i < vertex_.size(); ++i) {
-      rms += dot(vertex_[i].position_, vertex_[i].position_);
+    else {
+      build_topology__(*t, header.numVertices);
     }
-    rms = std::sqrt(rms / vertex_.size());
-    for (std::size_t i = 0; i < vertex_.size(); ++i) {
-      vertex_[i].position_ *= 1/rms;
+    topology_ = share__(t);
+    center_ = Cvec3f(header.center[0], header.center[1], header.center[2]);
+    scale_ = header.scale;
+    finish_load__();
+  }
+  // Wavefront OBJ and PLY files, parsed in parallel by MeshImporter
+  void load_import__(const MappedFile& file, const char filename[]) {
+    std::shared_ptr <topology_t> t(new topology_t());
+    std::vector <Cvec3f> positions;
+    if (MeshImporter::isPly(file.data(), file.size()))
+      MeshImporter::readPly(file.data(), file.size(), filename, positions, t->fhalfedge_, t->hvertex_);
+    else
+      MeshImporter::readObj(file.data(), file.size(), filename, positions, t->fhalfedge_, t->hvertex_);
+    if (!valid_faces__(*t, positions.size()))
+      throw std::runtime_error(std::string("Invalid face list in ") + filename);
+    build_topology__(*t, positions.size());
+    topology_ = share__(t);
+    position_.swap(positions);
+    normalize__();
+    finish_load__();
+  }
+  // Compressed files, decoded by MeshCodec straight from the mapping
+  void load_compressed__(const MappedFile& file, const char filename[]) {
+    MeshCodec codec;
+    codec.attach(file.data(), file.size(), filename);
+    std::shared_ptr <topology_t> t(new topology_t());
+    t->fhalfedge_.resize(codec.getNumFaces() + 1);
+    t->hvertex_.resize(codec.getNumCorners());
+    position_.resize(codec.getNumVertices());
+    try {
+      codec.decodeFaces(&t->fhalfedge_[0], t->hvertex_.empty() ? NULL : &t->hvertex_[0]);
     }
-    for (std::size_t i = 0; i < vertex_.size(); ++i) {
-      vertex_[i].normal_[0] = -5e37;
+    catch (const std::runtime_error&) {
+      throw std::runtime_error(std::string("Corrupt compressed mesh file ") + filename);
     }
+    codec.decodePositions(getPositions());
+    if (!valid_faces__(*t, position_.size()))
+      throw std::runtime_error(std::string("Invalid face list in ") + filename);
+    build_topology__(*t, position_.size());
+    topology_ = share__(t);
+    center_ = codec.getCenter();
+    scale_ = codec.getScale();
+    finish_load__();
+    if (codec.hasNormals() && !normal_.empty())
+      codec.decodeNormals(&normal_[0]);
+  }
+  void load__(const char filename[]) {
+    const MappedFile file(filename);
+    if (is_binary__(file))
+      load_binary__(file, filename);
+    else if (MeshCodec::isCompressed(file.data(), file.size()))
+      load_compressed__(file, filename);
+    else if (MeshImporter::isPly(file.data(), file.size()) || MeshImporter::isObj(filename))
+      load_import__(file, filename);
+    else
+      load_text__(filename);
   }
+  void save__(const char filename[], const bool withConnectivity) const {
+    const topology_t& t = *topology_;
+    binary_header_t header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, binary_magic__(), 8);
+    header.version = BINARY_VERSION;
+    header.flags = (withConnectivity ? BINARY_CONNECTIVITY : 0) |
+                   (t.not_manifold_ ? BINARY_NOT_MANIFOLD : 0) | (t.with_boundary_ ? BINARY_WITH_BOUNDARY : 0);
+    header.numVertices = getNumVertices();
+    header.numFaces = getNumFaces();
+    header.numHalfedges = t.hvertex_.size();
+    header.numEdges = getNumEdges();
+    for (int i = 0; i < 3; ++i) {
+      header.center[i] = center_[i];
+    }
+    header.scale = scale_;
+
+    std::ofstream f(filename, std::ios::binary);
+    if (!f) {
+      throw std::runtime_error(std::string("Cannot open file ") + filename);
+    }
+    f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write_array__(f, position_);
+    write_array__(f, t.fhalfedge_);
+    write_array__(f, t.hvertex_);
+    if (withConnectivity) {
+      write_array__(f, t.next_);
+      write_array__(f, t.twin_);
+      write_array__(f, t.hface_);
+      write_array__(f, t.hedge_);
+      write_array__(f, t.ehalfedge_);
+      write_array__(f, t.vhalfedge_);
+    }
+    if (!f)
+      throw std::runtime_error(std::string("Cannot write file ") + filename);
+  }
+  // the normals go in if every vertex has one
+  void save_compressed__(const char filename[], const int positionBits) const {
+    bool normals = !normal_.empty();
+    for (std::size_t i = 0; normals && i < normal_.size(); ++i) {
+      normals = normal_[i][0] > -1e37;
+    }
+    MeshCodec codec;
+    codec.encode(getNumVertices(), getPositions(), normals ? &normal_[0] : NULL, getNumFaces(),
+                 getFaceVertexOffsets(), getFaceVertexIndices(), center_, scale_, positionBits);
+    codec.save(filename);
+  }
+  // Every halfedge h (from vertex a, in face f, preceded by halfedge p) becomes the quad
+  //   [a, edge point of h, face point of f, edge point of p]
+  // with halfedges 4h .. 4h+3, so the refined connectivity follows from the old one by
+  // index arithmetic alone and every face can be emitted independently.
+  static std::shared_ptr <const topology_t> refine__(const topology_t& t) {
+    const std::vector <int>& next_ = t.next_;
+    const std::vector <int>& twin_ = t.twin_;
+    const std::vector <int>& hvertex_ = t.hvertex_;
+    const std::vector <int>& hedge_ = t.hedge_;
+    const std::vector <int>& fhalfedge_ = t.fhalfedge_;
+    const std::vector <int>& ehalfedge_ = t.ehalfedge_;
+    const std::vector <int>& vhalfedge_ = t.vhalfedge_;
+    const int nv = vhalfedge_.size(), ne = ehalfedge_.size(), nf = fhalfedge_.size() - 1, nh = hvertex_.size();
+    std::shared_ptr <topology_t> r(new topology_t());
+    std::vector <int>& next = r->next_;
+    std::vector <int>& twin = r->twin_;
+    std::vector <int>& hvertex = r->hvertex_;
+    std::vector <int>& hface = r->hface_;
+    std::vector <int>& hedge = r->hedge_;
+    std::vector <int>& fhalfedge = r->fhalfedge_;
+    std::vector <int>& ehalfedge = r->ehalfedge_;
+    std::vector <int>& vhalfedge = r->vhalfedge_;
+    next.resize(4*nh);
+    twin.resize(4*nh);
+    hvertex.resize(4*nh);
+    hface.resize(4*nh);
+    hedge.resize(4*nh);
+    fhalfedge.resize(nh+1);
+    ehalfedge.resize(2*ne + nh);
+    vhalfedge.resize(nv + ne + nf);
+    ThreadPool& pool = getThreadPool();
+    pool.parallelFor(nv, [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        vhalfedge[i] = 4*vhalfedge_[i];                                       // v-vertices
+      }
+    });
+    pool.parallelFor(ne, [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        vhalfedge[nv+i] = 4*ehalfedge_[i] + 1;                                // e-vertices
+        ehalfedge[2*i] = 4*ehalfedge_[i];
+        ehalfedge[2*i+1] = 4*next_[ehalfedge_[i]] + 3;
+      }
+    });
+    pool.parallelFor(nf, [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        vhalfedge[nv+ne+i] = 4*fhalfedge_[i] + 2;                             // f-vertices
+        for (int h = fhalfedge_[i], p = fhalfedge_[i+1]-1; h < fhalfedge_[i+1]; p = h++) {
+          const int q = 4*h;
+          fhalfedge[h] = q;
+          hvertex[q+0] = hvertex_[h];                                         // the v-vertex
+          hvertex[q+1] = nv + hedge_[h];
+          hvertex[q+2] = nv + ne + i;                                         // the f-vertex
+          hvertex[q+3] = nv + hedge_[p];
+          twin[q+0] = 4*next_[twin_[h]] + 3;
+          twin[q+1] = 4*next_[h] + 2;
+          twin[q+2] = 4*p + 1;
+          twin[q+3] = 4*twin_[p];
+          hedge[q+0] = 2*hedge_[h] + (ehalfedge_[hedge_[h]] != h);           // each old edge splits in two
+          hedge[q+1] = 2*ne + h;                                              // one new edge per old halfedge
+          hedge[q+2] = 2*ne + p;
+          hedge[q+3] = 2*hedge_[p] + (ehalfedge_[hedge_[p]] == p);
+          ehalfedge[2*ne + h] = q+1;
+          for (int j = 0; j < 4; ++j) {
+            next[q+j] = q + ((j+1) & 3);
+            hface[q+j] = h;
+          }
+        }
+      }
+    });
+    fhalfedge[nh] = 4*nh;
+    return r;
+  }
+  // Entries are in VertexIterator order wherever the halfedges around a vertex form one
+  // closed fan. Other vertices list their outgoing halfedges in order, then a face -1
+  // entry for each neighbour only reached through a boundary halfedge into the vertex.
+  static std::shared_ptr <const adjacency_t> adjacency__(const topology_t& t) {
+    const int nv = t.vhalfedge_.size(), nh = t.hvertex_.size();
+    std::shared_ptr <adjacency_t> a(new adjacency_t());
+    std::vector <int> out(nv+1, 0), bucket(nh);                                // outgoing halfedges by vertex
+    for (int h = 0; h < nh; ++h) {
+      ++out[t.hvertex_[h] + 1];
+    }
+    for (int v = 0; v < nv; ++v) {
+      out[v+1] += out[v];
+    }
+    {
+      std::vector <int> fill(out.begin(), out.end() - 1);
+      for (int h = 0; h < nh; ++h) {
+        bucket[fill[t.hvertex_[h]]++] = h;
+      }
+    }
+    a->offset_.assign(nv+1, 0);
+    for (int h = 0; h < nh; ++h) {
+      ++a->offset_[t.hvertex_[h] + 1];
+      if (t.twin_[h] < 0)
+        ++a->offset_[t.hvertex_[t.next_[h]] + 1];
+    }
+    for (int v = 0; v < nv; ++v) {
+      a->offset_[v+1] += a->offset_[v];
+    }
+    a->vertex_.resize(a->offset_[nv]);
+    a->face_.resize(a->offset_[nv]);
+    getThreadPool().parallelFor(nv, [&](int, int begin, int end) {
+      for (int v = begin; v < end; ++v) {
+        int k = a->offset_[v];
+        const int n = out[v+1] - out[v];
+        if (a->offset_[v+1] - k == n && n > 0) {                             // no boundary halfedge ends at v
+          int h = t.vhalfedge_[v], i = 0;
+          do {
+            a->vertex_[k + i] = t.hvertex_[t.next_[h]];
+            a->face_[k + i] = t.hface_[h];
+            h = t.twin_[h] < 0 ? -1 : t.next_[t.twin_[h]];
+          } while (++i < n && h >= 0 && h != t.vhalfedge_[v]);
+          if (i == n && h == t.vhalfedge_[v])
+            continue;                                                         // one closed fan
+        }
+        for (int i = out[v]; i < out[v+1]; ++i) {
+          a->vertex_[k] = t.hvertex_[t.next_[bucket[i]]];
+          a->face_[k++] = t.hface_[bucket[i]];
+        }
+        for (int i = out[v]; i < out[v+1]; ++i) {                             // boundary halfedges into v start at the previous corners
+          int p = bucket[i];
+          while (t.next_[p] != bucket[i]) {
+            p = t.next_[p];
+          }
+          if (t.twin_[p] < 0) {
+            a->vertex_[k] = t.hvertex_[p];
+            a->face_[k++] = -1;
+          }
+        }
+      }
+    });
+    return a;
+  }
+  const adjacency_t& adjacency__() const {
+    assert(topology_->adjacency_ || !"Error: call buildAdjacency() first");
+    return *topology_->adjacency_;
+  }
+
   void subdivide__() {
-    if (not_manifold_)
+    if (topology_->not_manifold_)
       throw std::runtime_error("Subdivision does not support non manifold mesh yet.");
-    if (with_boundary_)
+    if (topology_->with_boundary_)
       throw std::runtime_error("Subdivision does not support mesh with boundaries yet.");
-    std::vector <face_t> f;
-    std::vector <vertex_t> v;
-    std::vector <edge_t> e;
-    std::vector <int> findex;
-    v.resize(v_.size() + e_.size() + f_.size());
-    e.resize(4*edge_.size());
-    f.resize(2*edge_.size());
-    findex.resize(face_.size());
-    for (std::size_t i = 0; i < v_.size(); ++i) {
-      v[i].position_ = v_[i];                                                     // v-vertices
-    }
-    for (std::size_t i = 0; i < e_.size(); ++i) {
-      v[i+v_.size()].position_ = e_[i];                                               // e-vertices
-    }
-    for (std::size_t i = 0; i < f_.size(); ++i) {
-      v[i+v_.size()+e_.size()].position_ = f_[i];                                           // f-vertices
-    }
-    int fi = 0;
-#ifndef NDEBUG
-    for (std::size_t i = 0; i < v.size(); ++i) {
-      v[i].halfedge_ = -1;
+    {
+      static std::mutex mutex;                                                // copies of a mesh may share topology_
+      std::lock_guard <std::mutex> lock(mutex);
+      if (!topology_->refined_)
+        topology_->refined_ = refine__(*topology_);
     }
-#endif
-    for (std::size_t i = 0; i < face_.size(); ++i) {
-      findex[i] = fi;
-      const int n = fn__(i);
-      for (int j = 0; j < n; ++j, ++fi) {
-        const int k = (j+n-1) % n;
-        const int ej = face_[i].edge_[j] & ((1<<28)-1);
-        const int ek = face_[i].edge_[k] & ((1<<28)-1);
-        f[fi].vertex_[0] = face_[i].vertex_[j];                     // the v-vertex
-        f[fi].vertex_[1] = v_.size() + ej;
-        f[fi].vertex_[2] = v_.size() + e_.size() + i;                 // the f-vertex
-        f[fi].vertex_[3] = v_.size() + ek;
-        v[f[fi].vertex_[0]].halfedge_ = fi | (0 << 28);
-        v[f[fi].vertex_[1]].halfedge_ = fi | (1 << 28);
-        v[f[fi].vertex_[2]].halfedge_ = fi | (2 << 28);
-        v[f[fi].vertex_[3]].halfedge_ = fi | (3 << 28);
+    const int nv = v_.size(), ne = e_.size(), nf = f_.size();
+    refined_position_.resize(nv + ne + nf);
+    std::copy(v_.begin(), v_.end(), refined_position_.begin());              // v-vertices
+    std::copy(e_.begin(), e_.end(), refined_position_.begin() + nv);         // e-vertices
+    std::copy(f_.begin(), f_.end(), refined_position_.begin() + nv + ne);    // f-vertices
+    position_.swap(refined_position_);
+    topology_ = topology_->refined_;
+    clear_normals__();
+    resize__();
+  }
+
+  // A face of the mesh and the faces that share a vertex with it, which is all the
+  // limit surface over the face depends on, as flat face lists over local vertices.
+  // Face 0 is the face itself, with its first corner at (u, v) = (0, 0).
+  struct patch_t {
+    std::vector <Cvec3> p;
+    std::vector <int> offset, index;
+
+    int faceSize(const int f) const {
+      return offset[f+1] - offset[f];
+    }
+    int corner(const int f, const int i) const {
+      const int n = faceSize(f);
+      return index[offset[f] + (i % n + n) % n];
+    }
+    // the vertices x, y following the directed edge a -> b in the quad holding it
+    bool opposite(const int a, const int b, int& x, int& y) const {
+      for (int f = 0; f + 1 < (int)offset.size(); ++f) {
+        if (faceSize(f) != 4)
+          continue;
+        for (int i = 0; i < 4; ++i) {
+          if (corner(f, i) == a && corner(f, i+1) == b) {
+            x = corner(f, i+2);
+            y = corner(f, i+3);
+            return true;
+          }
+        }
       }
+      return false;
     }
-    for (std::size_t i = 0; i < edge_.size(); ++i) {
-      const int f0 = edge_[i].halfedge_[0] & ((1<<28)-1);
-      const int f1 = edge_[i].halfedge_[1] & ((1<<28)-1);
-      const int j0 = edge_[i].halfedge_[0] >> 28;
-      const int j1 = edge_[i].halfedge_[1] >> 28;
-      const int n0 = fn__(f0);
-      const int n1 = fn__(f1);
-      const int k0 = (j0+1) % n0;
-      const int k1 = (j1+1) % n1;
-      e[4*i + 0].halfedge_[0] = (findex[f0] + j0) | (0 << 28);
-      e[4*i + 0].halfedge_[1] = (findex[f1] + k1) | (3 << 28);
-      e[4*i + 1].halfedge_[0] = (findex[f0] + j0) | (1 << 28);
-      e[4*i + 1].halfedge_[1] = (findex[f0] + k0) | (2 << 28);
-      e[4*i + 2].halfedge_[0] = (findex[f1] + j1) | (0 << 28);
-      e[4*i + 2].halfedge_[1] = (findex[f0] + k0) | (3 << 28);
-      e[4*i + 3].halfedge_[0] = (findex[f1] + j1) | (1 << 28);
-      e[4*i + 3].halfedge_[1] = (findex[f1] + k1) | (2 << 28);
-      for (std::size_t j = 4*i; j < 4*i+4; ++j) {
-        for (int k = 0; k < 2; ++k) {
-          f[e[j].halfedge_[k] & ((1<<28)-1)].edge_[e[j].halfedge_[k] >> 28] = j | (k<<28);
+    // the number of faces around v, and whether they are all quads
+    int valence(const int v, bool& quads) const {
+      int n = 0;
+      quads = true;
+      for (int f = 0; f + 1 < (int)offset.size(); ++f) {
+        if (std::find(index.begin() + offset[f], index.begin() + offset[f+1], v) != index.begin() + offset[f+1]) {
+          ++n;
+          quads = quads && faceSize(f) == 4;
         }
       }
+      return n;
     }
-#ifndef NDEBUG
-    for (std::size_t i = 0; i < v.size(); ++i) {
-      assert(v[i].halfedge_ != -1);
+  };
+
+  // face f and its one-ring, read off the halfedges
+  patch_t limit_patch__(const int f) const {
+    const topology_t& t = *topology_;
+    std::vector <int> faces(1, f);
+    for (int h = t.fhalfedge_[f]; h < t.fhalfedge_[f+1]; ++h) {
+      int g = h;
+      do {
+        if (std::find(faces.begin(), faces.end(), t.hface_[g]) == faces.end())
+          faces.push_back(t.hface_[g]);
+        g = t.next_[t.twin_[g]];
+      } while (g != h);
     }
-#endif
-    vertex_.swap(v);
-    edge_.swap(e);
-    face_.swap(f);
-    resize__();
+    patch_t r;
+    std::vector <int> global;                                                 // local vertex -> mesh vertex
+    r.offset.push_back(0);
+    for (std::size_t i = 0; i < faces.size(); ++i) {
+      for (int h = t.fhalfedge_[faces[i]]; h < t.fhalfedge_[faces[i]+1]; ++h) {
+        const int v = std::find(global.begin(), global.end(), t.hvertex_[h]) - global.begin();
+        if (v == (int)global.size()) {
+          global.push_back(t.hvertex_[h]);
+          r.p.push_back(d__(position_[t.hvertex_[h]]));
+        }
+        r.index.push_back(v);
+      }
+      r.offset.push_back(r.index.size());
+    }
+    return r;
+  }
+
+  // One Catmull-Clark step over the patch, keeping the sub-quad of face 0 at the given
+  // corner and its own one-ring. Only the points of that ring are needed, and those
+  // only depend on faces of the patch, so the missing faces beyond it do not matter.
+  // The sub-quad starts at the vertex-vertex of the corner, followed by the edge-vertex
+  // towards the next corner.
+  static patch_t refine_limit_patch__(const patch_t& in, const int corner) {
+    const int nv = in.p.size(), nf = in.offset.size() - 1;
+    // edges as (smaller vertex, larger vertex, face), sorted so both faces of an edge are adjacent
+    std::vector <std::pair <std::pair <int, int>, int> > edges;
+    for (int f = 0; f < nf; ++f) {
+      for (int i = 0; i < in.faceSize(f); ++i) {
+        const int a = in.corner(f, i), b = in.corner(f, i+1);
+        edges.push_back(std::make_pair(std::make_pair(std::min(a, b), std::max(a, b)), f));
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+    std::vector <std::pair <int, int> > keys;
+    std::vector <Cvec3> fp(nf, Cvec3(0)), ep, sum(nv, Cvec3(0));
+    std::vector <int> valence(nv, 0);
+    for (int f = 0; f < nf; ++f) {
+      for (int i = 0; i < in.faceSize(f); ++i) {
+        fp[f] += in.p[in.corner(f, i)];
+      }
+      fp[f] /= in.faceSize(f);
+      for (int i = 0; i < in.faceSize(f); ++i) {
+        sum[in.corner(f, i)] += fp[f];
+      }
+    }
+    for (std::size_t i = 0; i < edges.size(); ) {
+      const std::pair <int, int> e = edges[i].first;
+      const bool both = i + 1 < edges.size() && edges[i+1].first == e;
+      const Cvec3 a = in.p[e.first], b = in.p[e.second];
+      keys.push_back(e);
+      ep.push_back(both ? (a + b + fp[edges[i].second] + fp[edges[i+1].second]) / 4 : (a + b) / 2);
+      sum[e.first] += b;
+      sum[e.second] += a;
+      ++valence[e.first];
+      ++valence[e.second];
+      i += both ? 2 : 1;
+    }
+    // vertex-vertices, then edge-vertices, then face-vertices, as in subdivide()
+    std::vector <Cvec3> p(nv);
+    for (int v = 0; v < nv; ++v) {
+      const double n = valence[v];
+      p[v] = n ? in.p[v] * ((n - 2) / n) + sum[v] / (n * n) : in.p[v];
+    }
+    p.insert(p.end(), ep.begin(), ep.end());
+    p.insert(p.end(), fp.begin(), fp.end());
+    const int ne = ep.size();
+    auto edge = [&](const int a, const int b) {
+      return std::lower_bound(keys.begin(), keys.end(), std::make_pair(std::min(a, b), std::max(a, b))) - keys.begin();
+    };
+
+    // every face splits into one quad per corner
+    std::vector <int> quads;
+    int target = -1;
+    for (int f = 0; f < nf; ++f) {
+      for (int i = 0; i < in.faceSize(f); ++i) {
+        if (f == 0 && i == corner)
+          target = quads.size();
+        const int c = in.corner(f, i);
+        quads.push_back(c);
+        quads.push_back(nv + edge(c, in.corner(f, i+1)));
+        quads.push_back(nv + ne + f);
+        quads.push_back(nv + edge(in.corner(f, i-1), c));
+      }
+    }
+
+    // the target quad and every quad sharing a vertex with it, renumbered
+    patch_t r;
+    std::vector <int> local(p.size(), -1);
+    std::vector <int> ring(1, target);
+    for (int q = 0; q < (int)quads.size(); q += 4) {
+      for (int j = 0; j < 4 && q != target; ++j) {
+        if (std::find(quads.begin() + target, quads.begin() + target + 4, quads[q + j]) != quads.begin() + target + 4) {
+          ring.push_back(q);
+          break;
+        }
+      }
+    }
+    r.offset.push_back(0);
+    for (std::size_t i = 0; i < ring.size(); ++i) {
+      for (int j = 0; j < 4; ++j) {
+        int& v = local[quads[ring[i] + j]];
+        if (v < 0) {
+          v = r.p.size();
+          r.p.push_back(p[quads[ring[i] + j]]);
+        }
+        r.index.push_back(v);
+      }
+      r.offset.push_back(r.index.size());
+    }
+    return r;
+  }
+
+  // The 4x4 B-spline control points of face 0 if it is a regular quad, that is one whose
+  // corners all have four quads around them. P[i][j] sits i steps along u and j along v,
+  // with the corners of the face at P[1][1], P[2][1], P[2][2] and P[1][2].
+  static bool limit_control_points__(const patch_t& s, Cvec3 P[4][4]) {
+    if (s.faceSize(0) != 4)
+      return false;
+    const int c0 = s.corner(0, 0), c1 = s.corner(0, 1), c2 = s.corner(0, 2), c3 = s.corner(0, 3);
+    for (int i = 0; i < 4; ++i) {
+      bool quads;
+      if (s.valence(s.corner(0, i), quads) != 4 || !quads)
+        return false;
+    }
+    int g[4][4];
+    g[1][1] = c0; g[2][1] = c1; g[2][2] = c2; g[1][2] = c3;
+    // the neighbours across the four edges, then the four diagonal neighbours
+    const bool ok =
+      s.opposite(c1, c0, g[1][0], g[2][0]) && s.opposite(c2, c1, g[3][1], g[3][2]) &&
+      s.opposite(c3, c2, g[2][3], g[1][3]) && s.opposite(c0, c3, g[0][2], g[0][1]) &&
+      s.opposite(c0, g[0][1], g[0][0], g[1][0]) && s.opposite(c1, g[2][0], g[3][0], g[3][1]) &&
+      s.opposite(c2, g[3][2], g[3][3], g[2][3]) && s.opposite(c3, g[1][3], g[0][3], g[0][2]);
+    if (!ok)
+      return false;
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        P[i][j] = s.p[g[i][j]];
+      }
+    }
+    return true;
+  }
+
+  // uniform cubic B-spline basis functions and their derivatives at t
+  static void bspline_basis__(const double t, double b[4], double d[4]) {
+    const double s = 1 - t;
+    b[0] = s * s * s / 6;
+    b[1] = (3 * t * t * t - 6 * t * t + 4) / 6;
+    b[2] = (-3 * t * t * t + 3 * t * t + 3 * t + 1) / 6;
+    b[3] = t * t * t / 6;
+    d[0] = -s * s / 2;
+    d[1] = (3 * t * t - 4 * t) / 2;
+    d[2] = (-3 * t * t + 2 * t + 1) / 2;
+    d[3] = t * t / 2;
+  }
+
+  // The limit point and normal at corner 0 of face 0, from the limit and tangent masks
+  // of Catmull-Clark around a vertex whose faces are all quads
+  static void limit_at_corner__(const patch_t& s, Cvec3& position, Cvec3& normal) {
+    const int v = s.corner(0, 0);
+    std::vector <Cvec3> e, d;                                                // edge and diagonal neighbours, in turn
+    int a = s.corner(0, 1), x = s.corner(0, 2), y = s.corner(0, 3);
+    const int first = a;
+    do {
+      e.push_back(s.p[a]);
+      d.push_back(s.p[x]);
+      a = y;
+    } while (a != first && e.size() <= s.p.size() && s.opposite(v, a, x, y));
+    const int n = e.size();
+    const double pi = 3.14159265358979323846;
+    const double A = 1 + std::cos(2 * pi / n) + std::cos(pi / n) * std::sqrt(2 * (9 + std::cos(2 * pi / n)));
+    Cvec3 p = s.p[v] * (n * n), t1(0), t2(0);
+    for (int j = 0; j < n; ++j) {
+      const double c0 = std::cos(2 * pi * j / n), c1 = std::cos(2 * pi * (j+1) / n), c2 = std::cos(2 * pi * (j+2) / n);
+      p += e[j] * 4 + d[j];
+      t1 += e[j] * (A * c0) + d[j] * (c0 + c1);
+      t2 += e[j] * (A * c1) + d[j] * (c1 + c2);
+    }
+    position = p / (n * (n + 5));
+    normal = cross(t1 / norm(t1), t2 / norm(t2));                           // the tangents shrink with every refinement
+    const Cvec3 face = cross(s.p[s.corner(0, 1)] - s.p[v], s.p[s.corner(0, 3)] - s.p[v]);
+    normal /= dot(normal, face) < 0 ? -norm(normal) : norm(normal);
+  }
+
+  // Refines the patch around (u, v) until face 0 is a regular quad, whose limit surface
+  // is the bicubic B-spline over its 4x4 control points. Each step keeps the quadrant
+  // holding (u, v) and doubles the parameters, which leaves an extraordinary vertex at
+  // corner 0. The vertex itself, or a point still next to it after maxDepth steps, is
+  // evaluated with the limit masks.
+  static void eval_limit__(patch_t s, double u, double v, Cvec3& position, Cvec3& normal) {
+    static const int maxDepth = 30;
+    for (int depth = 0; ; ++depth) {
+      Cvec3 P[4][4];
+      if (limit_control_points__(s, P)) {
+        double bu[4], du[4], bv[4], dv[4];
+        bspline_basis__(u, bu, du);
+        bspline_basis__(v, bv, dv);
+        Cvec3 su(0), sv(0);
+        position = Cvec3(0);
+        for (int i = 0; i < 4; ++i) {
+          for (int j = 0; j < 4; ++j) {
+            position += P[i][j] * (bu[i] * bv[j]);
+            su += P[i][j] * (du[i] * bv[j]);
+            sv += P[i][j] * (bu[i] * dv[j]);
+          }
+        }
+        normal = cross(su / norm(su), sv / norm(sv));
+        normal /= norm(normal);
+        return;
+      }
+      if (depth == maxDepth || (depth > 0 && u == 0 && v == 0)) {
+        limit_at_corner__(s, position, normal);
+        return;
+      }
+      // the sub-quad at corner k has its own u running towards corner k+1 and v towards corner k-1
+      const bool right = u >= 0.5, top = v >= 0.5;
+      const int k = top ? (right ? 2 : 3) : (right ? 1 : 0);
+      const double su[4] = { 2*u, 2*v, 2 - 2*u, 2 - 2*v }, sv[4] = { 2*v, 2 - 2*u, 2 - 2*v, 2*u };
+      s = refine_limit_patch__(s, k);
+      u = std::min(su[k], 1.0);
+      v = std::min(sv[k], 1.0);
+    }
+  }
+  void evaluate_limit__(const int f, const int corner, const double u, const double v, Cvec3& position, Cvec3& normal) const {
+    if (topology_->not_manifold_)
+      throw std::runtime_error("Limit evaluation does not support non manifold mesh yet.");
+    if (topology_->with_boundary_)
+      throw std::runtime_error("Limit evaluation does not support mesh with boundaries yet.");
+    assert(f >= 0 && f < getNumFaces());
+    assert(u >= 0 && u <= 1 && v >= 0 && v <= 1);
+    patch_t s = limit_patch__(f);
+    if (s.faceSize(0) != 4) {
+      assert(corner >= 0 && corner < s.faceSize(0));
+      s = refine_limit_patch__(s, corner);
+    }
+    eval_limit__(s, u, v, position, normal);
   }
 
 public:
   struct VertexIterator;                                    // forward declaration (needed by Vertex class)
 
   // Default contructor. Assignment operator/constructor
-  Mesh() : not_manifold_(false), with_boundary_(false) {}
+  Mesh() : topology_(new topology_t()), center_(0), scale_(1) {}
   Mesh(const Mesh& m) {
     *this = m;
   }
   Mesh& operator = (const Mesh& m) {
-    face_ = m.face_;
-    vertex_ = m.vertex_;
-    edge_ = m.edge_;
+    topology_ = m.topology_;
+    position_ = m.position_;
+    normal_ = m.normal_;
     f_ = m.f_;
     e_ = m.e_;
     v_ = m.v_;
-    not_manifold_ = m.not_manifold_;
-    with_boundary_ = m.with_boundary_;
+    center_ = m.center_;
+    scale_ = m.scale_;
     return *this;
   }
 
@@ -246,24 +1025,24 @@ public:
 
     Vertex(Mesh& m, const int v) : m_(m), v_(v)                 {}
     Cvec3 getPosition() const {
-      return m_.vertex_[v_].position_;
+      return d__(m_.position_[v_]);
     }
     Cvec3 getNormal() const {
-      assert(m_.vertex_[v_].normal_[0] > -1e37 || !"Error: This normal is uninitialized, you can set it with setNormal()");
-      return m_.vertex_[v_].normal_;
+      assert(m_.normal_[v_][0] > -1e37 || !"Error: This normal is uninitialized, you can set it with setNormal()");
+      return d__(m_.normal_[v_]);
     }
     void setPosition(const Cvec3& p) const {
-      m_.vertex_[v_].position_ = p;
+      m_.position_[v_] = f__(p);
     }
     void setNormal(const Cvec3& n) const {
-      m_.vertex_[v_].normal_ = n;
+      m_.normal_[v_] = f__(n);
     }
     int getIndex() const {
       return v_;
     }
     VertexIterator getIterator() const {
-      assert((m_.vertex_[v_].halfedge_&((1<<28)-1)) < (int)m_.face_.size());
-      return VertexIterator(m_, m_.vertex_[v_].halfedge_);
+      assert(m_.topology_->vhalfedge_[v_] >= 0 && m_.topology_->vhalfedge_[v_] < (int)m_.topology_->hvertex_.size());
+      return VertexIterator(m_, m_.topology_->vhalfedge_[v_]);
     }
   };
 
@@ -277,12 +1056,16 @@ public:
       return m_.fn__(f_);
     }
     Cvec3 getNormal() const {
-      return cross(m_.vertex_[m_.face_[f_].vertex_[1]].position_ - m_.vertex_[m_.face_[f_].vertex_[0]].position_,
-                   m_.vertex_[m_.face_[f_].vertex_[2]].position_ - m_.vertex_[m_.face_[f_].vertex_[0]].position_).normalize();
+      const int h = m_.topology_->fhalfedge_[f_];
+      const Cvec3 p0 = d__(m_.position_[m_.topology_->hvertex_[h]]);
+      return cross(d__(m_.position_[m_.topology_->hvertex_[h+1]]) - p0, d__(m_.position_[m_.topology_->hvertex_[h+2]]) - p0).normalize();
     }
     Vertex getVertex(const int i) const {
       assert(i >= 0 && i < getNumVertices());
-      return Vertex(m_, m_.face_[f_].vertex_[i]);
+      return Vertex(m_, m_.topology_->hvertex_[m_.topology_->fhalfedge_[f_] + i]);
+    }
+    int getIndex() const {
+      return f_;
     }
 
   };
@@ -295,17 +1078,16 @@ public:
     Edge(Mesh& m, const int e) : m_(m), e_(e)                 {}
     Vertex getVertex(const int i) const {
       assert(i >= 0 && i < 2);
-      int faceIdx = m_.edge_[e_].halfedge_[0] & ((1<<28)-1);
-      int vertIdxWithinFace = ((m_.edge_[e_].halfedge_[0] >> 28) + i) % 4;
-      if (m_.face_[faceIdx].vertex_[vertIdxWithinFace] == -1) {
-        assert(vertIdxWithinFace == 3);
-        vertIdxWithinFace = 0;
-      }
-      return Vertex(m_, m_.face_[faceIdx].vertex_[vertIdxWithinFace]);
+      const int h = m_.topology_->ehalfedge_[e_];
+      return Vertex(m_, m_.topology_->hvertex_[i ? m_.topology_->next_[h] : h]);
     }
     Face getFace(const int i) const {
       assert(i >= 0 && i < 2);
-      return Face(m_, m_.edge_[e_].halfedge_[i] & ((1<<28)-1));
+      const int h = m_.topology_->ehalfedge_[e_];
+      return Face(m_, i ? m_.topology_->hface_[m_.topology_->twin_[h]] : m_.topology_->hface_[h]);
+    }
+    int getIndex() const {
+      return e_;
     }
     bool is_valid() const {
       return getVertex(0).v_ != -1 && getVertex(1).v_ != -1;
@@ -315,20 +1097,17 @@ public:
   // Mesh::VertexIterator
   struct VertexIterator {
     Mesh& m_;
-    int h_;
+    int h_;                                                 // halfedge leaving the center vertex
 
     VertexIterator(Mesh& m, const int h) : m_(m), h_(h)             {}
     Vertex getVertex() const {
-      const int v(h_ >> 28);
-      const int f(h_ & ((1<<28)-1));
-      return Vertex(m_, m_.face_[f].vertex_[(v+1) % m_.fn__(f)]);
+      return Vertex(m_, m_.topology_->hvertex_[m_.topology_->next_[h_]]);
     }
     Face getFace() const {
-      return Face(m_, h_ & ((1<<28)-1));
+      return Face(m_, m_.topology_->hface_[h_]);
     }
     VertexIterator& operator ++ () {
-      const int f(h_ & ((1<<28)-1)), v(h_ >> 28), vj((v+m_.fn__(f)-1) % m_.fn__(f)), e(m_.face_[f].edge_[vj] & ((1<<28)-1)), ei(m_.face_[f].edge_[vj] >> 28);
-      h_ = m_.edge_[e].halfedge_[ei ^ 1];
+      h_ = m_.topology_->next_[m_.topology_->twin_[h_]];
       return *this;
     }
     bool operator == (const VertexIterator& vi) const {
@@ -340,13 +1119,13 @@ public:
   };
 
   int getNumFaces() const {
-    return face_.size();
+    return topology_->fhalfedge_.size() - 1;
   }
   int getNumEdges() const {
-    return edge_.size();
+    return topology_->ehalfedge_.size();
   }
   int getNumVertices() const {
-    return vertex_.size();
+    return position_.size();
   }
 
   Vertex getVertex(const int i) {
@@ -360,31 +1139,123 @@ public:
   }
 
   Cvec3 getNewFaceVertex(const Face& f) const {
-    return f_[f.f_];
+    return d__(f_[f.f_]);
   }
   Cvec3 getNewEdgeVertex(const Edge& e) const {
-    return e_[e.e_];
+    return d__(e_[e.e_]);
   }
   Cvec3 getNewVertexVertex(const Vertex& v) const {
-    return v_[v.v_];
+    return d__(v_[v.v_]);
   }
 
   void setNewFaceVertex(const Face& f, const Cvec3& p) {
-    f_[f.f_] = p;
+    f_[f.f_] = f__(p);
   }
   void setNewEdgeVertex(const Edge& e, const Cvec3& p) {
-    e_[e.e_] = p;
+    e_[e.e_] = f__(p);
   }
   void setNewVertexVertex(const Vertex& v, const Cvec3& p) {
-    v_[v.v_] = p;
+    v_[v.v_] = f__(p);
   }
 
+  // Vertex positions as one contiguous array of getNumVertices() entries
+  const Cvec3f* getPositions() const {
+    return position_.empty() ? NULL : &position_[0];
+  }
+  Cvec3f* getPositions() {
+    return position_.empty() ? NULL : &position_[0];
+  }
+
+  // Face f has the getFaceVertexOffsets()[f+1] - getFaceVertexOffsets()[f] vertices
+  // getFaceVertexIndices()[getFaceVertexOffsets()[f]], ..., in counter clockwise order
+  const int* getFaceVertexOffsets() const {
+    return &topology_->fhalfedge_[0];
+  }
+  const int* getFaceVertexIndices() const {
+    return topology_->hvertex_.empty() ? NULL : &topology_->hvertex_[0];
+  }
+
+  // One-ring adjacency in compressed sparse row form, built by buildAdjacency() and
+  // shared by all meshes with the same connectivity. Vertex v has getValence(v)
+  // neighbours, getVertexNeighbors()[getVertexRingOffsets()[v]] and on, in
+  // VertexIterator order. getVertexRingFaces() holds at the same positions the face of
+  // the halfedge from v to each neighbour, or -1 where that halfedge is missing on a
+  // boundary. buildAdjacency() must be called before the other functions, which then
+  // only read; it only builds once, and may be called from several threads.
+  void buildAdjacency() const {
+    const topology_t& t = *topology_;
+    std::call_once(t.adjacency_once_, [&t]() {
+      t.adjacency_ = adjacency__(t);
+    });
+  }
+  const int* getVertexRingOffsets() const {
+    return &adjacency__().offset_[0];
+  }
+  const int* getVertexNeighbors() const {
+    const adjacency_t& a = adjacency__();
+    return a.vertex_.empty() ? NULL : &a.vertex_[0];
+  }
+  const int* getVertexRingFaces() const {
+    const adjacency_t& a = adjacency__();
+    return a.face_.empty() ? NULL : &a.face_[0];
+  }
+  int getValence(const int v) const {
+    const adjacency_t& a = adjacency__();
+    return a.offset_[v+1] - a.offset_[v];
+  }
+
+  // The refined mesh keeps the vertex-vertices at their old indices, followed by
+  // one edge-vertex per old edge and one face-vertex per old face, in that order
   void subdivide() {
     subdivide__();
   }
+  // Point and unit normal of the Catmull-Clark limit surface over quad f at (u, v) in
+  // [0, 1]^2, where corner i of the face (as in getFaceVertexIndices()) sits at (0, 0),
+  // (1, 0), (1, 1) and (0, 1) for i = 0..3. Regular quads are evaluated in closed form
+  // as bicubic B-spline patches; near extraordinary vertices the one-ring of the face
+  // is refined locally until the point lies in a regular patch. Throws runtime_error
+  // on non manifold meshes and meshes with boundaries, like subdivide().
+  void evaluateLimit(const int f, const double u, const double v, Cvec3& position, Cvec3& normal) const {
+    assert(fn__(f) == 4);
+    evaluate_limit__(f, 0, u, v, position, normal);
+  }
+  // The same for any face, which subdivision splits into one quad per corner: (u, v)
+  // runs over the quad at the given corner, with the corner at (0, 0), the middle of
+  // the edge to the next corner at (1, 0) and the face center at (1, 1). For a quad
+  // face this is the quarter of the face at that corner.
+  void evaluateLimit(const int f, const int corner, const double u, const double v, Cvec3& position, Cvec3& normal) const {
+    const double su[4] = { u, 1 - v, 1 - u, v }, sv[4] = { v, u, 1 - v, 1 - u };
+    if (fn__(f) == 4)
+      evaluate_limit__(f, 0, (su[corner] + (corner == 1 || corner == 2)) / 2, (sv[corner] + (corner >= 2)) / 2, position, normal);
+    else
+      evaluate_limit__(f, corner, u, v, position, normal);
+  }
+  // Replaces the mesh by faces over the given vertex positions, which are used as
+  // they are (not normalized). Face f has the vertices
+  // faceVertexIndices[faceVertexOffsets[f]] .. faceVertexIndices[faceVertexOffsets[f+1]-1],
+  // in counter clockwise order. Throws runtime_error on an invalid face list.
+  void build(const std::vector <Cvec3f>& positions, const std::vector <int>& faceVertexOffsets, const std::vector <int>& faceVertexIndices) {
+    build__(positions, faceVertexOffsets, faceVertexIndices);
+  }
+  // Reads a text .mesh file, a binary file written by save() or saveCompressed(), a
+  // Wavefront .obj file or a PLY file (ascii or binary). Positions are centered and
+  // scaled like .mesh files.
   void load(const char filename[]) {
     load__(filename);
   }
+  // Writes the mesh in the binary format, which load() memory maps and copies
+  // without parsing. With withConnectivity the halfedge connectivity is stored
+  // too, so loading skips rebuilding it.
+  void save(const char filename[], const bool withConnectivity = true) const {
+    save__(filename, withConnectivity);
+  }
+  // Writes the mesh compressed by MeshCodec: positions quantized to positionBits per
+  // coordinate over the bounding box, normals (if every vertex has one) in 32 bits and
+  // delta coded faces, typically a quarter of what save() writes. Quantization moves
+  // the positions by up to half a step of the box size / 2^positionBits.
+  void saveCompressed(const char filename[], const int positionBits = 16) const {
+    save_compressed__(filename, positionBits);
+  }
 };
 
 
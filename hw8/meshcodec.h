@@ -0,0 +1,505 @@
+#ifndef MESHCODEC_H
+#define MESHCODEC_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+#include "cvec.h"
+#include "threadpool.h"
+
+// Compressed mesh, kept in memory as the bytes of its file, so it can be loaded,
+// saved or mapped as is and decoded straight into vertex and index buffers:
+//   positions     unsigned 16 bit (or fewer bits) per coordinate, quantized over the
+//                 bounding box of the mesh
+//   normals       optional, octahedral encoding in two signed 16 bit values (a zero
+//                 normal comes back as +z)
+//   faces         blocks of BLOCK_FACES faces, each a run of variable-length byte
+//                 codes (7 bits per byte), one per corner: a corner shared with the
+//                 previous face is stored as its position in that face, any other as
+//                 the zigzag coded difference to the same corner of the previous face.
+//                 Neighbouring faces in strips (grids, subdivided meshes) share
+//                 vertices and have nearby indices, so most corners take one byte. A
+//                 face with a different number of corners than the previous one says
+//                 so with a flag bit on its first corner
+// The blocks start with an empty previous face, so they decode independently and in
+// parallel on the thread pool. Works on the same flat arrays as Mesh::build(), and is
+// behind Mesh::load() and Mesh::saveCompressed().
+//
+// File layout: a header_t followed by
+//   blockByte     unsigned long long[numBlocks+1]    start of each block in the face bytes
+//   blockCorner   int[numBlocks+1]                   first corner of each block
+//   position      unsigned short[3*numVertices]
+//   normal        short[2*numVertices]               if the NORMALS flag is set
+//   face bytes    unsigned char[faceBytes]
+class MeshCodec {
+public:
+  enum {
+    BLOCK_FACES = 1024
+  };
+
+  MeshCodec() : external_(NULL), size_(0) {}
+
+  static bool isCompressed(const char* data, const std::size_t size) {
+    return size >= sizeof(header_t) && std::memcmp(data, magic__(), 8) == 0;
+  }
+
+  // Compresses the faces (as for Mesh::build()) over numVertices positions, with
+  // normals if they are given, quantizing positions to positionBits in [1, 16].
+  // center and scale are stored for Mesh::load() (see Mesh::save()).
+  void encode(const int numVertices, const Cvec3f* positions, const Cvec3f* normals,
+              const int numFaces, const int* faceVertexOffsets, const int* faceVertexIndices,
+              const Cvec3f& center = Cvec3f(0), const float scale = 1, const int positionBits = 16) {
+    if (positionBits < 1 || positionBits > 16)
+      throw std::runtime_error("Position bits must be in [1, 16]");
+    ThreadPool& pool = getThreadPool();
+    header_t header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, magic__(), 8);
+    header.version = VERSION;
+    header.flags = normals ? NORMALS : 0;
+    header.numVertices = numVertices;
+    header.numFaces = numFaces;
+    header.numCorners = faceVertexOffsets[numFaces];
+    header.numBlocks = (numFaces + BLOCK_FACES - 1) / BLOCK_FACES;
+    header.positionBits = positionBits;
+    header.blockFaces = BLOCK_FACES;
+    for (int i = 0; i < 3; ++i) {
+      header.center[i] = center[i];
+    }
+    header.scale = scale;
+
+    // the bounding box, with dequantized = boxMin + q * boxStep
+    Cvec3f lo(0), hi(0);
+    for (int v = 0; v < numVertices; ++v) {
+      for (int i = 0; i < 3; ++i) {
+        lo[i] = v ? std::min(lo[i], positions[v][i]) : positions[v][i];
+        hi[i] = v ? std::max(hi[i], positions[v][i]) : positions[v][i];
+      }
+    }
+    const float levels = (float)((1 << positionBits) - 1);
+    for (int i = 0; i < 3; ++i) {
+      header.boxMin[i] = lo[i];
+      header.boxStep[i] = (hi[i] - lo[i]) / levels;
+    }
+
+    // the face blocks are encoded by a few tasks each into their own buffer, then concatenated
+    const int nb = header.numBlocks;
+    const int tasks = std::min(nb, 4 * pool.getNumThreads());
+    std::vector<std::vector<unsigned char> > bytes(tasks);
+    std::vector<unsigned long long> blockByte(nb + 1, 0);
+    std::vector<int> blockCorner(nb + 1, header.numCorners);
+    pool.run(tasks, [&](int t) {
+      for (int b = (long long)nb * t / tasks; b < (long long)nb * (t+1) / tasks; ++b) {
+        blockByte[b] = bytes[t].size();
+        blockCorner[b] = faceVertexOffsets[b * BLOCK_FACES];
+        encode_block__(b, numFaces, faceVertexOffsets, faceVertexIndices, bytes[t]);
+      }
+    });
+    unsigned long long total = 0;
+    for (int t = 0; t < tasks; ++t) {
+      for (int b = (long long)nb * t / tasks; b < (long long)nb * (t+1) / tasks; ++b) {
+        blockByte[b] += total;
+      }
+      total += bytes[t].size();
+    }
+    blockByte[nb] = total;
+    header.faceBytes = total;
+
+    buffer_.resize(sizeof(header) + (nb + 1) * (sizeof(unsigned long long) + sizeof(int)) +
+                   numVertices * (3 + (normals ? 2 : 0)) * sizeof(short) + total);
+    external_ = NULL;
+    size_ = buffer_.size();
+    char* const out = &buffer_[0];
+    std::memcpy(out, &header, sizeof(header));
+    std::memcpy(out + blockByteAt__(), &blockByte[0], (nb + 1) * sizeof(unsigned long long));
+    std::memcpy(out + blockCornerAt__(), &blockCorner[0], (nb + 1) * sizeof(int));
+    for (int t = 0; t < tasks; ++t) {
+      if (!bytes[t].empty())
+        std::memcpy(out + faceBytesAt__() + blockByte[(long long)nb * t / tasks], &bytes[t][0], bytes[t].size());
+    }
+    unsigned short* const q = reinterpret_cast<unsigned short*>(out + positionAt__());
+    short* const o = reinterpret_cast<short*>(out + normalAt__());
+    pool.parallelFor(numVertices, [&](int, int begin, int end) {
+      for (int v = begin; v < end; ++v) {
+        for (int i = 0; i < 3; ++i) {
+          const float s = header.boxStep[i] > 0 ? (positions[v][i] - header.boxMin[i]) / header.boxStep[i] : 0;
+          q[3*v + i] = (unsigned short)std::min(levels, std::max(0.0f, std::floor(s + 0.5f)));
+        }
+        if (normals)
+          encode_normal__(normals[v], o + 2*v);
+      }
+    });
+  }
+
+  // Uses the compressed mesh in the size bytes at data, which must stay valid while
+  // this MeshCodec uses them, without copying. Throws runtime_error naming filename
+  // if they do not hold a consistent compressed mesh.
+  void attach(const char* data, const std::size_t size, const char filename[]) {
+    check__(data, size, filename);
+    buffer_.clear();
+    external_ = data;
+    size_ = size;
+  }
+
+  void load(const char filename[]) {
+    std::ifstream f(filename, std::ios::binary);
+    if (!f)
+      throw std::runtime_error(std::string("Cannot open file ") + filename);
+    std::vector<char> buffer((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    check__(buffer.empty() ? NULL : &buffer[0], buffer.size(), filename);
+    buffer_.swap(buffer);
+    external_ = NULL;
+    size_ = buffer_.size();
+  }
+
+  void save(const char filename[]) const {
+    std::ofstream f(filename, std::ios::binary);
+    if (!f)
+      throw std::runtime_error(std::string("Cannot open file ") + filename);
+    f.write(data__(), size_);
+    if (!f)
+      throw std::runtime_error(std::string("Cannot write file ") + filename);
+  }
+
+  // Compressed size in bytes, the same in memory and on disk
+  std::size_t getSize() const {
+    return size_;
+  }
+
+  int getNumVertices() const {
+    return size_ ? header__().numVertices : 0;
+  }
+
+  int getNumFaces() const {
+    return size_ ? header__().numFaces : 0;
+  }
+
+  // Length of the face vertex index array, the sum of the face sizes
+  int getNumCorners() const {
+    return size_ ? header__().numCorners : 0;
+  }
+
+  bool hasNormals() const {
+    return size_ && (header__().flags & NORMALS);
+  }
+
+  Cvec3f getCenter() const {
+    const header_t& h = header__();
+    return Cvec3f(h.center[0], h.center[1], h.center[2]);
+  }
+
+  float getScale() const {
+    return header__().scale;
+  }
+
+  // Largest distance between a coordinate and its quantized value
+  Cvec3f getQuantizationError() const {
+    const header_t& h = header__();
+    return Cvec3f(h.boxStep[0], h.boxStep[1], h.boxStep[2]) / 2;
+  }
+
+  // The getNumVertices() positions and normals (if hasNormals()) into any vertex type
+  // with Cvec3f members p and n, such as VertexPN. n is left alone without normals.
+  template<typename Vertex>
+  void decodeVertices(Vertex* out) const {
+    decode_vertices__(out, [](Vertex& v) -> Cvec3f& { return v.p; }, [](Vertex& v) -> Cvec3f& { return v.n; });
+  }
+
+  void decodePositions(Cvec3f* positions) const {
+    decode_vertices__(positions, [](Cvec3f& v) -> Cvec3f& { return v; }, NoNormal());
+  }
+
+  void decodeNormals(Cvec3f* normals) const {
+    if (hasNormals())
+      decode_vertices__(normals, NoPosition(), [](Cvec3f& v) -> Cvec3f& { return v; });
+  }
+
+  // The faces as getNumFaces()+1 offsets into getNumCorners() indices, as for
+  // Mesh::build(). Throws runtime_error on corrupt face data.
+  void decodeFaces(int* faceVertexOffsets, int* faceVertexIndices) const {
+    decode_faces__([&](const int b, std::vector<int>&) {
+      return faceVertexIndices + blockCorner__()[b];
+    }, [&](const int f, const int first, const int*, const int) {
+      faceVertexOffsets[f] = first;
+    });
+    faceVertexOffsets[getNumFaces()] = getNumCorners();
+  }
+
+  // The faces as a triangle list, every polygon fanned from its first corner as in
+  // MeshPipeline, 3 * (getNumCorners() - 2 * getNumFaces()) indices. Throws
+  // runtime_error on corrupt face data.
+  template<typename Index>
+  void decodeTriangles(Index* indices) const {
+    decode_faces__([&](const int b, std::vector<int>& scratch) {
+      scratch.resize(blockCorner__()[b+1] - blockCorner__()[b]);
+      return scratch.empty() ? NULL : &scratch[0];
+    }, [&](const int f, const int first, const int* corners, const int n) {
+      Index* out = indices + 3 * (first - 2 * f);             // 3 * (first - 2f) indices before face f, as in MeshPipeline
+      for (int j = 1; j + 1 < n; ++j) {
+        *out++ = corners[0];
+        *out++ = corners[j];
+        *out++ = corners[j+1];
+      }
+    });
+  }
+
+private:
+  enum {
+    VERSION = 1,
+    NORMALS = 1
+  };
+
+  struct header_t {
+    char magic[8];                                          // "MESHQZ" and terminating zeros
+    unsigned version;
+    unsigned flags;
+    int numVertices, numFaces, numCorners, numBlocks;
+    int positionBits, blockFaces;
+    float boxMin[3], boxStep[3];                            // position = boxMin + quantized * boxStep
+    float center[3], scale;                                 // Mesh::load() normalization, as in the binary mesh format
+    unsigned long long faceBytes;
+  };
+
+  struct NoNormal {};
+  struct NoPosition {};
+
+  std::vector<char> buffer_;                                // the compressed mesh, unless attach()ed
+  const char* external_;
+  std::size_t size_;
+
+  static const char* magic__() {
+    return "MESHQZ\0";
+  }
+
+  const char* data__() const {
+    return external_ ? external_ : (buffer_.empty() ? NULL : &buffer_[0]);
+  }
+  const header_t& header__() const {
+    return *reinterpret_cast<const header_t*>(data__());
+  }
+
+  // byte offsets of the arrays, from the header
+  static std::size_t blockByteAt__() {
+    return sizeof(header_t);
+  }
+  static std::size_t blockCornerAt__(const header_t& h) {
+    return blockByteAt__() + (h.numBlocks + 1) * sizeof(unsigned long long);
+  }
+  static std::size_t positionAt__(const header_t& h) {
+    return blockCornerAt__(h) + (h.numBlocks + 1) * sizeof(int);
+  }
+  static std::size_t normalAt__(const header_t& h) {
+    return positionAt__(h) + 3 * (std::size_t)h.numVertices * sizeof(unsigned short);
+  }
+  static std::size_t faceBytesAt__(const header_t& h) {
+    return normalAt__(h) + ((h.flags & NORMALS) ? 2 * (std::size_t)h.numVertices * sizeof(short) : 0);
+  }
+  std::size_t blockCornerAt__() const {
+    return blockCornerAt__(header__());
+  }
+  std::size_t positionAt__() const {
+    return positionAt__(header__());
+  }
+  std::size_t normalAt__() const {
+    return normalAt__(header__());
+  }
+  std::size_t faceBytesAt__() const {
+    return faceBytesAt__(header__());
+  }
+  const unsigned long long* blockByte__() const {
+    return reinterpret_cast<const unsigned long long*>(data__() + blockByteAt__());
+  }
+  const int* blockCorner__() const {
+    return reinterpret_cast<const int*>(data__() + blockCornerAt__());
+  }
+
+  static void check__(const char* data, const std::size_t size, const char filename[]) {
+    if (!isCompressed(data, size))
+      throw std::runtime_error(std::string("Not a compressed mesh file: ") + filename);
+    header_t h;
+    std::memcpy(&h, data, sizeof(h));
+    if (h.version != VERSION)
+      throw std::runtime_error(std::string("Unsupported compressed mesh version in ") + filename);
+    bool ok = h.numVertices >= 0 && h.numFaces >= 0 && h.numCorners >= 0 && h.blockFaces == BLOCK_FACES &&
+              h.numBlocks == (int)(((long long)h.numFaces + BLOCK_FACES - 1) / BLOCK_FACES) &&
+              h.positionBits >= 1 && h.positionBits <= 16 &&
+              faceBytesAt__(h) <= size && size - faceBytesAt__(h) == h.faceBytes;
+    if (ok) {
+      const unsigned long long* byte = reinterpret_cast<const unsigned long long*>(data + blockByteAt__());
+      const int* corner = reinterpret_cast<const int*>(data + blockCornerAt__(h));
+      ok = byte[0] == 0 && byte[h.numBlocks] == h.faceBytes && corner[0] == 0 && corner[h.numBlocks] == h.numCorners;
+      for (int b = 0; ok && b < h.numBlocks; ++b) {
+        ok = byte[b] <= byte[b+1] && corner[b] <= corner[b+1];
+      }
+    }
+    if (!ok)
+      throw std::runtime_error(std::string("Corrupt compressed mesh file ") + filename);
+  }
+
+  static unsigned zigzag__(const int x) {
+    return ((unsigned)x << 1) ^ (unsigned)(x >> 31);
+  }
+  static int unzigzag__(const unsigned x) {
+    return (int)(x >> 1) ^ -(int)(x & 1);
+  }
+  static void put__(std::vector<unsigned char>& out, unsigned x) {
+    while (x >= 0x80) {
+      out.push_back((unsigned char)(x | 0x80));
+      x >>= 7;
+    }
+    out.push_back((unsigned char)x);
+  }
+  // false if the code runs past end or over 32 bits
+  static bool get__(const unsigned char*& in, const unsigned char* end, unsigned& x) {
+    x = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      if (in == end)
+        return false;
+      const unsigned char c = *in++;
+      x |= (unsigned)(c & 0x7f) << shift;
+      if (!(c & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  // Codes below the previous face's size k refer to its corners. Code k + zigzag(d)
+  // is corner j of the previous face, or the face's own previous corner past its end,
+  // plus d. The first corner's code carries a flag in its lowest bit when the face
+  // size changes, followed by the size.
+  static void encode_block__(const int b, const int numFaces, const int* offset, const int* index,
+                             std::vector<unsigned char>& out) {
+    const int* previous = NULL;
+    int previousSize = 0;
+    for (int f = b * BLOCK_FACES; f < std::min(numFaces, (b + 1) * BLOCK_FACES); ++f) {
+      const int* const v = index + offset[f];
+      const int n = offset[f+1] - offset[f];
+      for (int j = 0; j < n; ++j) {
+        const int shared = std::find(previous, previous + previousSize, v[j]) - previous;
+        const int predicted = j < previousSize ? previous[j] : (j ? v[j-1] : 0);
+        const unsigned code = shared < previousSize ? shared : previousSize + zigzag__(v[j] - predicted);
+        if (j == 0) {
+          put__(out, code << 1 | (n != previousSize));
+          if (n != previousSize)
+            put__(out, n);
+        }
+        else {
+          put__(out, code);
+        }
+      }
+      previous = v;
+      previousSize = n;
+    }
+  }
+
+  // Decodes every block with the thread pool. cornersOf(b, scratch) returns where the
+  // corners of block b go, face(f, first, corners, n) is called for every face in
+  // order within a block, with the index of its first corner in the whole mesh. Throws once all blocks are done if one of them was corrupt.
+  template<typename CornersOf, typename Face>
+  void decode_faces__(CornersOf cornersOf, Face face) const {
+    ThreadPool& pool = getThreadPool();
+    const header_t& h = header__();
+    const int nb = h.numBlocks, nv = h.numVertices;
+    const int tasks = std::min(nb, 4 * pool.getNumThreads());
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(data__() + faceBytesAt__());
+    const unsigned long long* const blockByte = blockByte__();
+    const int* const blockCorner = blockCorner__();
+    std::vector<char> corrupt(tasks, false);
+    pool.run(tasks, [&](int t) {
+      std::vector<int> scratch;
+      for (int b = (long long)nb * t / tasks; b < (long long)nb * (t+1) / tasks && !corrupt[t]; ++b) {
+        int* const corners = cornersOf(b, scratch);
+        const int numCorners = blockCorner[b+1] - blockCorner[b];
+        const unsigned char* in = bytes + blockByte[b], * const end = bytes + blockByte[b+1];
+        const int* previous = NULL;
+        int previousSize = 0, c = 0;
+        for (int f = b * BLOCK_FACES; f < std::min(h.numFaces, (b + 1) * BLOCK_FACES); ++f) {
+          unsigned code, n = previousSize;
+          if (!get__(in, end, code) || ((code & 1) && !get__(in, end, n)) || n < 3 || n > (unsigned)(numCorners - c)) {
+            corrupt[t] = true;
+            break;
+          }
+          int* const v = corners + c;
+          for (int j = 0; j < (int)n; ++j) {
+            if (j > 0 && !get__(in, end, code)) {
+              corrupt[t] = true;
+              break;
+            }
+            const unsigned c = j ? code : code >> 1;
+            const int predicted = j < previousSize ? previous[j] : (j ? v[j-1] : 0);
+            v[j] = c < (unsigned)previousSize ? previous[c] : predicted + unzigzag__(c - previousSize);
+            corrupt[t] |= v[j] < 0 || v[j] >= nv;
+          }
+          if (corrupt[t])
+            break;
+          face(f, blockCorner[b] + c, v, n);
+          previous = v;
+          previousSize = n;
+          c += n;
+        }
+        corrupt[t] |= c != numCorners || in != end;
+      }
+    });
+    if (std::find(corrupt.begin(), corrupt.end(), true) != corrupt.end())
+      throw std::runtime_error("Corrupt compressed mesh face data");
+  }
+
+  static void encode_normal__(const Cvec3f& n, short out[2]) {
+    const float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+    float u = l1 > 0 ? n[0] / l1 : 0, v = l1 > 0 ? n[1] / l1 : 0;
+    if (n[2] < 0) {                                         // the lower half folds over the diagonals
+      const float fu = (1 - std::abs(v)) * (u >= 0 ? 1 : -1), fv = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+      u = fu;
+      v = fv;
+    }
+    out[0] = (short)std::floor(std::min(1.0f, std::max(-1.0f, u)) * 32767 + 0.5f);
+    out[1] = (short)std::floor(std::min(1.0f, std::max(-1.0f, v)) * 32767 + 0.5f);
+  }
+  static Cvec3f decode_normal__(const short in[2]) {
+    float u = in[0] / 32767.0f, v = in[1] / 32767.0f;
+    const float z = 1 - std::abs(u) - std::abs(v);
+    if (z < 0) {
+      const float fu = (1 - std::abs(v)) * (u >= 0 ? 1 : -1), fv = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+      u = fu;
+      v = fv;
+    }
+    const Cvec3f n(u, v, z);
+    return n / std::sqrt(norm2(n));
+  }
+
+  template<typename Out, typename Position, typename Normal>
+  void decode_vertices__(Out* out, Position position, Normal normal) const {
+    const header_t& h = header__();
+    const unsigned short* const q = reinterpret_cast<const unsigned short*>(data__() + positionAt__());
+    const short* const o = reinterpret_cast<const short*>(data__() + normalAt__());
+    const bool normals = (h.flags & NORMALS) != 0;
+    getThreadPool().parallelFor(h.numVertices, [&](int, int begin, int end) {
+      for (int v = begin; v < end; ++v) {
+        set_position__(out[v], position, q + 3*v, h);
+        if (normals)
+          set_normal__(out[v], normal, o + 2*v);
+      }
+    });
+  }
+  template<typename Out, typename Position>
+  static void set_position__(Out& out, Position position, const unsigned short* q, const header_t& h) {
+    position(out) = Cvec3f(h.boxMin[0] + q[0] * h.boxStep[0], h.boxMin[1] + q[1] * h.boxStep[1], h.boxMin[2] + q[2] * h.boxStep[2]);
+  }
+  template<typename Out>
+  static void set_position__(Out&, NoPosition, const unsigned short*, const header_t&) {}
+  template<typename Out, typename Normal>
+  static void set_normal__(Out& out, Normal normal, const short* o) {
+    normal(out) = decode_normal__(o);
+  }
+  template<typename Out>
+  static void set_normal__(Out&, NoNormal, const short*) {}
+};
+
+#endif
@@ -0,0 +1,452 @@
+#ifndef MESHDECIMATOR_H
+#define MESHDECIMATOR_H
+
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+
+#include "cvec.h"
+#include "mesh.h"
+#include "threadpool.h"
+
+// Simplifies a mesh by quadric error metric edge collapse (Garland and Heckbert).
+// Every vertex carries the sum of the squared distance quadrics of the planes of its
+// triangles. Collapsing an edge merges the quadrics of its ends and puts the kept
+// vertex where their sum is smallest. Edges are collapsed cheapest first from a
+// priority queue, skipping collapses that would fold a triangle over or make the
+// surface non manifold. Boundary edges get extra perpendicular planes so the outline
+// is kept. Polygons are triangulated first, so the output is a triangle mesh.
+//
+// Large meshes are first cut into spatial clusters that are simplified in parallel,
+// with the vertices on cluster borders held in place. A serial pass over the much
+// smaller result then simplifies across the borders.
+class MeshDecimator {
+public:
+  struct Level {
+    Mesh mesh;
+    double error;                                           // largest distance() of a collapsed vertex from the planes
+                                                            // it stands for so far: about how far the surface moved
+  };
+
+  MeshDecimator() : boundaryWeight_(100), trianglesPerCluster_(50000) {}
+
+  // Appends numLevels simplifications of m to chain, each with about ratio times as
+  // many triangles as the one before (the first has ratio times the triangles of m).
+  // Stops early once no edge can be collapsed.
+  void buildChain(const Mesh& m, const int numLevels, const double ratio, std::vector<Level>& chain) {
+    init__(m);
+    const int numTriangles = live__();
+    std::vector<Worker> workers;
+    if (numTriangles >= 2 * trianglesPerCluster_)
+      cluster__(std::min(64, numTriangles / trianglesPerCluster_), (int)(numTriangles * ratio), workers);
+    Worker all(-1);
+    for (int v = 0; v < (int)p_.size(); ++v) {
+      locked_[v] = nonmanifold_[v];
+    }
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+      all.maxError = std::max(all.maxError, workers[i].maxError);
+    }
+    all.live = live__();
+    seed__(all);
+
+    double target = numTriangles;
+    for (int level = 0; level < numLevels; ++level) {
+      target *= ratio;
+      const int before = all.live;
+      run__(all, std::max(1, (int)target));
+      if (all.live == before && level > 0)
+        break;
+      chain.push_back(Level());
+      extract__(chain.back().mesh);
+      chain.back().error = all.maxError;
+    }
+  }
+
+  // Relative weight of the planes that hold boundary edges in place
+  void setBoundaryWeight(const double weight) {
+    boundaryWeight_ = weight;
+  }
+
+private:
+  // Symmetric 4x4 matrix Q, with cost v^T Q v for v = (x, y, z, 1), stored as its upper
+  // triangle, and the total weight of the planes summed into it
+  struct Quadric {
+    double a, b, c, d, e, f, g, h, i, j;                    // [a b c d; b e f g; c f h i; d g i j]
+    double weight;
+
+    Quadric() : a(0), b(0), c(0), d(0), e(0), f(0), g(0), h(0), i(0), j(0), weight(0) {}
+
+    // w times the squared distance to the plane dot(n, x) + dn = 0, for a unit n
+    Quadric(const Cvec3& n, const double dn, const double w)
+      : a(w*n[0]*n[0]), b(w*n[0]*n[1]), c(w*n[0]*n[2]), d(w*n[0]*dn),
+        e(w*n[1]*n[1]), f(w*n[1]*n[2]), g(w*n[1]*dn),
+        h(w*n[2]*n[2]), i(w*n[2]*dn), j(w*dn*dn), weight(w) {}
+
+    Quadric& operator += (const Quadric& q) {
+      a += q.a; b += q.b; c += q.c; d += q.d; e += q.e;
+      f += q.f; g += q.g; h += q.h; i += q.i; j += q.j;
+      weight += q.weight;
+      return *this;
+    }
+
+    Quadric operator + (const Quadric& q) const {
+      return Quadric(*this) += q;
+    }
+
+    double evaluate(const Cvec3& v) const {
+      const double x = v[0], y = v[1], z = v[2];
+      return a*x*x + 2*b*x*y + 2*c*x*z + 2*d*x + e*y*y + 2*f*y*z + 2*g*y + h*z*z + 2*i*z + j;
+    }
+
+    // The weighted RMS distance from v to the planes, in mesh units, where evaluate()
+    // is in units of weight times squared distance
+    double distance(const Cvec3& v) const {
+      return weight > 0 ? std::sqrt(std::max(0.0, evaluate(v)) / weight) : 0;
+    }
+
+    // Sets v to the minimum of the quadric; false if the 3x3 part is close to singular
+    bool minimize(Cvec3& v) const {
+      const double c0 = e*h - f*f, c1 = c*f - b*h, c2 = b*f - c*e;
+      const double det = a*c0 + b*c1 + c*c2;
+      const double scale = a + e + h;
+      if (std::abs(det) <= 1e-10 * scale * scale * scale)
+        return false;
+      v = Cvec3(-(d*c0 + g*c1 + i*c2),
+                -(d*c1 + g*(a*h - c*c) + i*(b*c - a*f)),
+                -(d*c2 + g*(b*c - a*f) + i*(a*e - b*b))) / det;
+      return true;
+    }
+  };
+
+  struct Candidate {
+    double cost, error;                                     // error is the distance() of the target
+    int a, b;                                               // collapse b into a
+    unsigned versionA, versionB;
+    Cvec3 target;
+
+    bool operator < (const Candidate& c) const {            // makes the priority_queue a min heap on cost
+      return cost > c.cost;
+    }
+  };
+
+  // The collapses of one cluster (or of the whole mesh, for cluster -1)
+  struct Worker {
+    int cluster;
+    std::priority_queue<Candidate> queue;
+    std::vector<int> triangles;                             // of the cluster, taken before the parallel pass
+    std::vector<int> around, aroundB;                       // scratch neighbour lists
+    int live;                                               // live triangles of the cluster
+    double maxError;
+
+    explicit Worker(const int c) : cluster(c), live(0), maxError(0) {}
+  };
+
+  double boundaryWeight_;
+  int trianglesPerCluster_;
+
+  std::vector<Cvec3> p_;
+  std::vector<Quadric> q_;
+  std::vector<int> tri_;                                    // 3 vertices per triangle, -1 once removed
+  std::vector<std::vector<int> > vtris_;                    // triangles around each vertex, may list removed ones
+  std::vector<unsigned> version_;                           // bumped when a vertex moves, invalidating queued collapses
+  std::vector<char> locked_, nonmanifold_, boundary_;
+  std::vector<int> tcluster_, vcluster_;                    // cluster of each triangle and of each unlocked vertex
+
+  int live__() const {
+    int n = 0;
+    for (std::size_t t = 0; t < tri_.size(); t += 3) {
+      n += tri_[t] >= 0;
+    }
+    return n;
+  }
+
+  bool has__(const int t, const int v) const {
+    return tri_[3*t] == v || tri_[3*t+1] == v || tri_[3*t+2] == v;
+  }
+
+  void init__(const Mesh& m) {
+    const Cvec3f* position = m.getPositions();
+    const int* offset = m.getFaceVertexOffsets();
+    const int* index = m.getFaceVertexIndices();
+    const int nv = m.getNumVertices(), nf = m.getNumFaces();
+    p_.resize(nv);
+    for (int v = 0; v < nv; ++v) {
+      p_[v] = Cvec3(position[v][0], position[v][1], position[v][2]);
+    }
+    tri_.clear();
+    for (int f = 0; f < nf; ++f) {                          // fan triangulation
+      for (int j = offset[f] + 1; j < offset[f+1] - 1; ++j) {
+        tri_.push_back(index[offset[f]]);
+        tri_.push_back(index[j]);
+        tri_.push_back(index[j+1]);
+      }
+    }
+    const int nt = tri_.size() / 3;
+    vtris_.assign(nv, std::vector<int>());
+    for (int t = 0; t < nt; ++t) {
+      for (int k = 0; k < 3; ++k) {
+        vtris_[tri_[3*t+k]].push_back(t);
+      }
+    }
+    version_.assign(nv, 0);
+    locked_.assign(nv, false);
+    nonmanifold_.assign(nv, false);
+    boundary_.assign(nv, false);
+
+    // count the triangles on every edge, with the edges sorted by their end points
+    std::vector<std::pair<std::pair<int, int>, int> > edges;
+    edges.reserve(3 * nt);
+    for (int t = 0; t < nt; ++t) {
+      for (int k = 0; k < 3; ++k) {
+        const int u = tri_[3*t+k], v = tri_[3*t + (k+1) % 3];
+        edges.push_back(std::make_pair(std::make_pair(std::min(u, v), std::max(u, v)), t));
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+
+    q_.assign(nv, Quadric());
+    for (int t = 0; t < nt; ++t) {
+      const Cvec3 n = cross(p_[tri_[3*t+1]] - p_[tri_[3*t]], p_[tri_[3*t+2]] - p_[tri_[3*t]]);
+      const double area2 = norm(n);
+      if (area2 <= 0)
+        continue;
+      const Cvec3 u = n / area2;
+      const Quadric q(u, -dot(u, p_[tri_[3*t]]), area2 / 2);
+      for (int k = 0; k < 3; ++k) {
+        q_[tri_[3*t+k]] += q;
+      }
+    }
+    for (std::size_t i = 0, j; i < edges.size(); i = j) {
+      for (j = i+1; j < edges.size() && edges[j].first == edges[i].first; ++j) {}
+      const int u = edges[i].first.first, v = edges[i].first.second;
+      if (j - i > 2) {
+        nonmanifold_[u] = nonmanifold_[v] = true;
+      }
+      else if (j - i == 1) {                                // boundary edge: add a plane through it, perpendicular to its triangle
+        const int t = edges[i].second;
+        boundary_[u] = boundary_[v] = true;
+        const Cvec3 n = cross(p_[tri_[3*t+1]] - p_[tri_[3*t]], p_[tri_[3*t+2]] - p_[tri_[3*t]]);
+        const Cvec3 side = cross(p_[v] - p_[u], n);
+        const double len = norm(side);
+        if (len <= 0)
+          continue;
+        const Quadric q(side / len, -dot(side / len, p_[u]), boundaryWeight_ * norm2(p_[v] - p_[u]));
+        q_[u] += q;
+        q_[v] += q;
+      }
+    }
+  }
+
+  // Splits the triangles into numClusters slabs of equal size along the longest side of
+  // the bounding box, then simplifies every cluster towards its share of target
+  // triangles in parallel, with the vertices shared between clusters locked.
+  void cluster__(const int numClusters, const int target, std::vector<Worker>& workers) {
+    const int nt = tri_.size() / 3, nv = p_.size();
+    Cvec3 lo = p_[0], hi = p_[0];
+    for (int v = 1; v < nv; ++v) {
+      for (int k = 0; k < 3; ++k) {
+        lo[k] = std::min(lo[k], p_[v][k]);
+        hi[k] = std::max(hi[k], p_[v][k]);
+      }
+    }
+    const Cvec3 size = hi - lo;
+    const int axis = size[0] >= size[1] && size[0] >= size[2] ? 0 : (size[1] >= size[2] ? 1 : 2);
+    std::vector<std::pair<double, int> > order(nt);
+    for (int t = 0; t < nt; ++t) {
+      order[t] = std::make_pair(p_[tri_[3*t]][axis] + p_[tri_[3*t+1]][axis] + p_[tri_[3*t+2]][axis], t);
+    }
+    std::sort(order.begin(), order.end());
+    tcluster_.resize(nt);
+    for (int i = 0; i < nt; ++i) {
+      tcluster_[order[i].second] = (long long)i * numClusters / nt;
+    }
+    vcluster_.assign(nv, -1);
+    for (int v = 0; v < nv; ++v) {
+      for (std::size_t k = 0; k < vtris_[v].size(); ++k) {
+        const int c = tcluster_[vtris_[v][k]];
+        if (vcluster_[v] != -1 && vcluster_[v] != c)
+          locked_[v] = true;
+        vcluster_[v] = c;
+      }
+      locked_[v] = locked_[v] || nonmanifold_[v];
+    }
+
+    for (int c = 0; c < numClusters; ++c) {
+      workers.push_back(Worker(c));
+    }
+    for (int t = 0; t < nt; ++t) {
+      workers[tcluster_[t]].triangles.push_back(t);
+    }
+    for (int c = 0; c < numClusters; ++c) {
+      workers[c].live = workers[c].triangles.size();
+    }
+    getThreadPool().run(numClusters, [&](int c) {
+      Worker& w = workers[c];
+      seed__(w);
+      run__(w, (int)((long long)w.live * target / nt));
+    });
+  }
+
+  // Queues a collapse for every unlocked edge of the worker's cluster. A cluster only
+  // reads its own triangles, which the other clusters do not change.
+  void seed__(Worker& w) {
+    w.queue = std::priority_queue<Candidate>();
+    const int n = w.cluster >= 0 ? (int)w.triangles.size() : (int)tri_.size() / 3;
+    for (int i = 0; i < n; ++i) {
+      const int t = w.cluster >= 0 ? w.triangles[i] : i;
+      if (tri_[3*t] < 0)
+        continue;
+      for (int k = 0; k < 3; ++k) {
+        const int u = tri_[3*t+k], v = tri_[3*t + (k+1) % 3];
+        if (u < v)
+          push__(w, u, v);
+      }
+    }
+  }
+
+  void push__(Worker& w, const int a, const int b) {
+    if (locked_[a] || locked_[b])
+      return;
+    const Quadric q = q_[a] + q_[b];
+    Candidate c;
+    c.a = a;
+    c.b = b;
+    c.versionA = version_[a];
+    c.versionB = version_[b];
+    if (!q.minimize(c.target)) {
+      const Cvec3 choices[3] = {p_[a], p_[b], (p_[a] + p_[b]) * 0.5};
+      c.target = choices[0];
+      for (int k = 1; k < 3; ++k) {
+        if (q.evaluate(choices[k]) < q.evaluate(c.target))
+          c.target = choices[k];
+      }
+    }
+    c.cost = std::max(0.0, q.evaluate(c.target));
+    c.error = q.distance(c.target);
+    w.queue.push(c);
+  }
+
+  // Collapses the cheapest edges until at most target triangles are left in the worker's part
+  void run__(Worker& w, const int target) {
+    while (w.live > target && !w.queue.empty()) {
+      const Candidate c = w.queue.top();
+      w.queue.pop();
+      if (version_[c.a] != c.versionA || version_[c.b] != c.versionB || vtris_[c.b].empty())
+        continue;
+      if (collapse__(w, c.a, c.b, c.target))
+        w.maxError = std::max(w.maxError, c.error);
+    }
+  }
+
+  // collects the distinct vertices other than v and other that share a live triangle with v
+  void neighbours__(const int v, const int other, std::vector<int>& out) const {
+    out.clear();
+    for (std::size_t k = 0; k < vtris_[v].size(); ++k) {
+      const int t = vtris_[v][k];
+      for (int j = 0; j < 3 && tri_[3*t] >= 0; ++j) {
+        if (tri_[3*t+j] != v && tri_[3*t+j] != other)
+          out.push_back(tri_[3*t+j]);
+      }
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+  }
+
+  // false if moving v to target would flip or flatten one of its triangles that does not contain other
+  bool keeps_orientation__(const int v, const int other, const Cvec3& target) const {
+    for (std::size_t k = 0; k < vtris_[v].size(); ++k) {
+      const int t = vtris_[v][k];
+      if (tri_[3*t] < 0 || has__(t, other))
+        continue;
+      Cvec3 before[3], after[3];
+      for (int j = 0; j < 3; ++j) {
+        before[j] = p_[tri_[3*t+j]];
+        after[j] = tri_[3*t+j] == v ? target : before[j];
+      }
+      if (dot(cross(before[1] - before[0], before[2] - before[0]), cross(after[1] - after[0], after[2] - after[0])) <= 0)
+        return false;
+    }
+    return true;
+  }
+
+  bool collapse__(Worker& w, const int a, const int b, const Cvec3& target) {
+    int shared = 0;                                         // triangles on the edge ab
+    for (std::size_t k = 0; k < vtris_[a].size(); ++k) {
+      shared += tri_[3*vtris_[a][k]] >= 0 && has__(vtris_[a][k], b);
+    }
+    if (shared == 0 || (shared == 2 && boundary_[a] && boundary_[b]))
+      return false;                                         // would pinch two boundaries together
+    // link condition: the ends may only share the neighbours opposite the edge
+    neighbours__(a, b, w.around);
+    neighbours__(b, a, w.aroundB);
+    if (!boundary_[a] && !boundary_[b] && w.around.size() + w.aroundB.size() - shared < 3)
+      return false;                                         // e.g. a tetrahedron, which would fold flat
+    std::vector<int>::iterator it = std::set_intersection(w.around.begin(), w.around.end(),
+                                                          w.aroundB.begin(), w.aroundB.end(), w.around.begin());
+    if (it - w.around.begin() != shared)
+      return false;
+    if (!keeps_orientation__(a, b, target) || !keeps_orientation__(b, a, target))
+      return false;
+
+    p_[a] = target;
+    q_[a] += q_[b];
+    boundary_[a] = boundary_[a] || boundary_[b];
+    ++version_[a];
+    ++version_[b];
+    std::vector<int>& ta = vtris_[a];
+    for (std::size_t k = 0; k < vtris_[b].size(); ++k) {
+      const int t = vtris_[b][k];
+      if (tri_[3*t] < 0)
+        continue;
+      if (has__(t, a)) {
+        tri_[3*t] = tri_[3*t+1] = tri_[3*t+2] = -1;
+        --w.live;
+      }
+      else {
+        for (int j = 0; j < 3; ++j) {
+          if (tri_[3*t+j] == b)
+            tri_[3*t+j] = a;
+        }
+        ta.push_back(t);
+      }
+    }
+    std::vector<int>().swap(vtris_[b]);
+    std::size_t n = 0;
+    for (std::size_t k = 0; k < ta.size(); ++k) {
+      if (tri_[3*ta[k]] >= 0)
+        ta[n++] = ta[k];
+    }
+    ta.resize(n);
+
+    neighbours__(a, a, w.around);
+    for (std::size_t k = 0; k < w.around.size(); ++k) {
+      push__(w, a, w.around[k]);
+    }
+    return true;
+  }
+
+  // the live triangles as a Mesh, over the vertices they use
+  void extract__(Mesh& m) const {
+    std::vector<int> remap(p_.size(), -1), offsets(1, 0), indices;
+    std::vector<Cvec3f> positions;
+    for (std::size_t t = 0; t < tri_.size(); t += 3) {
+      if (tri_[t] < 0)
+        continue;
+      for (int j = 0; j < 3; ++j) {
+        int& r = remap[tri_[t+j]];
+        if (r < 0) {
+          r = positions.size();
+          const Cvec3& p = p_[tri_[t+j]];
+          positions.push_back(Cvec3f(p[0], p[1], p[2]));
+        }
+        indices.push_back(r);
+      }
+      offsets.push_back(indices.size());
+    }
+    m.build(positions, offsets, indices);
+  }
+};
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef MESHDEFORMER_H
+#define MESHDEFORMER_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "cvec.h"
+#include "quat.h"
+#include "mesh.h"
+#include "meshlaplacian.h"
+#include "sparsematrix.h"
+#include "threadpool.h"
+
+// Handle-based as-rigid-as-possible deformation (Sorkine and Alexa, "As-Rigid-As-
+// Possible Surface Modeling"): the handle vertices are placed, and the others follow
+// so that the one-ring of every vertex stays as close as possible to a rotated copy of
+// its rest shape. Every iteration alternates
+//   local    the best rotation of every one-ring, extracted from the covariance of its
+//            rest and current edges (Mueller et al., "A Robust Method to Extract the
+//            Rotational Part of Deformations"), starting from the last rotation found
+//   global   the positions that best fit the rotated rest edges, a Laplacian system
+//            with the handles as fixed values, solved by ConjugateGradient
+// Both run in parallel on the thread pool. Nothing is factorized: every deform()
+// starts from the positions and rotations of the previous one, so a handle dragged a
+// little per frame needs a few iterations only, and keeps converging across frames.
+class MeshDeformer {
+public:
+  MeshDeformer() : iterations_(1) {
+    solver_.setMaxIterations(10);
+    solver_.setTolerance(1e-4);
+  }
+
+  // Rest shape and weights. Cotangent weights are clamped to be non negative, which
+  // keeps the rotation fits well posed on obtuse triangles.
+  void setMesh(const Mesh& m, const MeshLaplacian::Weighting weighting = MeshLaplacian::COTANGENT) {
+    MeshLaplacian laplacian;
+    laplacian.build(m, weighting);
+    const SparseMatrix& l = laplacian.getMatrix();
+    const int nv = m.getNumVertices();
+    std::vector<SparseMatrix::Entry> entries;
+    for (int i = 0; i < nv; ++i) {
+      for (int k = l.getOffsets()[i]; k < l.getOffsets()[i+1]; ++k) {
+        const int j = l.getColumns()[k];
+        const double w = std::max(-l.getValues()[k], 0.0);
+        if (j != i && w > 0) {
+          entries.push_back(SparseMatrix::Entry(i, j, -w));
+          entries.push_back(SparseMatrix::Entry(i, i, w));
+        }
+      }
+      entries.push_back(SparseMatrix::Entry(i, i, 0));
+    }
+    laplacian_.build(nv, entries);
+    rest_.resize(nv);
+    for (int i = 0; i < nv; ++i) {
+      rest_[i] = Cvec3(m.getPositions()[i][0], m.getPositions()[i][1], m.getPositions()[i][2]);
+    }
+    x_ = rest_;
+    position_.resize(nv);
+    for (int i = 0; i < nv; ++i) {
+      position_[i] = m.getPositions()[i];
+    }
+    rotation_.assign(nv, Quat());
+    matrix_.resize(3 * nv);
+    setHandles(std::vector<int>());
+  }
+
+  // Vertices placed by deform(), in the order of its positions. Parts of the mesh not
+  // connected to any handle keep their rest shape, wherever they drift. The global
+  // step's matrix, L restricted to the other (free) vertices, is assembled here.
+  void setHandles(const std::vector<int>& handles) {
+    const int nv = rest_.size();
+    handles_ = handles;
+    handle_.assign(nv, -1);
+    for (std::size_t k = 0; k < handles.size(); ++k) {
+      handle_[handles[k]] = k;
+    }
+    free_.clear();
+    row_.assign(nv, -1);
+    for (int i = 0; i < nv; ++i) {
+      if (handle_[i] < 0) {
+        row_[i] = free_.size();
+        free_.push_back(i);
+      }
+    }
+    const int* const offset = laplacian_.getOffsets();
+    std::vector<SparseMatrix::Entry> entries;
+    inverseDiagonal_.resize(free_.size());
+    for (std::size_t r = 0; r < free_.size(); ++r) {
+      const int i = free_[r];
+      for (int k = offset[i]; k < offset[i+1]; ++k) {
+        const int j = laplacian_.getColumns()[k];
+        if (row_[j] >= 0)
+          entries.push_back(SparseMatrix::Entry(r, row_[j], laplacian_.getValues()[k]));
+      }
+      const double d = laplacian_.get(i, i);
+      inverseDiagonal_[r] = d > 0 ? 1 / d : 1;
+    }
+    system_.build(free_.size(), entries);
+    b_.resize(free_.size());
+    unknown_.resize(free_.size());
+  }
+
+  // Local/global iterations per deform()
+  void setIterations(const int iterations) {
+    iterations_ = iterations;
+  }
+
+  // The solver of the global steps, with at most 10 iterations and a tolerance of 1e-4 by default
+  ConjugateGradient& getSolver() {
+    return solver_;
+  }
+
+  // Moves the handles to handlePositions and updates the other vertices
+  void deform(const std::vector<Cvec3f>& handlePositions) {
+    ThreadPool& pool = getThreadPool();
+    const int nv = rest_.size();
+    const int* const offset = laplacian_.getOffsets();
+    const int* const column = laplacian_.getColumns();
+    const double* const value = laplacian_.getValues();
+    for (std::size_t k = 0; k < handles_.size(); ++k) {
+      x_[handles_[k]] = Cvec3(handlePositions[k][0], handlePositions[k][1], handlePositions[k][2]);
+    }
+    if (nv == 0)
+      return;
+
+    for (int iteration = 0; iteration < iterations_; ++iteration) {
+      pool.parallelFor(nv, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+          Cvec3 a[3];                                       // columns of sum w e' e^T
+          for (int k = offset[i]; k < offset[i+1]; ++k) {
+            const int j = column[k];
+            const Cvec3 e = rest_[i] - rest_[j], ed = (x_[i] - x_[j]) * -value[k];
+            for (int c = 0; c < 3; ++c) {
+              a[c] += ed * e[c];
+            }
+          }
+          rotation_[i] = fit_rotation__(a, rotation_[i]);
+          matrix__(rotation_[i], &matrix_[3*i]);
+        }
+      });
+
+      // right-hand side sum w (R_i + R_j) / 2 (p_i - p_j), minus the handle columns
+      const int nf = free_.size();
+      pool.parallelFor(nf, [&](int, int begin, int end) {
+        for (int r = begin; r < end; ++r) {
+          const int i = free_[r];
+          Cvec3 b(0);
+          for (int k = offset[i]; k < offset[i+1]; ++k) {
+            const int j = column[k];
+            if (j == i)
+              continue;
+            const Cvec3 e = rest_[i] - rest_[j];
+            b += (rotate__(&matrix_[3*i], e) + rotate__(&matrix_[3*j], e)) * (-value[k] / 2);
+            if (handle_[j] >= 0)
+              b -= x_[j] * value[k];
+          }
+          b_[r] = b;
+          unknown_[r] = x_[i];
+        }
+      });
+      if (nf == 0)
+        continue;
+      solver_.solve(nf, [&](const Cvec3* x, Cvec3* y) {
+        system_.multiply(x, y);
+      }, &inverseDiagonal_[0], &b_[0], &unknown_[0]);
+      pool.parallelFor(nf, [&](int, int begin, int end) {
+        for (int r = begin; r < end; ++r) {
+          x_[free_[r]] = unknown_[r];
+        }
+      });
+    }
+    pool.parallelFor(nv, [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        position_[i] = Cvec3f(x_[i][0], x_[i][1], x_[i][2]);
+      }
+    });
+  }
+
+  // The positions found by the last deform(), or the rest positions before that
+  const Cvec3f* getPositions() const {
+    return position_.empty() ? NULL : &position_[0];
+  }
+
+  int getNumVertices() const {
+    return position_.size();
+  }
+
+private:
+  SparseMatrix laplacian_, system_;                         // system_ is laplacian_ over the free vertices
+  std::vector<Cvec3> rest_, x_, b_, unknown_;               // b_ and unknown_ per free vertex
+  std::vector<Cvec3f> position_;
+  std::vector<Quat> rotation_;                              // of every one-ring, kept as the starting point of the next fit
+  std::vector<Cvec3> matrix_;                               // the same as three rows per vertex
+  std::vector<int> handle_;                                 // index into handles_, or -1 for free vertices
+  std::vector<int> handles_;
+  std::vector<int> free_, row_;                             // the free vertices, and the row of every vertex in system_ (or -1)
+  std::vector<double> inverseDiagonal_;                     // of system_
+  ConjugateGradient solver_;
+  int iterations_;
+
+  static Cvec3 rotate__(const Cvec3* rows, const Cvec3& v) {
+    return Cvec3(dot(rows[0], v), dot(rows[1], v), dot(rows[2], v));
+  }
+
+  static void matrix__(const Quat& q, Cvec3* rows) {
+    const double w = q[0], x = q[1], y = q[2], z = q[3];
+    rows[0] = Cvec3(1 - 2*(y*y + z*z), 2*(x*y - w*z), 2*(x*z + w*y));
+    rows[1] = Cvec3(2*(x*y + w*z), 1 - 2*(x*x + z*z), 2*(y*z - w*x));
+    rows[2] = Cvec3(2*(x*z - w*y), 2*(y*z + w*x), 1 - 2*(x*x + y*y));
+  }
+
+  // Rotation R maximizing trace(R^T A) for the columns a of A, by turning q towards
+  // the columns. Starting from the last frame's rotation, two steps are plenty; the
+  // steps are small, so q + omega q / 2 stands in for the exact exp(omega) q.
+  static Quat fit_rotation__(const Cvec3 a[3], Quat q) {
+    for (int iteration = 0; iteration < 2; ++iteration) {
+      Cvec3 rows[3];
+      matrix__(q, rows);
+      Cvec3 torque(0);
+      double alignment = 0;
+      for (int c = 0; c < 3; ++c) {
+        const Cvec3 r(rows[0][c], rows[1][c], rows[2][c]);
+        torque += cross(r, a[c]);
+        alignment += dot(r, a[c]);
+      }
+      const Cvec3 omega = torque / (std::abs(alignment) + 1e-9);
+      const double angle = norm(omega);
+      if (angle < 1e-6)
+        break;
+      q = normalize(angle < 0.1 ? Quat(1, omega / 2) * q : Quat(std::cos(angle / 2), omega * (std::sin(angle / 2) / angle)) * q);
+    }
+    return q;
+  }
+};
+
+#endif
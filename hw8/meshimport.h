@@ -0,0 +1,490 @@
+#ifndef MESHIMPORT_H
+#define MESHIMPORT_H
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <climits>
+#include <cctype>
+#include <stdexcept>
+#include <charconv>
+#include <algorithm>
+
+#include "cvec.h"
+#include "threadpool.h"
+
+// Readers for Wavefront OBJ and PLY (ascii, binary little and big endian) files,
+// used by Mesh::load(). They produce the same flat face lists as Mesh::build():
+// offsets holds numFaces+1 entries into indices. Text is cut into chunks at line
+// breaks and the chunks are parsed in parallel on the thread pool with
+// std::from_chars, then merged by prefix sums over the per-chunk counts. Binary PLY
+// vertices are decoded in parallel directly, faces after a scan for their offsets.
+//
+// Only positions and polygons are read: OBJ texture coordinates, normals, groups and
+// materials and any other PLY element or property are skipped.
+class MeshImporter {
+public:
+  static bool isObj(const char filename[]) {
+    const std::size_t n = std::strlen(filename);
+    return n >= 4 && filename[n-4] == '.' && std::tolower(filename[n-3]) == 'o' &&
+           std::tolower(filename[n-2]) == 'b' && std::tolower(filename[n-1]) == 'j';
+  }
+
+  static bool isPly(const char* data, const std::size_t size) {
+    return size >= 4 && std::memcmp(data, "ply", 3) == 0 && (data[3] == '\n' || data[3] == '\r');
+  }
+
+  // Throw runtime_error naming filename on malformed input
+  static void readObj(const char* data, const std::size_t size, const char filename[],
+                      std::vector<Cvec3f>& positions, std::vector<int>& offsets, std::vector<int>& indices) {
+    std::vector<Chunk> chunks(numChunks__(size));
+    const std::vector<const char*> cuts = cut__(data, data + size, chunks.size());
+    getThreadPool().run(chunks.size(), [&](int c) {
+      parseObj__(cuts[c], cuts[c+1], chunks[c]);
+    });
+    merge__(chunks, filename, "OBJ", true, positions, offsets, indices);
+  }
+
+  static void readPly(const char* data, const std::size_t size, const char filename[],
+                      std::vector<Cvec3f>& positions, std::vector<int>& offsets, std::vector<int>& indices) {
+    PlyHeader header;
+    const char* body = parsePlyHeader__(data, data + size, header);
+    if (!body)
+      throw std::runtime_error(std::string("Malformed PLY header in ") + filename);
+    if (header.format == PlyHeader::ASCII)
+      readPlyAscii__(header, body, data + size, filename, positions, offsets, indices);
+    else
+      readPlyBinary__(header, body, data + size, filename, positions, offsets, indices);
+  }
+
+private:
+  // what one thread parsed: polygons as vertex counts and indices; indices at the
+  // positions in `relative` are relative to the chunk's first vertex (negative OBJ indices)
+  struct Chunk {
+    std::vector<Cvec3f> positions;
+    std::vector<int> counts, indices, relative;
+    bool error;
+
+    Chunk() : error(false) {}
+  };
+
+  static int numChunks__(const std::size_t size) {
+    const std::size_t minChunk = 1 << 16;
+    return (int)std::max<std::size_t>(1, std::min<std::size_t>(4 * getThreadPool().getNumThreads(), size / minChunk));
+  }
+
+  // n+1 cut points in [begin, end], each but the ends just past a line break
+  static std::vector<const char*> cut__(const char* begin, const char* end, const int n) {
+    std::vector<const char*> cuts(n + 1, end);
+    cuts[0] = begin;
+    for (int c = 1; c < n; ++c) {
+      const char* p = std::max(cuts[c-1], begin + (end - begin) * c / n);
+      const char* eol = p > begin && p[-1] == '\n' ? p - 1 : static_cast<const char*>(std::memchr(p, '\n', end - p));
+      cuts[c] = eol ? eol + 1 : end;
+    }
+    return cuts;
+  }
+
+  static const char* skipSpaces__(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+      ++p;
+    }
+    return p;
+  }
+
+  template<typename T>
+  static bool number__(const char*& p, const char* end, T& value) {
+    p = skipSpaces__(p, end);
+    if (p < end && *p == '+')
+      ++p;
+    const std::from_chars_result r = std::from_chars(p, end, value);
+    p = r.ptr;
+    return r.ec == std::errc();
+  }
+
+  static void parseObj__(const char* p, const char* end, Chunk& chunk) {
+    while (p < end && !chunk.error) {
+      const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+      if (!eol)
+        eol = end;
+      p = skipSpaces__(p, eol);
+      if (eol - p > 1 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+        float x, y, z;
+        ++p;
+        chunk.error = !number__(p, eol, x) || !number__(p, eol, y) || !number__(p, eol, z);
+        chunk.positions.push_back(Cvec3f(x, y, z));
+      }
+      else if (eol - p > 1 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+        int n = 0;
+        for (++p; (p = skipSpaces__(p, eol)) < eol && *p != '#'; ++n) {
+          int i;
+          if (!number__(p, eol, i) || i == 0) {
+            chunk.error = true;
+            break;
+          }
+          if (i < 0)
+            chunk.relative.push_back(chunk.indices.size());
+          chunk.indices.push_back(i < 0 ? (int)chunk.positions.size() + i : i - 1);
+          while (p < eol && *p != ' ' && *p != '\t' && *p != '\r') {  // texture and normal indices
+            ++p;
+          }
+        }
+        chunk.counts.push_back(n);
+        chunk.error = chunk.error || n < 3;
+      }
+      p = eol + 1;
+    }
+  }
+
+  // concatenates the chunks in order; without chunkPositions the positions were read already
+  static void merge__(std::vector<Chunk>& chunks, const char filename[], const char format[], const bool chunkPositions,
+                      std::vector<Cvec3f>& positions, std::vector<int>& offsets, std::vector<int>& indices) {
+    const int n = chunks.size();
+    std::vector<int> vertexBase(n + 1, 0), faceBase(n + 1, 0), indexBase(n + 1, 0);
+    for (int c = 0; c < n; ++c) {
+      if (chunks[c].error)
+        throw std::runtime_error(std::string("Malformed ") + format + " file " + filename);
+      vertexBase[c+1] = vertexBase[c] + chunks[c].positions.size();
+      faceBase[c+1] = faceBase[c] + chunks[c].counts.size();
+      indexBase[c+1] = indexBase[c] + chunks[c].indices.size();
+    }
+    if (chunkPositions)
+      positions.resize(vertexBase[n]);
+    offsets.resize(faceBase[n] + 1);
+    indices.resize(indexBase[n]);
+    offsets[faceBase[n]] = indexBase[n];
+    getThreadPool().run(n, [&](int c) {
+      Chunk& chunk = chunks[c];
+      std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + vertexBase[c]);
+      for (std::size_t i = 0; i < chunk.relative.size(); ++i) {
+        chunk.indices[chunk.relative[i]] += vertexBase[c];
+      }
+      std::copy(chunk.indices.begin(), chunk.indices.end(), indices.begin() + indexBase[c]);
+      for (int f = 0, k = indexBase[c]; f < (int)chunk.counts.size(); k += chunk.counts[f++]) {
+        offsets[faceBase[c] + f] = k;
+      }
+    });
+  }
+
+  // PLY
+
+  enum PlyType { PLY_INVALID, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64 };
+
+  struct PlyProperty {
+    std::string name;
+    PlyType type, countType;                                // countType is PLY_INVALID unless this is a list
+  };
+
+  struct PlyElement {
+    std::string name;
+    long long count;
+    std::vector<PlyProperty> properties;
+  };
+
+  struct PlyHeader {
+    enum Format { ASCII, BINARY_LITTLE_ENDIAN, BINARY_BIG_ENDIAN } format;
+    std::vector<PlyElement> elements;
+  };
+
+  static PlyType plyType__(const std::string& s) {
+    static const char* const names[][2] = {
+      {"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+      {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}
+    };
+    for (int i = 0; i < 8; ++i) {
+      if (s == names[i][0] || s == names[i][1])
+        return PlyType(PLY_INT8 + i);
+    }
+    return PLY_INVALID;
+  }
+
+  static int plySize__(const PlyType type) {
+    static const int sizes[] = {0, 1, 1, 2, 2, 4, 4, 4, 8};
+    return sizes[type];
+  }
+
+  // Returns the start of the body, or NULL on a malformed header
+  static const char* parsePlyHeader__(const char* p, const char* end, PlyHeader& header) {
+    bool format = false;
+    while (p < end) {
+      const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+      if (!eol)
+        return NULL;
+      std::vector<std::string> words;
+      for (const char* w = p; (w = skipSpaces__(w, eol)) < eol; ) {
+        const char* e = w;
+        while (e < eol && *e != ' ' && *e != '\t' && *e != '\r') {
+          ++e;
+        }
+        words.push_back(std::string(w, e));
+        w = e;
+      }
+      p = eol + 1;
+      if (words.empty() || words[0] == "ply" || words[0] == "comment" || words[0] == "obj_info")
+        continue;
+      if (words[0] == "end_header")
+        return format ? p : NULL;
+      if (words[0] == "format" && words.size() >= 2) {
+        format = true;
+        if (words[1] == "ascii")
+          header.format = PlyHeader::ASCII;
+        else if (words[1] == "binary_little_endian")
+          header.format = PlyHeader::BINARY_LITTLE_ENDIAN;
+        else if (words[1] == "binary_big_endian")
+          header.format = PlyHeader::BINARY_BIG_ENDIAN;
+        else
+          return NULL;
+      }
+      else if (words[0] == "element" && words.size() == 3) {
+        PlyElement e;
+        e.name = words[1];
+        e.count = std::atoll(words[2].c_str());
+        if (e.count < 0 || e.count > INT_MAX)                // elements are numbered with int
+          return NULL;
+        header.elements.push_back(e);
+      }
+      else if (words[0] == "property" && !header.elements.empty() && words.size() >= 3) {
+        PlyProperty prop;
+        const bool list = words[1] == "list" && words.size() == 5;
+        prop.countType = list ? plyType__(words[2]) : PLY_INVALID;
+        prop.type = plyType__(words[list ? 3 : 1]);
+        prop.name = words.back();
+        if (prop.type == PLY_INVALID || (list && prop.countType == PLY_INVALID))
+          return NULL;
+        header.elements.back().properties.push_back(prop);
+      }
+      else {
+        return NULL;
+      }
+    }
+    return NULL;
+  }
+
+  // The vertex element with its x, y and z properties and the face element with its
+  // vertex index list, or false if the file has none
+  static bool findPly__(const PlyHeader& header, int& vertex, int xyz[3], int& face, int& list) {
+    vertex = face = -1;
+    for (std::size_t e = 0; e < header.elements.size(); ++e) {
+      const std::vector<PlyProperty>& props = header.elements[e].properties;
+      if (header.elements[e].name == "vertex") {
+        vertex = e;
+        xyz[0] = xyz[1] = xyz[2] = -1;
+        for (std::size_t i = 0; i < props.size(); ++i) {
+          for (int k = 0; k < 3; ++k) {
+            if (props[i].name == std::string(1, 'x' + k) && props[i].countType == PLY_INVALID)
+              xyz[k] = i;
+          }
+        }
+        if (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0)
+          return false;
+      }
+      if (header.elements[e].name == "face") {
+        face = e;
+        list = -1;
+        for (std::size_t i = 0; i < props.size() && list < 0; ++i) {
+          if (props[i].countType != PLY_INVALID && (props[i].name == "vertex_indices" || props[i].name == "vertex_index"))
+            list = i;
+        }
+        for (std::size_t i = 0; i < props.size() && list < 0; ++i) {
+          if (props[i].countType != PLY_INVALID)
+            list = i;
+        }
+        if (list < 0)
+          return false;
+      }
+    }
+    return vertex >= 0;
+  }
+
+  static void readPlyAscii__(const PlyHeader& header, const char* body, const char* end, const char filename[],
+                             std::vector<Cvec3f>& positions, std::vector<int>& offsets, std::vector<int>& indices) {
+    int vertex, xyz[3], face, list = -1;
+    if (!findPly__(header, vertex, xyz, face, list))
+      throw std::runtime_error(std::string("PLY file without vertex positions ") + filename);
+    // every record is one line: number the lines of each chunk, then parse the chunks
+    std::vector<Chunk> chunks(numChunks__(end - body));
+    const std::vector<const char*> cuts = cut__(body, end, chunks.size());
+    std::vector<long long> firstLine(chunks.size() + 1, 0);
+    getThreadPool().run(chunks.size(), [&](int c) {
+      firstLine[c+1] = std::count(cuts[c], cuts[c+1], '\n') + (c + 1 == (int)chunks.size() && cuts[c+1] > cuts[c] && cuts[c+1][-1] != '\n');
+    });
+    for (std::size_t c = 0; c < chunks.size(); ++c) {
+      firstLine[c+1] += firstLine[c];
+    }
+    std::vector<long long> elementLine(header.elements.size() + 1, 0);
+    for (std::size_t e = 0; e < header.elements.size(); ++e) {
+      elementLine[e+1] = elementLine[e] + header.elements[e].count;
+    }
+    if (firstLine[chunks.size()] < elementLine[header.elements.size()])
+      throw std::runtime_error(std::string("Truncated PLY file ") + filename);
+    positions.resize(header.elements[vertex].count);
+
+    getThreadPool().run(chunks.size(), [&](int c) {
+      Chunk& chunk = chunks[c];
+      long long line = firstLine[c];
+      for (const char* p = cuts[c]; p < cuts[c+1] && !chunk.error; ++line) {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', cuts[c+1] - p));
+        if (!eol)
+          eol = cuts[c+1];
+        const int e = std::upper_bound(elementLine.begin(), elementLine.end(), line) - elementLine.begin() - 1;
+        if (e == vertex || e == face) {
+          const std::vector<PlyProperty>& props = header.elements[e].properties;
+          double value[3] = {0, 0, 0};
+          for (int i = 0; i < (int)props.size() && !chunk.error; ++i) {
+            if (props[i].countType != PLY_INVALID) {
+              int n = 0;
+              chunk.error = !number__(p, eol, n) || n < 0;
+              for (int j = 0; j < n && !chunk.error; ++j) {
+                double v;
+                chunk.error = !number__(p, eol, v);
+                if (e == face && i == list)
+                  chunk.indices.push_back((int)v);
+              }
+              if (e == face && i == list) {
+                chunk.counts.push_back(n);
+                chunk.error = chunk.error || n < 3;
+              }
+            }
+            else {
+              double v;
+              chunk.error = !number__(p, eol, v);
+              for (int k = 0; k < 3; ++k) {
+                if (e == vertex && i == xyz[k])
+                  value[k] = v;
+              }
+            }
+          }
+          if (e == vertex)
+            positions[line - elementLine[vertex]] = Cvec3f(value[0], value[1], value[2]);
+        }
+        p = eol + 1;
+      }
+    });
+    merge__(chunks, filename, "PLY", false, positions, offsets, indices);
+  }
+
+  // a binary value of the given type at p, swapping the bytes if needed
+  static double plyValue__(const char* p, const PlyType type, const bool swap) {
+    char b[8];
+    const int n = plySize__(type);
+    for (int i = 0; i < n; ++i) {
+      b[i] = p[swap ? n - 1 - i : i];
+    }
+    switch (type) {
+    case PLY_INT8:    { signed char v;     std::memcpy(&v, b, 1); return v; }
+    case PLY_UINT8:   { unsigned char v;   std::memcpy(&v, b, 1); return v; }
+    case PLY_INT16:   { short v;           std::memcpy(&v, b, 2); return v; }
+    case PLY_UINT16:  { unsigned short v;  std::memcpy(&v, b, 2); return v; }
+    case PLY_INT32:   { int v;             std::memcpy(&v, b, 4); return v; }
+    case PLY_UINT32:  { unsigned int v;    std::memcpy(&v, b, 4); return v; }
+    case PLY_FLOAT32: { float v;           std::memcpy(&v, b, 4); return v; }
+    case PLY_FLOAT64: { double v;          std::memcpy(&v, b, 8); return v; }
+    default:          return 0;
+    }
+  }
+
+  static void readPlyBinary__(const PlyHeader& header, const char* body, const char* bodyEnd, const char filename[],
+                              std::vector<Cvec3f>& positions, std::vector<int>& offsets, std::vector<int>& indices) {
+    int vertex, xyz[3], face, list = -1;
+    if (!findPly__(header, vertex, xyz, face, list))
+      throw std::runtime_error(std::string("PLY file without vertex positions ") + filename);
+    const unsigned short one = 1;
+    const bool littleEndian = *reinterpret_cast<const unsigned char*>(&one) == 1;
+    const bool swap = littleEndian != (header.format == PlyHeader::BINARY_LITTLE_ENDIAN);
+    const std::runtime_error truncated(std::string("Truncated PLY file ") + filename);
+
+    const char* p = body;
+    for (std::size_t e = 0; e < header.elements.size(); ++e) {
+      const PlyElement& element = header.elements[e];
+      const std::vector<PlyProperty>& props = element.properties;
+      bool fixed = true;
+      int size = 0, at[3] = {0, 0, 0};
+      for (std::size_t i = 0; i < props.size(); ++i) {
+        for (int k = 0; k < 3; ++k) {
+          if ((int)e == vertex && (int)i == xyz[k])
+            at[k] = size;
+        }
+        fixed = fixed && props[i].countType == PLY_INVALID;
+        size += plySize__(props[i].type);
+      }
+      if (fixed) {                                          // records of one size: decode them in parallel
+        if ((bodyEnd - p) / std::max(size, 1) < element.count)
+          throw truncated;
+        if ((int)e == vertex) {
+          positions.resize(element.count);
+          getThreadPool().parallelFor(element.count, [&](int, int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+              const char* r = p + (std::size_t)i * size;
+              positions[i] = Cvec3f(plyValue__(r + at[0], props[xyz[0]].type, swap),
+                                    plyValue__(r + at[1], props[xyz[1]].type, swap),
+                                    plyValue__(r + at[2], props[xyz[2]].type, swap));
+            }
+          });
+        }
+        p += (std::size_t)size * element.count;
+        continue;
+      }
+      // records with lists: one scan for where each record's index list starts,
+      // then the lists are decoded in parallel. Positions of vertices with lists are
+      // decoded during the scan.
+      std::vector<const char*> start;
+      std::vector<int> count;
+      if ((int)e == face) {
+        start.resize(element.count);
+        count.resize(element.count);
+      }
+      if ((int)e == vertex)
+        positions.resize(element.count);
+      for (long long r = 0; r < element.count; ++r) {
+        for (std::size_t i = 0; i < props.size(); ++i) {
+          if (props[i].countType == PLY_INVALID) {
+            if (bodyEnd - p < plySize__(props[i].type))
+              throw truncated;
+            for (int k = 0; k < 3; ++k) {
+              if ((int)e == vertex && (int)i == xyz[k])
+                positions[r][k] = plyValue__(p, props[i].type, swap);
+            }
+            p += plySize__(props[i].type);
+            continue;
+          }
+          if (bodyEnd - p < plySize__(props[i].countType))
+            throw truncated;
+          const double n = plyValue__(p, props[i].countType, swap);
+          p += plySize__(props[i].countType);
+          if (!(n >= 0))                                    // would move p back
+            throw std::runtime_error(std::string("Malformed PLY file ") + filename);
+          if (n > (bodyEnd - p) / plySize__(props[i].type))
+            throw truncated;
+          if ((int)e == face && (int)i == list) {
+            start[r] = p;
+            count[r] = (int)n;
+          }
+          p += (std::size_t)n * plySize__(props[i].type);
+        }
+      }
+      if ((int)e != face)
+        continue;
+      offsets.resize(element.count + 1);
+      offsets[0] = 0;
+      for (long long r = 0; r < element.count; ++r) {
+        if (count[r] < 3 || count[r] > INT_MAX - offsets[r])
+          throw std::runtime_error(std::string("Malformed PLY file ") + filename);
+        offsets[r+1] = offsets[r] + count[r];
+      }
+      indices.resize(offsets[element.count]);
+      const PlyType type = props[list].type;
+      getThreadPool().parallelFor(element.count, [&](int, int begin, int end) {
+        for (int r = begin; r < end; ++r) {
+          for (int j = 0; j < count[r]; ++j) {
+            indices[offsets[r] + j] = (int)plyValue__(start[r] + j * plySize__(type), type, swap);
+          }
+        }
+      });
+    }
+    if (face < 0)
+      offsets.assign(1, 0);
+  }
+};
+
+#endif
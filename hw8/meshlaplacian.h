@@ -0,0 +1,143 @@
+#ifndef MESHLAPLACIAN_H
+#define MESHLAPLACIAN_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "cvec.h"
+#include "mesh.h"
+#include "sparsematrix.h"
+#include "threadpool.h"
+
+// Laplacian L = D - W of a mesh, a symmetric positive semi-definite SparseMatrix with
+// a row per vertex, and the lumped mass matrix M (vertex areas), for smoothing and
+// deformation. Weightings:
+//   UNIFORM    w(i, j) = 1 for every edge, with M = I (the umbrella operator)
+//   COTANGENT  w(i, j) = (cot a + cot b) / 2 over the angles opposite the edge, with M
+//              a third of the area of the triangles around each vertex. Polygons are
+//              fanned from their first corner, so quads get a diagonal entry.
+// The weights are taken from the positions at build() and kept as the mesh moves.
+class MeshLaplacian {
+public:
+  enum Weighting {
+    UNIFORM,
+    COTANGENT
+  };
+
+  MeshLaplacian() : lambda_(-1) {}
+
+  void build(const Mesh& m, const Weighting weighting) {
+    const int nv = m.getNumVertices(), nf = m.getNumFaces();
+    const Cvec3f* const p = m.getPositions();
+    const int* const offset = m.getFaceVertexOffsets();
+    const int* const index = m.getFaceVertexIndices();
+    entries_.clear();
+    mass_.assign(nv, weighting == UNIFORM ? 1 : 0);
+    if (weighting == UNIFORM) {
+      m.buildAdjacency();
+      const int* const ring = m.getVertexRingOffsets();
+      const int* const neighbor = m.getVertexNeighbors();
+      for (int i = 0; i < nv; ++i) {
+        for (int k = ring[i]; k < ring[i+1]; ++k) {
+          entries_.push_back(SparseMatrix::Entry(i, neighbor[k], -1));
+        }
+        entries_.push_back(SparseMatrix::Entry(i, i, ring[i+1] - ring[i]));
+      }
+    }
+    else {
+      for (int f = 0; f < nf; ++f) {
+        const int* const v = index + offset[f];
+        for (int j = 1; j + 1 < offset[f+1] - offset[f]; ++j) {
+          const int t[3] = { v[0], v[j], v[j+1] };
+          const double area = norm(cross(d__(p[t[1]]) - d__(p[t[0]]), d__(p[t[2]]) - d__(p[t[0]]))) / 2;
+          for (int k = 0; k < 3; ++k) {
+            // the angle at t[k] is opposite the edge (a, b)
+            const int a = t[(k+1) % 3], b = t[(k+2) % 3];
+            const Cvec3 ea = d__(p[a]) - d__(p[t[k]]), eb = d__(p[b]) - d__(p[t[k]]);
+            const double s = norm(cross(ea, eb));
+            const double w = s > 0 ? dot(ea, eb) / s / 2 : 0;
+            entries_.push_back(SparseMatrix::Entry(a, b, -w));
+            entries_.push_back(SparseMatrix::Entry(b, a, -w));
+            entries_.push_back(SparseMatrix::Entry(a, a, w));
+            entries_.push_back(SparseMatrix::Entry(b, b, w));
+            mass_[t[k]] += area / 3;
+          }
+        }
+      }
+      for (int i = 0; i < nv; ++i) {
+        entries_.push_back(SparseMatrix::Entry(i, i, 0));  // every row has its diagonal
+        if (!(mass_[i] > 0))
+          mass_[i] = 1;                                     // vertices in no face (or only in degenerate ones) stay put
+      }
+    }
+    laplacian_.build(nv, entries_);
+    lambda_ = -1;
+  }
+
+  const SparseMatrix& getMatrix() const {
+    return laplacian_;
+  }
+
+  // Lumped mass of every vertex
+  const std::vector<double>& getMass() const {
+    return mass_;
+  }
+
+  // The solver used by smooth()
+  ConjugateGradient& getSolver() {
+    return solver_;
+  }
+
+  // One step of implicit (backward Euler) Laplacian smoothing: solves
+  // (M + lambda L) p' = M p, starting from p, which damps features of size below
+  // about sqrt(lambda) without the step size limit of explicit smoothing. The system
+  // is reassembled only when lambda changes. Returns the number of CG iterations.
+  int smooth(const Cvec3f* in, Cvec3f* out, const double lambda) {
+    const int nv = laplacian_.getNumRows();
+    if (lambda != lambda_) {
+      system_ = laplacian_;
+      system_.scale(lambda);
+      system_.addToDiagonal(mass_);
+      inverseDiagonal_.resize(nv);
+      for (int i = 0; i < nv; ++i) {
+        inverseDiagonal_[i] = 1 / system_.get(i, i);
+      }
+      lambda_ = lambda;
+    }
+    b_.resize(nv);
+    x_.resize(nv);
+    for (int i = 0; i < nv; ++i) {
+      x_[i] = d__(in[i]);
+      b_[i] = x_[i] * mass_[i];
+    }
+    if (nv == 0)
+      return 0;
+    solver_.solve(nv, [&](const Cvec3* x, Cvec3* y) {
+      system_.multiply(x, y);
+    }, &inverseDiagonal_[0], &b_[0], &x_[0]);
+    for (int i = 0; i < nv; ++i) {
+      out[i] = Cvec3f(x_[i][0], x_[i][1], x_[i][2]);
+    }
+    return solver_.getIterations();
+  }
+
+  // The same on the positions of m, which must have the connectivity given to build()
+  int smooth(Mesh& m, const double lambda) {
+    return smooth(m.getPositions(), m.getPositions(), lambda);
+  }
+
+private:
+  SparseMatrix laplacian_, system_;                         // system_ = M + lambda_ L
+  std::vector<double> mass_, inverseDiagonal_;
+  std::vector<SparseMatrix::Entry> entries_;
+  std::vector<Cvec3> b_, x_;
+  ConjugateGradient solver_;
+  double lambda_;
+
+  static Cvec3 d__(const Cvec3f& v) {
+    return Cvec3(v[0], v[1], v[2]);
+  }
+};
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef MESHLOD_H
+#define MESHLOD_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "cvec.h"
+#include "mesh.h"
+#include "arcball.h"
+
+// Picks the subdivision level of a mesh from its size on screen. Each Catmull-Clark
+// step halves the edge lengths, so the level that brings the average edge down to
+// the target length in pixels is log2(projected edge / target), rounded up. The level
+// only changes once that estimate is more than the hysteresis past the boundary of
+// the current level, so a mesh sitting on a boundary does not pop back and forth.
+//
+// Below level 0 it can go on to decimated versions of the mesh (see MeshDecimator),
+// returned as negative levels: -k for the k-th decimated mesh, picked as the coarsest
+// one whose error stays under a given number of pixels on screen.
+class MeshLod {
+public:
+  MeshLod() : radius_(0), edge_(0), targetEdgePixels_(4), hysteresis_(0.25), maxErrorPixels_(1), level_(0) {}
+
+  // Measures m. Its vertices are assumed to stay within radiusScale times their
+  // distance from the origin of the mesh, however it is deformed.
+  void setMesh(const Mesh& m, const double radiusScale = 1) {
+    const Cvec3f* p = m.getPositions();
+    const int* offset = m.getFaceVertexOffsets();
+    const int* index = m.getFaceVertexIndices();
+    double radius = 0, edges = 0;
+    for (int i = 0; i < m.getNumVertices(); ++i) {
+      radius = std::max(radius, (double)norm(p[i]));
+    }
+    for (int i = 0; i < m.getNumFaces(); ++i) {             // every interior edge is seen twice, which keeps the mean
+      for (int j = offset[i], k = offset[i+1]-1; j < offset[i+1]; k = j++) {
+        edges += norm(p[index[j]] - p[index[k]]);
+      }
+    }
+    radius_ = radius * radiusScale;
+    edge_ = m.getNumFaces() ? edges / offset[m.getNumFaces()] : 0;
+    errors_.clear();
+    level_ = 0;
+  }
+
+  // Errors of the decimated meshes, finest first, and the largest error in pixels
+  // a decimated mesh may have on screen
+  void setDecimationErrors(const std::vector<double>& errors, const double maxErrorPixels = 1) {
+    errors_ = errors;
+    maxErrorPixels_ = maxErrorPixels;
+    level_ = std::max(level_, 0);
+  }
+
+  // Average edge length in pixels that the chosen level aims for
+  void setTargetEdgePixels(const double pixels) {
+    targetEdgePixels_ = pixels;
+  }
+
+  // How far, in levels, the estimate must move past a level boundary to switch
+  void setHysteresis(const double levels) {
+    hysteresis_ = levels;
+  }
+
+  int getLevel() const {
+    return level_;
+  }
+
+  // Returns the level in [-number of decimation errors, maxLevel] for the mesh with its
+  // origin at center, in eye coordinates, seen through the frustum given by frustFovY
+  // (in degrees), the screen size and the near and far planes (negative z). Meshes
+  // outside the frustum get the lowest level.
+  int update(const Cvec3& center, const int maxLevel, const double frustFovY,
+             const int screenWidth, const int screenHeight, const double frustNear, const double frustFar) {
+    if (!visible__(center, frustFovY, screenWidth, screenHeight, frustNear, frustFar)) {
+      level_ = -(int)errors_.size();
+      return level_;
+    }
+    // the point of the bounding sphere closest to the eye has the largest edges on screen
+    const double z = std::min(center[2] + radius_, frustNear);
+    const double pixelsPerUnit = 1 / getScreenToEyeScale(z, frustFovY, screenHeight);
+    const double estimate = std::log(std::max(edge_ * pixelsPerUnit, 1e-9) / targetEdgePixels_) / std::log(2.0);
+    int level = std::max(level_, 0);
+    if (estimate > level + hysteresis_ || estimate < level - 1 - hysteresis_)
+      level = (int)std::ceil(estimate);
+    level = std::max(0, std::min(maxLevel, level));
+    if (level == 0) {
+      // coarsen while the next mesh is clearly small enough, refine while the current one is clearly too coarse
+      const double margin = 1 + hysteresis_;
+      int k = std::max(-level_, 0);
+      while (k < (int)errors_.size() && errors_[k] * pixelsPerUnit * margin <= maxErrorPixels_) {
+        ++k;
+      }
+      while (k > 0 && errors_[k-1] * pixelsPerUnit > maxErrorPixels_ * margin) {
+        --k;
+      }
+      level = -k;
+    }
+    level_ = level;
+    return level_;
+  }
+
+private:
+  double radius_;                                           // bounding sphere around the mesh origin
+  double edge_;                                             // average edge length
+  double targetEdgePixels_;
+  double hysteresis_;
+  std::vector<double> errors_;                              // of the decimated meshes
+  double maxErrorPixels_;
+  int level_;
+
+  // false if the bounding sphere is entirely outside the view frustum
+  bool visible__(const Cvec3& c, const double frustFovY, const int screenWidth, const int screenHeight,
+                 const double frustNear, const double frustFar) const {
+    if (c[2] - radius_ > frustNear || c[2] + radius_ < frustFar)
+      return false;
+    const double ty = std::tan(frustFovY * CS175_PI / 360), tx = ty * screenWidth / screenHeight;
+    // signed distances past the side planes, which pass through the eye
+    return (std::abs(c[0]) + c[2] * tx) / std::sqrt(1 + tx * tx) <= radius_ &&
+           (std::abs(c[1]) + c[2] * ty) / std::sqrt(1 + ty * ty) <= radius_;
+  }
+};
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef MESHPIPELINE_H
+#define MESHPIPELINE_H
+
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cassert>
+
+#include "cvec.h"
+#include "vertex.h"
+#include "mesh.h"
+#include "stenciltable.h"
+#include "vertexnormals.h"
+#include "meshdecimator.h"
+#include "indexoptimizer.h"
+#include "threadpool.h"
+
+// Turns an animated control mesh into vertex and index buffers ready for upload,
+// one frame per update(), in three stages:
+//   deform   moves the control vertices
+//   refine   subdivides them, with stencil tables or through a direct subdivision callback
+//   shade    computes the normals and fills the VertexPN and 32 bit index buffers
+// Every buffer is kept between frames, so once a subdivision level has been seen a
+// frame neither allocates nor copies the refined mesh. The stencils and refined mesh
+// of every level used so far stay cached, so switching levels (e.g. for level of
+// detail) is cheap. Negative levels draw decimated versions of the mesh, without
+// subdivision. With adaptive refinement on, only the regions picked by the adaptive
+// options are subdivided (see StencilTable::buildAdaptive). The index buffer is only
+// rebuilt when the level, the refinement or the shading mode changes, and is then
+// reordered for the vertex cache and overdraw (see IndexOptimizer).
+class MeshPipeline {
+public:
+  // Milliseconds spent in each stage by the last update()
+  struct Timings {
+    double deform, refine, shade;
+
+    Timings() : deform(0), refine(0), shade(0) {}
+  };
+
+  MeshPipeline()
+    : levels_(0), useStencils_(true), flat_(false), adaptive_(false), optimizeIndices_(true),
+      weighting_(VertexNormals::AREA_WEIGHTED), indexValid_(false), indexLevels_(0), indexFlat_(false), indexAdaptive_(false), refined_(&base_) {}
+
+  void setMesh(const Mesh& m) {
+    base_ = m;
+    cache_.clear();
+    adaptiveCache_.clear();
+    decimated_.clear();
+    indexValid_ = false;
+    refined_ = &base_;
+  }
+
+  // Simplified versions of the mesh set with setMesh(), coarsest last. Level -k draws chain[k-1].
+  void setDecimatedMeshes(const std::vector<MeshDecimator::Level>& chain) {
+    decimated_.resize(chain.size());
+    for (std::size_t i = 0; i < chain.size(); ++i) {
+      decimated_[i] = chain[i].mesh;
+    }
+    indexValid_ = false;
+  }
+
+  int getNumDecimatedMeshes() const {
+    return decimated_.size();
+  }
+
+  const Mesh& getMesh() const {
+    return base_;
+  }
+
+  // Subdivision steps, or minus the decimated mesh to draw, in [-getNumDecimatedMeshes(), ...)
+  void setLevels(const int levels) {
+    assert(levels >= -(int)decimated_.size());
+    levels_ = levels;
+  }
+
+  void setUseStencils(const bool useStencils) {
+    useStencils_ = useStencils;
+  }
+
+  void setFlatShading(const bool flat) {
+    flat_ = flat;
+  }
+
+  // Adaptive refinement always goes through stencil tables, whatever setUseStencils()
+  // says, since the refined topology is picked once from the undeformed mesh
+  void setAdaptive(const bool adaptive) {
+    adaptive_ = adaptive;
+  }
+
+  // Reorder the triangles of each new index buffer for the GPU vertex cache and overdraw
+  void setOptimizeIndices(const bool optimize) {
+    optimizeIndices_ = optimize;
+    indexValid_ = false;
+  }
+
+  void setAdaptiveOptions(const StencilTable::AdaptiveOptions& options) {
+    adaptiveOptions_ = options;
+    adaptiveCache_.clear();
+    indexValid_ = false;
+  }
+
+  void setNormalWeighting(const VertexNormals::Weighting weighting) {
+    weighting_ = weighting;
+  }
+
+  // Runs the three stages. deform(i, p) returns the new position of control vertex i,
+  // currently at p, and is called from several threads. subdivide(mesh, levels) refines
+  // mesh in place and is only called when stencil tables are off.
+  template<typename Deform, typename Subdivide>
+  void update(Deform deform, Subdivide subdivide) {
+    const Clock::time_point start = Clock::now();
+    const Mesh& source = levels_ < 0 ? decimated_[-levels_ - 1] : base_;
+    const bool adaptive = adaptive_ && levels_ > 0;
+    const bool stencils = (useStencils_ || adaptive) && levels_ >= 0;
+    const int nv = source.getNumVertices();
+    const Cvec3f* control = source.getPositions();
+    Cvec3f* deformed;
+    if (stencils) {
+      deformed_.resize(nv);
+      deformed = nv ? &deformed_[0] : NULL;
+    }
+    else {
+      direct_ = source;                                     // copies the control level only
+      deformed = direct_.getPositions();
+    }
+    getThreadPool().parallelFor(nv, [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        deformed[i] = deform(i, control[i]);
+      }
+    });
+
+    const Clock::time_point deformed_at = Clock::now();
+    if (stencils) {
+      std::vector<std::shared_ptr<Level> >& cache = adaptive ? adaptiveCache_ : cache_;
+      if ((int)cache.size() <= levels_)
+        cache.resize(levels_ + 1);
+      if (!cache[levels_]) {
+        cache[levels_].reset(new Level());
+        if (adaptive)
+          cache[levels_]->stencils.buildAdaptive(base_, levels_, adaptiveOptions_, cache[levels_]->mesh);
+        else
+          cache[levels_]->stencils.build(base_, levels_, cache[levels_]->mesh);
+      }
+      cache[levels_]->stencils.apply(deformed, cache[levels_]->mesh.getPositions());
+      refined_ = &cache[levels_]->mesh;
+    }
+    else {
+      if (levels_ > 0)
+        subdivide(direct_, levels_);
+      refined_ = &direct_;
+    }
+
+    const Clock::time_point refined_at = Clock::now();
+    shade__(adaptive);
+
+    timings_.deform = ms__(start, deformed_at);
+    timings_.refine = ms__(deformed_at, refined_at);
+    timings_.shade = ms__(refined_at, Clock::now());
+  }
+
+  const Mesh& getRefinedMesh() const {
+    return *refined_;
+  }
+
+  const VertexPN* getVertices() const {
+    return vertices_.empty() ? NULL : &vertices_[0];
+  }
+
+  int getNumVertices() const {
+    return vertices_.size();
+  }
+
+  const unsigned int* getIndices() const {
+    return indices_.empty() ? NULL : &indices_[0];
+  }
+
+  int getNumIndices() const {
+    return indices_.size();
+  }
+
+  const Timings& getTimings() const {
+    return timings_;
+  }
+
+  // Holds the ACMR of the last index buffer built, before and after reordering
+  const IndexOptimizer& getIndexOptimizer() const {
+    return optimizer_;
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  // base_ refined to one level: the stencils and the mesh they are applied to
+  struct Level {
+    StencilTable stencils;
+    Mesh mesh;
+  };
+
+  Mesh base_, direct_;                                      // direct_ is subdivided in place when stencils are off
+  std::vector<Mesh> decimated_;
+  std::vector<std::shared_ptr<Level> > cache_;              // indexed by level, built on first use
+  std::vector<std::shared_ptr<Level> > adaptiveCache_;      // the same for adaptive refinement
+  StencilTable::AdaptiveOptions adaptiveOptions_;
+  VertexNormals normals_;
+  std::vector<Cvec3f> deformed_;                            // deformed control positions, for the stencils
+  std::vector<VertexPN> vertices_;
+  std::vector<unsigned int> indices_;
+  IndexOptimizer optimizer_;
+  Timings timings_;
+
+  int levels_;
+  bool useStencils_, flat_, adaptive_, optimizeIndices_;
+  VertexNormals::Weighting weighting_;
+  bool indexValid_;                                         // false until indices_ is built, and after a change that invalidates it
+  int indexLevels_;                                         // levels, shading and refinement indices_ was built for
+  bool indexFlat_, indexAdaptive_;
+  const Mesh* refined_;                                     // the mesh shaded by the last update()
+
+  MeshPipeline(const MeshPipeline&);
+  MeshPipeline& operator = (const MeshPipeline&);
+
+  static double ms__(const Clock::time_point& begin, const Clock::time_point& end) {
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+  }
+
+  // Smooth shading emits one vertex per mesh vertex and flat shading one vertex per
+  // face corner, since each face has its own normal.
+  void shade__(const bool adaptive) {
+    ThreadPool& pool = getThreadPool();
+    const Cvec3f* position = refined_->getPositions();
+    const int* offset = refined_->getFaceVertexOffsets();
+    const int* index = refined_->getFaceVertexIndices();
+    const int nf = refined_->getNumFaces();
+
+    if (flat_) {
+      vertices_.resize(offset[nf]);
+      pool.parallelFor(nf, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+          Cvec3f normal(0);
+          for (int j = offset[i], k = offset[i+1]-1; j < offset[i+1]; k = j++) {
+            normal += cross(position[index[k]], position[index[j]]);
+          }
+          const float s = norm(normal);                   // degenerate faces keep a zero normal
+          if (s > 0)
+            normal /= s;
+          for (int j = offset[i]; j < offset[i+1]; ++j) {
+            vertices_[j] = VertexPN(position[index[j]], normal);
+          }
+        }
+      });
+    }
+    else {
+      vertices_.resize(refined_->getNumVertices());
+      normals_.compute(*refined_, weighting_, [&](int i, const Cvec3f& p, const Cvec3f& n) {
+        vertices_[i] = VertexPN(p, n);
+      });
+    }
+
+    if (indexValid_ && indexLevels_ == levels_ && indexFlat_ == flat_ && indexAdaptive_ == adaptive)
+      return;
+    indexValid_ = true;
+    indexLevels_ = levels_;
+    indexFlat_ = flat_;
+    indexAdaptive_ = adaptive;
+    // Polygons are fanned from their first corner. Face i has offset[i] corners before it,
+    // so 3 * (offset[i] - 2i) indices before it. Flat shading indexes corners, smooth
+    // shading mesh vertices.
+    indices_.resize(3 * (offset[nf] - 2 * nf));
+    pool.parallelFor(nf, [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        const int first = flat_ ? offset[i] : index[offset[i]];
+        for (int j = offset[i] + 1, k = 3 * (offset[i] - 2 * i); j < offset[i+1] - 1; ++j) {
+          indices_[k++] = first;
+          indices_[k++] = flat_ ? j : index[j];
+          indices_[k++] = flat_ ? j + 1 : index[j + 1];
+        }
+      }
+    });
+    if (optimizeIndices_ && !indices_.empty())
+      optimizer_.optimize(&vertices_[0], vertices_.size(), &indices_[0], indices_.size());
+  }
+};
+
+#endif
@@ -154,7 +154,7 @@ inline Matrix4 quatToMatrix(const Quat& q) {
   return r;
 }
 
-inline Quat cn(Quat& q) {
+inline Quat cn(Quat q) {
     if (q[0] < 0) {
         q[0] = -q[0];
         q[1] = -q[1];
@@ -164,23 +164,15 @@ inline Quat cn(Quat& q) {
     return q;
 }
 
+// q = (cos a, v sin a) to the i: (cos(a i), v sin(a i)), with sin a = |v|. QuatBatch
+// does the same for many quaternions at once.
 inline Quat power(const Quat& q, float i) {
-    
-    if (abs(q[0]-1) < CS175_EPS) return q;
-
- 
-    Cvec3 rotation_axis = Cvec3(q[1], q[2], q[3]).normalize();
-
-    double sin0;
-
-    if (q[1] != 0) sin0 = q[1] / rotation_axis[0];
-    else if (q[2] != 0) sin0 = q[2] / rotation_axis[1];
-    else sin0 = q[3] / rotation_axis[2];
-
-    double angle = atan2(sin0, q[0]);
-
-    return Quat(cos(angle * i), rotation_axis * sin(angle * i));
+    const double s = std::sqrt(q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    if (s == 0) return q;
 
+    const double angle = std::atan2(s, q[0]);
+    const double f = std::sin(angle * i) / s;
+    return Quat(std::cos(angle * i), q[1] * f, q[2] * f, q[3] * f);
 }
 
 #endif
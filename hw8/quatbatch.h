@@ -0,0 +1,276 @@
+#ifndef QUATBATCH_H
+#define QUATBATCH_H
+
+#include <cmath>
+
+#if defined(__AVX__)
+#   include <immintrin.h>
+#   define QUATBATCH_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   include <emmintrin.h>
+#   define QUATBATCH_SSE
+#endif
+
+// Quaternion interpolation over many quaternions at once, in single precision. A batch
+// of n quaternions is stored as structure of arrays: the w of quaternion k at q[k],
+// its x at q[stride + k], y at q[2*stride + k] and z at q[3*stride + k], which is the
+// layout of KeyframeStore. Outputs may alias inputs of the same index. Quaternions are
+// assumed to be unit length, so inverses are conjugates.
+//
+// Precision picks how angles are evaluated:
+//   EXACT       std::atan2, std::sin and std::cos, one quaternion at a time
+//   POLYNOMIAL  polynomials, without branches, 8 quaternions at a time with AVX or 4
+//               with SSE2 where the compiler targets them. For exponents in [0, 1] the
+//               results differ from the exact (double precision) ones by at most 4e-7
+//               per component, against 3e-7 for EXACT, i.e. float rounding.
+class QuatBatch {
+public:
+  enum Precision {
+    EXACT,
+    POLYNOMIAL
+  };
+
+  // out = a b
+  static void multiply(const int n, const float* a, const int aStride, const float* b, const int bStride,
+                       float* out, const int outStride) {
+    int k = 0;
+#if defined(QUATBATCH_AVX) || defined(QUATBATCH_SSE)
+    for (; k + Lanes::SIZE <= n; k += Lanes::SIZE) {
+      multiply__<Lanes>(k, a, aStride, b, bStride, out, outStride);
+    }
+#endif
+    for (; k < n; ++k) {
+      multiply__<float>(k, a, aStride, b, bStride, out, outStride);
+    }
+  }
+
+  // out = power(cn(q), t): the rotation of q, taken the short way round, scaled by t
+  static void power(const int n, const float* q, const int qStride, const float t,
+                    float* out, const int outStride, const Precision precision = EXACT) {
+    int k = 0;
+    if (precision == EXACT) {
+      for (; k < n; ++k) {
+        power__<float, Exact>(k, q, qStride, t, out, outStride);
+      }
+      return;
+    }
+#if defined(QUATBATCH_AVX) || defined(QUATBATCH_SSE)
+    for (; k + Lanes::SIZE <= n; k += Lanes::SIZE) {
+      power__<Lanes, Polynomial>(k, q, qStride, t, out, outStride);
+    }
+#endif
+    for (; k < n; ++k) {
+      power__<float, Polynomial>(k, q, qStride, t, out, outStride);
+    }
+  }
+
+  // out = power(cn(b a^-1), t) a, the spherical linear interpolation from a (t = 0) to b
+  // (t = 1), or to -b when that is closer
+  static void slerp(const int n, const float* a, const int aStride, const float* b, const int bStride, const float t,
+                    float* out, const int outStride, const Precision precision = EXACT) {
+    int k = 0;
+    if (precision == EXACT) {
+      for (; k < n; ++k) {
+        slerp__<float, Exact>(k, a, aStride, b, bStride, t, out, outStride);
+      }
+      return;
+    }
+#if defined(QUATBATCH_AVX) || defined(QUATBATCH_SSE)
+    for (; k + Lanes::SIZE <= n; k += Lanes::SIZE) {
+      slerp__<Lanes, Polynomial>(k, a, aStride, b, bStride, t, out, outStride);
+    }
+#endif
+    for (; k < n; ++k) {
+      slerp__<float, Polynomial>(k, a, aStride, b, bStride, t, out, outStride);
+    }
+  }
+
+  // out = the rotation by t times the rotation vector (axis times angle) v, whose x, y
+  // and z are at v[k], v[vStride + k] and v[2*vStride + k]. For POLYNOMIAL, t times
+  // the angle must be in [0, pi].
+  static void exp(const int n, const float* v, const int vStride, const float t,
+                  float* out, const int outStride, const Precision precision = EXACT) {
+    int k = 0;
+    if (precision == EXACT) {
+      for (; k < n; ++k) {
+        exp__<float, Exact>(k, v, vStride, t, out, outStride);
+      }
+      return;
+    }
+#if defined(QUATBATCH_AVX) || defined(QUATBATCH_SSE)
+    for (; k + Lanes::SIZE <= n; k += Lanes::SIZE) {
+      exp__<Lanes, Polynomial>(k, v, vStride, t, out, outStride);
+    }
+#endif
+    for (; k < n; ++k) {
+      exp__<float, Polynomial>(k, v, vStride, t, out, outStride);
+    }
+  }
+
+private:
+  // The kernels below are written once over a value type F: float for one quaternion,
+  // or Lanes for Lanes::SIZE of them, which supports the same arithmetic, with select__() for ?:.
+#if defined(QUATBATCH_AVX)
+  struct Lanes {
+    enum { SIZE = 8 };
+    __m256 v;
+
+    Lanes() {}
+    Lanes(const __m256 v) : v(v) {}
+    Lanes(const float f) : v(_mm256_set1_ps(f)) {}
+
+    friend Lanes operator+(const Lanes& a, const Lanes& b) { return _mm256_add_ps(a.v, b.v); }
+    friend Lanes operator-(const Lanes& a, const Lanes& b) { return _mm256_sub_ps(a.v, b.v); }
+    friend Lanes operator*(const Lanes& a, const Lanes& b) { return _mm256_mul_ps(a.v, b.v); }
+    friend Lanes operator/(const Lanes& a, const Lanes& b) { return _mm256_div_ps(a.v, b.v); }
+    friend Lanes operator-(const Lanes& a) { return _mm256_sub_ps(_mm256_setzero_ps(), a.v); }
+    friend Lanes operator<(const Lanes& a, const Lanes& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+  };
+
+  static Lanes sqrt__(const Lanes& a) { return _mm256_sqrt_ps(a.v); }
+  static Lanes select__(const Lanes& mask, const Lanes& a, const Lanes& b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+  static void load__(const float* p, Lanes& a) { a.v = _mm256_loadu_ps(p); }
+  static void store__(const Lanes& a, float* p) { _mm256_storeu_ps(p, a.v); }
+#elif defined(QUATBATCH_SSE)
+  struct Lanes {
+    enum { SIZE = 4 };
+    __m128 v;
+
+    Lanes() {}
+    Lanes(const __m128 v) : v(v) {}
+    Lanes(const float f) : v(_mm_set1_ps(f)) {}
+
+    friend Lanes operator+(const Lanes& a, const Lanes& b) { return _mm_add_ps(a.v, b.v); }
+    friend Lanes operator-(const Lanes& a, const Lanes& b) { return _mm_sub_ps(a.v, b.v); }
+    friend Lanes operator*(const Lanes& a, const Lanes& b) { return _mm_mul_ps(a.v, b.v); }
+    friend Lanes operator/(const Lanes& a, const Lanes& b) { return _mm_div_ps(a.v, b.v); }
+    friend Lanes operator-(const Lanes& a) { return _mm_sub_ps(_mm_setzero_ps(), a.v); }
+    friend Lanes operator<(const Lanes& a, const Lanes& b) { return _mm_cmplt_ps(a.v, b.v); }
+  };
+
+  static Lanes sqrt__(const Lanes& a) { return _mm_sqrt_ps(a.v); }
+  static Lanes select__(const Lanes& mask, const Lanes& a, const Lanes& b) {
+    return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+  }
+  static void load__(const float* p, Lanes& a) { a.v = _mm_loadu_ps(p); }
+  static void store__(const Lanes& a, float* p) { _mm_storeu_ps(p, a.v); }
+#endif
+
+  static float sqrt__(const float a) { return std::sqrt(a); }
+  static float select__(const bool mask, const float a, const float b) { return mask ? a : b; }
+  static void load__(const float* p, float& a) { a = *p; }
+  static void store__(const float a, float* p) { *p = a; }
+
+  // Loads component c of quaternion (or rotation vector) k
+  template<typename F>
+  static F get__(const float* q, const int stride, const int c, const int k) {
+    F a;
+    load__(q + c * stride + k, a);
+    return a;
+  }
+
+  template<typename F>
+  static void set__(float* q, const int stride, const int k, const F& w, const F& x, const F& y, const F& z) {
+    store__(w, q + k);
+    store__(x, q + stride + k);
+    store__(y, q + 2 * stride + k);
+    store__(z, q + 3 * stride + k);
+  }
+
+  // Angle functions over [0, pi/2]
+  struct Exact {
+    static float atan2(const float y, const float x) { return std::atan2(y, x); }
+    static float sinc(const float x) { return x > 0 ? std::sin(x) / x : 1; }
+    static float cos(const float x) { return std::cos(x); }
+  };
+
+  struct Polynomial {
+    // atan2(y, x) for x, y >= 0, from an odd polynomial fitted to atan on [0, 1], |error| < 4e-8
+    template<typename F>
+    static F atan2(const F& y, const F& x) {
+      const F less = y < x;
+      const F lo = select__(less, y, x), hi = select__(less, x, y);
+      const F r = lo / select__(F(0) < hi, hi, F(1)), r2 = r * r;
+      const F a = r * (0.999999336f + r2 * (-0.333298608f + r2 * (0.199465657f + r2 * (-0.139086295f
+                  + r2 * (0.0964219701f + r2 * (-0.0559123197f + r2 * (0.0218629517f + r2 * -0.00405456524f)))))));
+      return select__(less, a, 1.5707963f - a);
+    }
+
+    // sin(x) / x and cos(x) from their Taylor series, |error| < 1e-8
+    template<typename F>
+    static F sinc(const F& x) {
+      const F x2 = x * x;
+      return 1.0f + x2 * (-1 / 6.0f + x2 * (1 / 120.0f + x2 * (-1 / 5040.0f + x2 * (1 / 362880.0f + x2 * (-1 / 39916800.0f)))));
+    }
+
+    template<typename F>
+    static F cos(const F& x) {
+      const F x2 = x * x;
+      return 1.0f + x2 * (-1 / 2.0f + x2 * (1 / 24.0f + x2 * (-1 / 720.0f + x2 * (1 / 40320.0f + x2 * (-1 / 3628800.0f + x2 * (1 / 479001600.0f))))));
+    }
+  };
+
+  // For q = (w, v) with w >= 0: power(q, t) = (wOut, f v)
+  template<typename F, typename Angles>
+  static void power__(const F& w, const F& x, const F& y, const F& z, const F& t, F& wOut, F& f) {
+    const F s = sqrt__(x*x + y*y + z*z);
+    const F angle = Angles::atan2(s, w);                    // half the rotation angle, in [0, pi/2]
+    // sin(t angle) / s = t sinc(t angle) / sinc(angle), which stays finite as s goes to 0
+    wOut = Angles::cos(t * angle);
+    f = t * Angles::sinc(t * angle) / Angles::sinc(angle);
+  }
+
+  template<typename F>
+  static void multiply__(const int k, const float* a, const int aStride, const float* b, const int bStride,
+                         float* out, const int outStride) {
+    const F aw = get__<F>(a, aStride, 0, k), ax = get__<F>(a, aStride, 1, k), ay = get__<F>(a, aStride, 2, k), az = get__<F>(a, aStride, 3, k);
+    const F bw = get__<F>(b, bStride, 0, k), bx = get__<F>(b, bStride, 1, k), by = get__<F>(b, bStride, 2, k), bz = get__<F>(b, bStride, 3, k);
+    set__<F>(out, outStride, k,
+             aw*bw - ax*bx - ay*by - az*bz,
+             aw*bx + ax*bw + ay*bz - az*by,
+             aw*by - ax*bz + ay*bw + az*bx,
+             aw*bz + ax*by - ay*bx + az*bw);
+  }
+
+  template<typename F, typename Angles>
+  static void power__(const int k, const float* q, const int qStride, const float t, float* out, const int outStride) {
+    const F qw = get__<F>(q, qStride, 0, k), x = get__<F>(q, qStride, 1, k), y = get__<F>(q, qStride, 2, k), z = get__<F>(q, qStride, 3, k);
+    const F s = select__(qw < F(0), F(-1), F(1));
+    F w, f;
+    power__<F, Angles>(qw * s, x, y, z, F(t), w, f);
+    f = f * s;
+    set__<F>(out, outStride, k, w, x * f, y * f, z * f);
+  }
+
+  template<typename F, typename Angles>
+  static void slerp__(const int k, const float* a, const int aStride, const float* b, const int bStride, const float t,
+                      float* out, const int outStride) {
+    const F aw = get__<F>(a, aStride, 0, k), ax = get__<F>(a, aStride, 1, k), ay = get__<F>(a, aStride, 2, k), az = get__<F>(a, aStride, 3, k);
+    const F bw = get__<F>(b, bStride, 0, k), bx = get__<F>(b, bStride, 1, k), by = get__<F>(b, bStride, 2, k), bz = get__<F>(b, bStride, 3, k);
+    // r = b a^-1
+    const F rw = bw*aw + bx*ax + by*ay + bz*az;
+    const F rx = bx*aw - bw*ax - by*az + bz*ay;
+    const F ry = by*aw - bw*ay + bx*az - bz*ax;
+    const F rz = bz*aw - bw*az - bx*ay + by*ax;
+    const F s = select__(rw < F(0), F(-1), F(1));
+    F pw, f;
+    power__<F, Angles>(rw * s, rx, ry, rz, F(t), pw, f);
+    f = f * s;
+    const F px = rx * f, py = ry * f, pz = rz * f;
+    set__<F>(out, outStride, k,
+             pw*aw - px*ax - py*ay - pz*az,
+             pw*ax + px*aw + py*az - pz*ay,
+             pw*ay - px*az + py*aw + pz*ax,
+             pw*az + px*ay - py*ax + pz*aw);
+  }
+
+  template<typename F, typename Angles>
+  static void exp__(const int k, const float* v, const int vStride, const float t, float* out, const int outStride) {
+    const F x = get__<F>(v, vStride, 0, k), y = get__<F>(v, vStride, 1, k), z = get__<F>(v, vStride, 2, k);
+    const F half = sqrt__(x*x + y*y + z*z) * F(t / 2);
+    const F f = F(t / 2) * Angles::sinc(half);
+    set__<F>(out, outStride, k, Angles::cos(half), x * f, y * f, z * f);
+  }
+};
+
+#endif
@@ -141,8 +141,8 @@ inline RigTForm interpolate(const RigTForm& a, const RigTForm& b, float i) {
 }
 
 inline RigTForm CRS_interpolate(const RigTForm& c0, const RigTForm& c1, const RigTForm& c2, const RigTForm& c3, float i) {
-    if (abs(i - 0) < CS175_EPS) return c1;
-    if (abs(i - 1) < CS175_EPS) return c2;
+    if (std::abs(i - 0) < CS175_EPS) return c1;
+    if (std::abs(i - 1) < CS175_EPS) return c2;
 
     RigTForm r = RigTForm();
 
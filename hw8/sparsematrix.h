@@ -0,0 +1,276 @@
+#ifndef SPARSEMATRIX_H
+#define SPARSEMATRIX_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "cvec.h"
+#include "threadpool.h"
+
+// Square sparse matrix in compressed sparse row form: row i has the entries
+// [getOffsets()[i], getOffsets()[i+1]) of getColumns() and getValues(), sorted by
+// column. Products run in parallel over rows on the thread pool.
+class SparseMatrix {
+public:
+  struct Entry {
+    int row, column;
+    double value;
+
+    Entry() {}
+    Entry(const int r, const int c, const double v) : row(r), column(c), value(v) {}
+  };
+
+  SparseMatrix() : offset_(1, 0) {}
+
+  // Replaces the matrix by the numRows x numRows matrix with the given entries, where
+  // entries at the same position add up. The entries are bucketed by row and every
+  // row is sorted on its own, so this is linear in the number of entries for rows of
+  // bounded length.
+  void build(const int numRows, const std::vector<Entry>& entries) {
+    offset_.assign(numRows + 1, 0);
+    for (std::size_t k = 0; k < entries.size(); ++k) {
+      ++offset_[entries[k].row + 1];
+    }
+    for (int i = 0; i < numRows; ++i) {
+      offset_[i+1] += offset_[i];
+    }
+    std::vector<int> fill(offset_.begin(), offset_.end() - 1);
+    std::vector<std::pair<int, double> > row(entries.size());
+    for (std::size_t k = 0; k < entries.size(); ++k) {
+      row[fill[entries[k].row]++] = std::make_pair(entries[k].column, entries[k].value);
+    }
+    // merge duplicates in place, then close the gaps between rows
+    std::vector<int> length(numRows);
+    getThreadPool().parallelFor(numRows, [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        std::pair<int, double>* const r = row.empty() ? NULL : &row[0] + offset_[i];
+        const int n = offset_[i+1] - offset_[i];
+        std::sort(r, r + n, [](const std::pair<int, double>& a, const std::pair<int, double>& b) {
+          return a.first < b.first;
+        });
+        int m = 0;
+        for (int k = 0; k < n; ++k) {
+          if (m > 0 && r[m-1].first == r[k].first)
+            r[m-1].second += r[k].second;
+          else
+            r[m++] = r[k];
+        }
+        length[i] = m;
+      }
+    });
+    column_.clear();
+    value_.clear();
+    for (int i = 0; i < numRows; ++i) {
+      for (int k = offset_[i]; k < offset_[i] + length[i]; ++k) {
+        column_.push_back(row[k].first);
+        value_.push_back(row[k].second);
+      }
+    }
+    offset_[0] = 0;
+    for (int i = 0; i < numRows; ++i) {
+      offset_[i+1] = offset_[i] + length[i];
+    }
+  }
+
+  int getNumRows() const {
+    return offset_.size() - 1;
+  }
+
+  int getNumEntries() const {
+    return value_.size();
+  }
+
+  const int* getOffsets() const {
+    return &offset_[0];
+  }
+
+  const int* getColumns() const {
+    return column_.empty() ? NULL : &column_[0];
+  }
+
+  const double* getValues() const {
+    return value_.empty() ? NULL : &value_[0];
+  }
+
+  double* getValues() {
+    return value_.empty() ? NULL : &value_[0];
+  }
+
+  // Entry (i, j), or 0 if it is not stored
+  double get(const int i, const int j) const {
+    const int* const begin = getColumns() + offset_[i], * const end = getColumns() + offset_[i+1];
+    const int* const at = std::lower_bound(begin, end, j);
+    return at != end && *at == j ? value_[at - getColumns()] : 0;
+  }
+
+  // Multiplies every entry by s
+  void scale(const double s) {
+    for (std::size_t k = 0; k < value_.size(); ++k) {
+      value_[k] *= s;
+    }
+  }
+
+  // Adds d[i] to every diagonal entry (i, i), which must be stored
+  void addToDiagonal(const std::vector<double>& d) {
+    for (int i = 0; i < getNumRows(); ++i) {
+      const int* const begin = getColumns() + offset_[i];
+      value_[std::lower_bound(begin, begin + (offset_[i+1] - offset_[i]), i) - getColumns()] += d[i];
+    }
+  }
+
+  // y = A x, for x and y of doubles or Cvec3 (one product per coordinate)
+  template<typename T>
+  void multiply(const T* x, T* y) const {
+    getThreadPool().parallelFor(getNumRows(), [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        T sum = T();
+        for (int k = offset_[i]; k < offset_[i+1]; ++k) {
+          sum += x[column_[k]] * value_[k];
+        }
+        y[i] = sum;
+      }
+    });
+  }
+
+private:
+  std::vector<int> offset_;
+  std::vector<int> column_;
+  std::vector<double> value_;
+};
+
+// Jacobi preconditioned conjugate gradients for symmetric positive definite systems
+// with three right-hand sides, the coordinates of Cvec3 vectors, solved side by side
+// so every matrix product serves all three. The matrix only appears through a
+// multiply(x, y) callback (y = A x), so constrained or combined systems need not be
+// assembled. Starting from the previous solution (e.g. of the last frame) usually
+// takes a few iterations only. The work vectors are kept across calls, and the dot
+// products are summed per thread pool chunk in a fixed order, so results do not
+// depend on the number of threads.
+class ConjugateGradient {
+public:
+  ConjugateGradient() : maxIterations_(200), tolerance_(1e-6), iterations_(0), residual_(0) {}
+
+  void setMaxIterations(const int maxIterations) {
+    maxIterations_ = maxIterations;
+  }
+
+  // Stop once the residual of every coordinate is below tolerance times its right-hand side
+  void setTolerance(const double tolerance) {
+    tolerance_ = tolerance;
+  }
+
+  // Iterations and largest relative residual of the last solve()
+  int getIterations() const {
+    return iterations_;
+  }
+
+  double getResidual() const {
+    return residual_;
+  }
+
+  // Solves A x = b for the n unknowns in x, starting from the values in x.
+  // inverseDiagonal holds 1 / A(i, i). Returns the number of iterations.
+  template<typename Multiply>
+  int solve(const int n, Multiply multiply, const double* inverseDiagonal, const Cvec3* b, Cvec3* x) {
+    ThreadPool& pool = getThreadPool();
+    r_.resize(n);
+    z_.resize(n);
+    p_.resize(n);
+    q_.resize(n);
+    partial_.resize(3 * pool.getNumChunks(n));
+    Cvec3* const r = r_.empty() ? NULL : &r_[0];
+    Cvec3* const z = z_.empty() ? NULL : &z_[0];
+    Cvec3* const p = p_.empty() ? NULL : &p_[0];
+    Cvec3* const q = q_.empty() ? NULL : &q_[0];
+
+    multiply(x, q);
+    Cvec3 bb(0), rr, rz;
+    reduce__(n, [&](const int i, Cvec3* sum) {
+      r[i] = b[i] - q[i];
+      z[i] = r[i] * inverseDiagonal[i];
+      p[i] = z[i];
+      sum[0] += mul__(b[i], b[i]);
+      sum[1] += mul__(r[i], r[i]);
+      sum[2] += mul__(r[i], z[i]);
+    }, bb, rr, rz);
+
+    iterations_ = 0;
+    while (!converged__(rr, bb) && iterations_ < maxIterations_) {
+      multiply(p, q);
+      Cvec3 pq, unused;
+      reduce__(n, [&](const int i, Cvec3* sum) {
+        sum[0] += mul__(p[i], q[i]);
+      }, pq, unused, unused);
+      Cvec3 alpha;
+      for (int k = 0; k < 3; ++k) {                         // converged coordinates stay put
+        alpha[k] = pq[k] > 0 && !converged__(rr[k], bb[k]) ? rz[k] / pq[k] : 0;
+      }
+      Cvec3 rzNew;
+      reduce__(n, [&](const int i, Cvec3* sum) {
+        x[i] += mul__(alpha, p[i]);
+        r[i] -= mul__(alpha, q[i]);
+        z[i] = r[i] * inverseDiagonal[i];
+        sum[0] += mul__(r[i], r[i]);
+        sum[1] += mul__(r[i], z[i]);
+      }, rr, rzNew, unused);
+      Cvec3 beta;
+      for (int k = 0; k < 3; ++k) {
+        beta[k] = rz[k] > 0 ? rzNew[k] / rz[k] : 0;
+      }
+      rz = rzNew;
+      pool.parallelFor(n, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+          p[i] = z[i] + mul__(beta, p[i]);
+        }
+      });
+      ++iterations_;
+    }
+    residual_ = 0;
+    for (int k = 0; k < 3; ++k) {
+      residual_ = std::max(residual_, std::sqrt(rr[k] / std::max(bb[k], 1e-300)));
+    }
+    return iterations_;
+  }
+
+private:
+  int maxIterations_;
+  double tolerance_;
+  int iterations_;
+  double residual_;
+  std::vector<Cvec3> r_, z_, p_, q_;
+  std::vector<Cvec3> partial_;                              // three sums per chunk
+
+  static Cvec3 mul__(const Cvec3& a, const Cvec3& b) {
+    return Cvec3(a[0] * b[0], a[1] * b[1], a[2] * b[2]);
+  }
+
+  bool converged__(const double rr, const double bb) const {
+    return rr <= tolerance_ * tolerance_ * bb;
+  }
+  bool converged__(const Cvec3& rr, const Cvec3& bb) const {
+    return converged__(rr[0], bb[0]) && converged__(rr[1], bb[1]) && converged__(rr[2], bb[2]);
+  }
+
+  // Calls fn(i, sums) for every i in [0, n) and adds up the three sums it accumulates
+  template<typename Fn>
+  void reduce__(const int n, Fn fn, Cvec3& a, Cvec3& b, Cvec3& c) {
+    ThreadPool& pool = getThreadPool();
+    const int chunks = pool.getNumChunks(n);
+    pool.parallelFor(n, [&](int chunk, int begin, int end) {
+      Cvec3* const sum = &partial_[3 * chunk];
+      sum[0] = sum[1] = sum[2] = Cvec3(0);
+      for (int i = begin; i < end; ++i) {
+        fn(i, sum);
+      }
+    });
+    a = b = c = Cvec3(0);
+    for (int k = 0; k < chunks; ++k) {
+      a += partial_[3*k];
+      b += partial_[3*k + 1];
+      c += partial_[3*k + 2];
+    }
+  }
+};
+
+#endif
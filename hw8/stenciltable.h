@@ -0,0 +1,390 @@
+#ifndef STENCILTABLE_H
+#define STENCILTABLE_H
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <stdexcept>
+#include <cmath>
+
+#include "cvec.h"
+#include "mesh.h"
+#include "threadpool.h"
+
+// Catmull-Clark subdivision of a fixed topology is linear in the control vertex
+// positions. A StencilTable stores that linear map as a sparse matrix (one row of
+// control vertex weights per refined vertex, in CSR form), so refining a deformed
+// control mesh is a single sparse matrix-vector product instead of a rebuild.
+class StencilTable {
+public:
+  // What buildAdaptive() refines: faces next to extraordinary vertices, faces whose
+  // normal turns more than maxNormalAngle degrees from a neighbour's, and faces for which
+  // predicate(mesh, face, level) is true. Each of them is refined with the faces around it.
+  struct AdaptiveOptions {
+    bool extraordinary;
+    double maxNormalAngle;                                // negative for no curvature test
+    std::function<bool(const Mesh&, int, int)> predicate; // may be empty
+
+    AdaptiveOptions() : extraordinary(true), maxNormalAngle(-1) {}
+  };
+
+  StencilTable() : numControls_(0), offset_(1, 0) {}
+
+  // Computes the stencils for `levels` subdivision steps of `base`. On return
+  // `refined` holds the subdivided mesh, positioned from the current positions of base.
+  void build(const Mesh& base, const int levels, Mesh& refined) {
+    refined = base;
+    start__(base);
+
+    Rows rows;                                            // level 0 is the identity
+    for (int i = 0; i < numControls_; ++i) {
+      add__(i, 1);
+      flush__(rows);
+    }
+    for (int level = 0; level < levels; ++level) {
+      Rows f, e, v;
+      for (int i = 0; i < refined.getNumFaces(); ++i) {
+        const Mesh::Face face = refined.getFace(i);
+        const int n = face.getNumVertices();
+        for (int j = 0; j < n; ++j) {
+          accumulate__(rows, face.getVertex(j).getIndex(), 1.0 / n);
+        }
+        flush__(f);
+      }
+      for (int i = 0; i < refined.getNumEdges(); ++i) {
+        const Mesh::Edge edge = refined.getEdge(i);
+        for (int j = 0; j < 2; ++j) {
+          accumulate__(rows, edge.getVertex(j).getIndex(), 0.25);
+          accumulate__(f, edge.getFace(j).getIndex(), 0.25);
+        }
+        flush__(e);
+      }
+      refined.buildAdjacency();
+      const int* const ring = refined.getVertexRingOffsets();
+      const int* const neighbors = refined.getVertexNeighbors();
+      const int* const faces = refined.getVertexRingFaces();
+      for (int i = 0; i < refined.getNumVertices(); ++i) {
+        const int valence = ring[i+1] - ring[i];
+        const double w = 1.0 / valence / valence;
+        accumulate__(rows, i, (valence - 2) * 1.0 / valence);
+        for (int k = ring[i]; k < ring[i+1]; ++k) {
+          accumulate__(rows, neighbors[k], w);
+          accumulate__(f, faces[k], w);
+        }
+        flush__(v);
+      }
+      v.append(e);
+      v.append(f);
+      rows.swap(v);
+      refined.subdivide();
+    }
+
+    finish__(rows, base, refined);
+  }
+
+  // Like build(), but each step only refines the faces picked by options (tested on the
+  // current positions of base) and the faces sharing a vertex with them, so the vertex
+  // count grows with the features rather than as 4^levels. Only faces that came out of
+  // the previous step are candidates, so extraordinary vertices are isolated by rings of
+  // halving width. The unrefined faces next to refined ones take in the new edge vertices
+  // of their split edges as extra corners, which keeps the surface free of cracks.
+  // Throws runtime_error on meshes with boundaries.
+  void buildAdaptive(const Mesh& base, const int levels, const AdaptiveOptions& options, Mesh& refined) {
+    if (base.getFaceVertexOffsets()[base.getNumFaces()] != 2 * base.getNumEdges())
+      throw std::runtime_error("Adaptive subdivision does not support mesh with boundaries yet.");
+    refined = base;
+    start__(base);
+
+    Rows rows;
+    for (int i = 0; i < numControls_; ++i) {
+      add__(i, 1);
+      flush__(rows);
+    }
+    std::vector<char> full(base.getNumFaces(), true);     // faces made by the last step
+    for (int level = 0; level < levels && refineAdaptive__(base, level, options, refined, full, rows); ++level) {}
+    finish__(rows, base, refined);
+  }
+
+  int getNumControlVertices() const {
+    return numControls_;
+  }
+
+  int getNumRefinedVertices() const {
+    return offset_.size() - 1;
+  }
+
+  int getNumWeights() const {
+    return index_.size();
+  }
+
+  // refined[r] = sum of weight * control over row r, for every refined vertex r
+  void apply(const Cvec3f* control, Cvec3f* refined) const {
+    getThreadPool().parallelFor(getNumRefinedVertices(), [&](int, int begin, int end) {
+      for (int r = begin; r < end; ++r) {
+        float x = 0, y = 0, z = 0;
+        for (int k = offset_[r]; k < offset_[r+1]; ++k) {
+          const Cvec3f& p = control[index_[k]];
+          const float w = weight_[k];
+          x += w * p[0];
+          y += w * p[1];
+          z += w * p[2];
+        }
+        refined[r] = Cvec3f(x, y, z);
+      }
+    });
+  }
+
+private:
+  // Sparse rows over the control vertices, in double while they are being built
+  struct Rows {
+    std::vector<int> offset, index;
+    std::vector<double> weight;
+
+    Rows() : offset(1, 0) {}
+
+    void append(const Rows& r) {
+      const int base = index.size();
+      for (std::size_t i = 1; i < r.offset.size(); ++i) {
+        offset.push_back(base + r.offset[i]);
+      }
+      index.insert(index.end(), r.index.begin(), r.index.end());
+      weight.insert(weight.end(), r.weight.begin(), r.weight.end());
+    }
+
+    void swap(Rows& r) {
+      offset.swap(r.offset);
+      index.swap(r.index);
+      weight.swap(r.weight);
+    }
+  };
+
+  int numControls_;
+  std::vector<int> offset_, index_;
+  std::vector<float> weight_;
+
+  // dense scratch row used to merge stencils
+  std::vector<double> acc_;
+  std::vector<char> used_;
+  std::vector<int> touched_;
+
+  void start__(const Mesh& base) {
+    numControls_ = base.getNumVertices();
+    acc_.assign(numControls_, 0);
+    used_.assign(numControls_, false);
+    touched_.clear();
+  }
+
+  void finish__(const Rows& rows, const Mesh& base, Mesh& refined) {
+    offset_ = rows.offset;
+    index_ = rows.index;
+    weight_.assign(rows.weight.begin(), rows.weight.end());
+    apply(base.getPositions(), refined.getPositions());
+  }
+
+  void add__(const int control, const double w) {
+    if (!used_[control]) {
+      used_[control] = true;
+      touched_.push_back(control);
+    }
+    acc_[control] += w;
+  }
+
+  // adds w times row `row` of `rows` to the scratch row
+  void accumulate__(const Rows& rows, const int row, const double w) {
+    for (int k = rows.offset[row]; k < rows.offset[row+1]; ++k) {
+      add__(rows.index[k], w * rows.weight[k]);
+    }
+  }
+
+  // appends the scratch row to `rows` and clears it
+  void flush__(Rows& rows) {
+    for (std::size_t i = 0; i < touched_.size(); ++i) {
+      rows.index.push_back(touched_[i]);
+      rows.weight.push_back(acc_[touched_[i]]);
+      acc_[touched_[i]] = 0;
+      used_[touched_[i]] = false;
+    }
+    rows.offset.push_back(rows.index.size());
+    touched_.clear();
+  }
+
+  // One adaptive step of m, whose vertices have the stencils `rows` and whose faces made
+  // by the previous step are flagged in full. Returns false if nothing needs refining.
+  bool refineAdaptive__(const Mesh& base, const int level, const AdaptiveOptions& options, Mesh& m,
+                        std::vector<char>& full, Rows& rows) {
+    const int nv = m.getNumVertices(), ne = m.getNumEdges(), nf = m.getNumFaces();
+    const int* const offset = m.getFaceVertexOffsets();
+    const int* const index = m.getFaceVertexIndices();
+    const Cvec3f* const p = m.getPositions();
+
+    // a vertex is extraordinary if its valence is not 4 and all faces around it are full;
+    // the edge vertices inserted into unrefined faces have valence 3 but are not
+    std::vector<char> fullRing(nv, true);
+    for (int f = 0; f < nf; ++f) {
+      for (int j = offset[f]; j < offset[f+1]; ++j) {
+        fullRing[index[j]] = fullRing[index[j]] && full[f];
+      }
+    }
+    std::vector<char> picked(nf, false);
+    m.buildAdjacency();
+    for (int f = 0; f < nf; ++f) {
+      if (!full[f])
+        continue;
+      bool pick = options.extraordinary && offset[f+1] - offset[f] != 4;
+      for (int j = offset[f]; j < offset[f+1] && options.extraordinary && !pick; ++j) {
+        pick = fullRing[index[j]] && m.getValence(index[j]) != 4;
+      }
+      picked[f] = pick || (options.predicate && options.predicate(m, f, level));
+    }
+    // edges, sorted by endpoints so the faces can look up theirs
+    std::vector<std::pair<std::pair<int, int>, int> > edges(ne);
+    for (int e = 0; e < ne; ++e) {
+      Mesh::Edge edge = m.getEdge(e);
+      const int a = edge.getVertex(0).getIndex(), b = edge.getVertex(1).getIndex();
+      edges[e] = std::make_pair(std::make_pair(std::min(a, b), std::max(a, b)), e);
+    }
+    if (options.maxNormalAngle >= 0) {
+      std::vector<Cvec3> normal(nf, Cvec3(0));
+      for (int f = 0; f < nf; ++f) {
+        for (int j = offset[f], k = offset[f+1]-1; j < offset[f+1]; k = j++) {
+          normal[f] += cross(Cvec3(p[index[k]][0], p[index[k]][1], p[index[k]][2]), Cvec3(p[index[j]][0], p[index[j]][1], p[index[j]][2]));
+        }
+        const double s = norm(normal[f]);
+        if (s > 0)
+          normal[f] /= s;
+      }
+      const double minCos = std::cos(options.maxNormalAngle * CS175_PI / 180);
+      for (int e = 0; e < ne; ++e) {
+        Mesh::Edge edge = m.getEdge(e);
+        const int f0 = edge.getFace(0).getIndex(), f1 = edge.getFace(1).getIndex();
+        if (dot(normal[f0], normal[f1]) < minCos) {
+          picked[f0] = picked[f0] || full[f0];
+          picked[f1] = picked[f1] || full[f1];
+        }
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+
+    // refine the full faces sharing a vertex with a picked face
+    std::vector<char> moved(nv, false), selected(nf, false);
+    for (int f = 0; f < nf; ++f) {
+      for (int j = offset[f]; j < offset[f+1] && picked[f]; ++j) {
+        moved[index[j]] = true;
+      }
+    }
+    bool any = false;
+    for (int f = 0; f < nf; ++f) {
+      for (int j = offset[f]; j < offset[f+1] && full[f] && !selected[f]; ++j) {
+        selected[f] = moved[index[j]];
+      }
+      any = any || selected[f];
+    }
+    if (!any)
+      return false;
+    std::fill(moved.begin(), moved.end(), false);
+    for (int f = 0; f < nf; ++f) {
+      for (int j = offset[f]; j < offset[f+1] && selected[f]; ++j) {
+        moved[index[j]] = true;
+      }
+    }
+
+    // the same rules as build(), for the vertices that change
+    Rows f, e, v;
+    for (int i = 0; i < nf; ++i) {
+      const int n = offset[i+1] - offset[i];
+      for (int j = offset[i]; j < offset[i+1]; ++j) {
+        accumulate__(rows, index[j], 1.0 / n);
+      }
+      flush__(f);
+    }
+    std::vector<int> edgeVertex(ne, -1);                  // new index of the vertex splitting each edge
+    int numVertices = nv;
+    for (int i = 0; i < ne; ++i) {
+      Mesh::Edge edge = m.getEdge(i);
+      if (!selected[edge.getFace(0).getIndex()] && !selected[edge.getFace(1).getIndex()])
+        continue;
+      edgeVertex[i] = numVertices++;
+      for (int j = 0; j < 2; ++j) {
+        accumulate__(rows, edge.getVertex(j).getIndex(), 0.25);
+        accumulate__(f, edge.getFace(j).getIndex(), 0.25);
+      }
+      flush__(e);
+    }
+    m.buildAdjacency();
+    const int* const ring = m.getVertexRingOffsets();
+    const int* const neighbors = m.getVertexNeighbors();
+    const int* const faces = m.getVertexRingFaces();
+    for (int i = 0; i < nv; ++i) {
+      if (!moved[i]) {
+        accumulate__(rows, i, 1);
+        flush__(v);
+        continue;
+      }
+      const int n = ring[i+1] - ring[i];
+      const double w = 1.0 / n / n;
+      accumulate__(rows, i, (n - 2) * 1.0 / n);
+      for (int k = ring[i]; k < ring[i+1]; ++k) {
+        accumulate__(rows, neighbors[k], w);
+        accumulate__(f, faces[k], w);
+      }
+      flush__(v);
+    }
+    v.append(e);
+    for (int i = 0; i < nf; ++i) {
+      if (selected[i]) {
+        accumulate__(f, i, 1);
+        flush__(v);
+      }
+    }
+    rows.swap(v);
+
+    // selected faces split into one quad per corner, their neighbours gain the edge vertices
+    auto edgeVertexOf = [&](const int a, const int b) {
+      const std::pair<int, int> key(std::min(a, b), std::max(a, b));
+      return edgeVertex[std::lower_bound(edges.begin(), edges.end(), std::make_pair(key, -1))->second];
+    };
+    std::vector<int> offsets(1, 0), indices;
+    std::vector<char> made;
+    int faceVertex = numVertices;
+    for (int i = 0; i < nf; ++i) {
+      const int n = offset[i+1] - offset[i];
+      const int* const c = index + offset[i];
+      if (selected[i]) {
+        for (int j = 0; j < n; ++j) {
+          indices.push_back(c[j]);
+          indices.push_back(edgeVertexOf(c[j], c[(j+1) % n]));
+          indices.push_back(faceVertex);
+          indices.push_back(edgeVertexOf(c[(j+n-1) % n], c[j]));
+          offsets.push_back(indices.size());
+          made.push_back(true);
+        }
+        ++faceVertex;
+      }
+      else {
+        for (int j = 0; j < n; ++j) {
+          indices.push_back(c[j]);
+          const int split = edgeVertexOf(c[j], c[(j+1) % n]);
+          if (split >= 0)
+            indices.push_back(split);
+        }
+        offsets.push_back(indices.size());
+        made.push_back(false);
+      }
+    }
+    std::vector<Cvec3f> positions(rows.offset.size() - 1);
+    const Cvec3f* const control = base.getPositions();
+    for (std::size_t r = 0; r + 1 < rows.offset.size(); ++r) {
+      Cvec3 q(0);
+      for (int k = rows.offset[r]; k < rows.offset[r+1]; ++k) {
+        q += Cvec3(control[rows.index[k]][0], control[rows.index[k]][1], control[rows.index[k]][2]) * rows.weight[k];
+      }
+      positions[r] = Cvec3f(q[0], q[1], q[2]);
+    }
+    m.build(positions, offsets, indices);
+    full.swap(made);
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,412 @@
+#ifndef STREAMINGSUBDIVIDER_H
+#define STREAMINGSUBDIVIDER_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+#include "cvec.h"
+#include "mesh.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+
+// Catmull-Clark subdivision of a closed manifold mesh straight into a binary mesh file
+// (the format of Mesh::save(), without connectivity), for results too large for RAM.
+//
+// The control mesh is cut into patches, runs of consecutive faces, which are spatially
+// coherent for the usual face orders. A patch is refined on its own together with a
+// halo of the faces sharing a vertex with it, which is all its refined faces depend on.
+// After every level the halo is cut back to the refined faces sharing a vertex with the
+// patch, so it stays one face wide. The refined vertices, edges and faces get the
+// indices Mesh::subdivide() would give them, which refine__ derives from the parent
+// indices alone, and each patch writes its faces and vertices through windows of a
+// memory mapped output file. Patches run in parallel on the thread pool; peak memory is
+// the control mesh plus a few patches, whatever the size of the output.
+//
+// The positions follow the same rules as StencilTable: face points are the average of
+// the corners, edge points the average of the ends and the two face points, and vertex
+// points ((n-2) v + (sum of neighbours + sum of face points) / n) / n for valence n.
+class StreamingSubdivider {
+public:
+  StreamingSubdivider() : maxPatchFaces_(1 << 18), numPatches_(0) {}
+
+  // Refined faces of a patch (not counting its halo), which bounds the memory used per
+  // thread. A single control face refined further than this is one patch anyway.
+  void setMaxPatchFaces(const int maxPatchFaces) {
+    maxPatchFaces_ = maxPatchFaces;
+  }
+
+  // Patches the last subdivide() cut the mesh into
+  int getNumPatches() const {
+    return numPatches_;
+  }
+
+  // Writes m subdivided levels times to filename, which Mesh::load() reads back.
+  // Throws runtime_error on meshes subdivide() does not support, if the result needs
+  // indices beyond 32 bits, or if the file cannot be written.
+  void subdivide(const Mesh& m, const int levels, const char filename[]) {
+    const Mesh::topology_t& t = *m.topology_;
+    if (t.not_manifold_)
+      throw std::runtime_error("Subdivision does not support non manifold mesh yet.");
+    if (t.with_boundary_)
+      throw std::runtime_error("Subdivision does not support mesh with boundaries yet.");
+    if (levels < 0)
+      throw std::runtime_error("Negative number of subdivision levels");
+
+    // element counts per level, as in refine__
+    counts_.assign(levels + 1, counts_t());
+    counts_[0].nv = t.vhalfedge_.size();
+    counts_[0].ne = t.ehalfedge_.size();
+    counts_[0].nf = t.fhalfedge_.size() - 1;
+    counts_[0].nh = t.hvertex_.size();
+    for (int level = 0; level < levels; ++level) {
+      const counts_t& c = counts_[level];
+      counts_t& r = counts_[level+1];
+      r.nv = c.nv + c.ne + c.nf;
+      r.ne = 2*c.ne + c.nh;
+      r.nf = c.nh;
+      r.nh = 4*c.nh;
+      if (r.nv > INT_MAX || r.ne > INT_MAX || r.nh > INT_MAX)
+        throw std::runtime_error("Subdivided mesh is too large for 32 bit indices");
+    }
+    const counts_t& out = counts_[levels];
+
+    // file layout of Mesh::save__
+    Mesh::binary_header_t header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, Mesh::binary_magic__(), 8);
+    header.version = Mesh::BINARY_VERSION;
+    header.flags = 0;
+    header.numVertices = out.nv;
+    header.numFaces = out.nf;
+    header.numHalfedges = out.nh;
+    header.numEdges = out.ne;
+    for (int i = 0; i < 3; ++i) {
+      header.center[i] = m.center_[i];
+    }
+    header.scale = m.scale_;
+    positionOffset_ = sizeof(header);
+    const std::size_t faceOffset = positionOffset_ + 3 * sizeof(float) * out.nv;
+    halfedgeOffset_ = faceOffset + sizeof(int) * (out.nf + 1);
+    WritableMappedFile file(filename, halfedgeOffset_ + sizeof(int) * out.nh);
+    std::memcpy(file.map(0, sizeof(header)), &header, sizeof(header));
+    for (long long begin = 0; begin <= out.nf; begin += 1 << 20) {            // fhalfedge_
+      const int n = std::min<long long>(1 << 20, out.nf + 1 - begin);
+      int* const offset = reinterpret_cast<int*>(file.map(faceOffset + sizeof(int) * begin, sizeof(int) * n));
+      for (int i = 0; i < n; ++i) {
+        offset[i] = levels ? 4 * (begin + i) : t.fhalfedge_[begin + i];
+      }
+    }
+
+    // patches of about maxPatchFaces_ refined faces
+    const int nf = counts_[0].nf;
+    long long perCorner = 1;
+    for (int level = 1; level < levels; ++level) {
+      perCorner = std::min(4 * perCorner, (long long)INT_MAX);
+    }
+    std::vector<int> patch(1, 0);
+    long long size = 0;
+    for (int f = 0; f < nf; ++f) {
+      const long long faces = levels ? perCorner * (t.fhalfedge_[f+1] - t.fhalfedge_[f]) : 1;
+      if (size > 0 && size + faces > maxPatchFaces_) {
+        patch.push_back(f);
+        size = 0;
+      }
+      size += faces;
+    }
+    patch.push_back(nf);
+    numPatches_ = patch.size() - 1;
+
+    // refined a few patches at a time, and written by this thread
+    m.buildAdjacency();
+    ThreadPool& pool = getThreadPool();
+    const int batch = pool.getNumThreads();
+    std::vector<result_t> results(batch);
+    for (int first = 0; first < numPatches_; first += batch) {
+      const int n = std::min(batch, numPatches_ - first);
+      pool.run(n, [&](int k) {
+        refine_patch__(m, patch[first + k], patch[first + k + 1], levels, results[k]);
+      });
+      for (int k = 0; k < n; ++k) {
+        write__(file, results[k]);
+      }
+    }
+  }
+
+private:
+  struct counts_t {
+    long long nv, ne, nf, nh;
+
+    counts_t() : nv(0), ne(0), nf(0), nh(0) {}
+  };
+
+  // A patch and its halo at some level, as faces over local vertices. The global
+  // indices at that level are kept for every element, and faces of the patch proper
+  // come first.
+  struct patch_t {
+    std::vector<int> offset;                                // halfedges of each face
+    std::vector<int> face;                                  // global face
+    std::vector<char> inner;                                // whether the face is part of the patch rather than the halo
+    std::vector<int> vertex;                                // local start vertex of each halfedge
+    std::vector<int> twin;                                  // local, or -1 past the rim of the halo
+    std::vector<int> halfedge;                              // global halfedge
+    std::vector<int> edge;                                  // global edge
+    std::vector<char> first;                                // whether the halfedge is ehalfedge_ of its edge
+    std::vector<int> global;                                // global vertex of each local one
+    std::vector<Cvec3f> p;
+  };
+
+  // What a patch writes: the start vertex of its global halfedges from firstHalfedge on,
+  // and its vertices sorted by global index
+  struct result_t {
+    int firstHalfedge;
+    std::vector<int> corner;
+    std::vector<std::pair<int, Cvec3f> > vertex;
+  };
+
+  int maxPatchFaces_, numPatches_;
+  std::vector<counts_t> counts_;
+  std::size_t positionOffset_, halfedgeOffset_;
+
+  // control faces [begin, end) and the faces sharing a vertex with them
+  static void extract__(const Mesh& m, const int begin, const int end, patch_t& r) {
+    const Mesh::topology_t& t = *m.topology_;
+    const int* const ring = m.getVertexRingOffsets();
+    const int* const ringFace = m.getVertexRingFaces();
+    std::vector<int> faces;
+    for (int h = t.fhalfedge_[begin]; h < t.fhalfedge_[end]; ++h) {
+      const int v = t.hvertex_[h];
+      for (int k = ring[v]; k < ring[v+1]; ++k) {
+        if (ringFace[k] < begin || ringFace[k] >= end)
+          faces.push_back(ringFace[k]);
+      }
+    }
+    std::sort(faces.begin(), faces.end());
+    faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+    const int numInner = end - begin;
+    faces.insert(faces.begin(), numInner, 0);
+    for (int f = 0; f < numInner; ++f) {
+      faces[f] = begin + f;
+    }
+
+    r = patch_t();
+    std::vector<std::pair<int, int> > local;                // (global, local) halfedge
+    r.offset.push_back(0);
+    for (std::size_t f = 0; f < faces.size(); ++f) {
+      for (int h = t.fhalfedge_[faces[f]]; h < t.fhalfedge_[faces[f]+1]; ++h) {
+        local.push_back(std::make_pair(h, (int)r.halfedge.size()));
+        r.halfedge.push_back(h);
+        r.edge.push_back(t.hedge_[h]);
+        r.first.push_back(t.ehalfedge_[t.hedge_[h]] == h);
+        r.global.push_back(t.hvertex_[h]);
+      }
+      r.offset.push_back(r.halfedge.size());
+      r.face.push_back(faces[f]);
+      r.inner.push_back((int)f < numInner);
+    }
+    std::sort(local.begin(), local.end());
+    r.twin.resize(r.halfedge.size());
+    for (std::size_t h = 0; h < r.halfedge.size(); ++h) {
+      const std::vector<std::pair<int, int> >::const_iterator i =
+        std::lower_bound(local.begin(), local.end(), std::make_pair(t.twin_[r.halfedge[h]], -1));
+      r.twin[h] = i != local.end() && i->first == t.twin_[r.halfedge[h]] ? i->second : -1;
+    }
+    // r.global holds the start vertex of every halfedge for now
+    r.vertex = r.global;
+    std::sort(r.global.begin(), r.global.end());
+    r.global.erase(std::unique(r.global.begin(), r.global.end()), r.global.end());
+    r.p.resize(r.global.size());
+    for (std::size_t i = 0; i < r.global.size(); ++i) {
+      r.p[i] = m.position_[r.global[i]];
+    }
+    for (std::size_t h = 0; h < r.vertex.size(); ++h) {
+      r.vertex[h] = std::lower_bound(r.global.begin(), r.global.end(), r.vertex[h]) - r.global.begin();
+    }
+  }
+
+  // One level of subdivision of s into r, numbered as refine__ does with the counts of
+  // the level of s. Vertices whose fan is cut by the rim of the halo get a position
+  // that does not matter, as prune__ drops all faces around them.
+  static void refine__(const patch_t& s, const counts_t& c, patch_t& r) {
+    const int nf = s.face.size(), nh = s.vertex.size(), nv = s.p.size();
+    std::vector<int> hface(nh), next(nh), prev(nh);
+    for (int f = 0; f < nf; ++f) {
+      for (int h = s.offset[f]; h < s.offset[f+1]; ++h) {
+        hface[h] = f;
+        next[h] = h + 1 < s.offset[f+1] ? h + 1 : s.offset[f];
+        prev[h] = h > s.offset[f] ? h - 1 : s.offset[f+1] - 1;
+      }
+    }
+    std::vector<Cvec3f> fp(nf, Cvec3f(0));
+    for (int f = 0; f < nf; ++f) {
+      for (int h = s.offset[f]; h < s.offset[f+1]; ++h) {
+        fp[f] += s.p[s.vertex[h]];
+      }
+      fp[f] /= s.offset[f+1] - s.offset[f];
+    }
+    // local edges, numbered by their first halfedge
+    std::vector<int> hedge(nh);
+    int ne = 0;
+    for (int h = 0; h < nh; ++h) {
+      if (s.twin[h] < 0 || h < s.twin[h])
+        hedge[h] = ne++;
+      else
+        hedge[h] = hedge[s.twin[h]];
+    }
+
+    r.p.assign(nv + ne + nf, Cvec3f(0));
+    r.global.resize(nv + ne + nf);
+    std::vector<int> valence(nv, 0);
+    std::vector<char> open(nv, 0);
+    for (int h = 0; h < nh; ++h) {
+      const int v = s.vertex[h];
+      ++valence[v];
+      open[v] |= s.twin[h] < 0 || s.twin[prev[h]] < 0;
+      r.p[v] += s.p[s.vertex[next[h]]] + fp[hface[h]];
+      if (s.twin[h] < 0 || h < s.twin[h]) {
+        const Cvec3f ends = s.p[v] + s.p[s.vertex[next[h]]];
+        r.p[nv + hedge[h]] = s.twin[h] < 0 ? ends / 2 : (ends + fp[hface[h]] + fp[hface[s.twin[h]]]) / 4;
+        r.global[nv + hedge[h]] = c.nv + s.edge[h];
+      }
+    }
+    for (int v = 0; v < nv; ++v) {
+      const float n = valence[v];
+      r.p[v] = open[v] || n == 0 ? s.p[v] : s.p[v] * ((n - 2) / n) + r.p[v] / (n * n);
+      r.global[v] = s.global[v];
+    }
+    for (int f = 0; f < nf; ++f) {
+      r.p[nv + ne + f] = fp[f];
+      r.global[nv + ne + f] = c.nv + c.ne + s.face[f];
+    }
+
+    // face per old halfedge h, with halfedges 4h..4h+3
+    r.offset.resize(nh + 1);
+    r.face.resize(nh);
+    r.inner.resize(nh);
+    r.vertex.resize(4 * nh);
+    r.twin.resize(4 * nh);
+    r.halfedge.resize(4 * nh);
+    r.edge.resize(4 * nh);
+    r.first.resize(4 * nh);
+    for (int h = 0; h < nh; ++h) {
+      const int p = prev[h], q = 4*h, gh = s.halfedge[h];
+      r.offset[h] = q;
+      r.face[h] = gh;
+      r.inner[h] = s.inner[hface[h]];
+      r.vertex[q+0] = s.vertex[h];
+      r.vertex[q+1] = nv + hedge[h];
+      r.vertex[q+2] = nv + ne + hface[h];
+      r.vertex[q+3] = nv + hedge[p];
+      r.twin[q+0] = s.twin[h] < 0 ? -1 : 4*next[s.twin[h]] + 3;
+      r.twin[q+1] = 4*next[h] + 2;
+      r.twin[q+2] = 4*p + 1;
+      r.twin[q+3] = s.twin[p] < 0 ? -1 : 4*s.twin[p];
+      r.edge[q+0] = 2*s.edge[h] + !s.first[h];
+      r.edge[q+1] = 2*c.ne + gh;
+      r.edge[q+2] = 2*c.ne + s.halfedge[p];
+      r.edge[q+3] = 2*s.edge[p] + s.first[p];
+      r.first[q+0] = s.first[h];
+      r.first[q+1] = 1;
+      r.first[q+2] = 0;
+      r.first[q+3] = s.first[p];
+      for (int j = 0; j < 4; ++j) {
+        r.halfedge[q+j] = 4*gh + j;
+      }
+    }
+    r.offset[nh] = 4 * nh;
+  }
+
+  // Keeps the faces of the patch and the faces sharing a vertex with them, and the
+  // vertices these use
+  static void prune__(const patch_t& s, patch_t& r) {
+    const int nf = s.face.size(), nh = s.vertex.size(), nv = s.p.size();
+    std::vector<char> touched(nv, 0);
+    for (int f = 0; f < nf && s.inner[f]; ++f) {
+      for (int h = s.offset[f]; h < s.offset[f+1]; ++h) {
+        touched[s.vertex[h]] = 1;
+      }
+    }
+    std::vector<int> halfedge(nh, -1), vertex(nv, -1);
+    r = patch_t();
+    r.offset.push_back(0);
+    for (int f = 0; f < nf; ++f) {
+      bool keep = s.inner[f];
+      for (int h = s.offset[f]; !keep && h < s.offset[f+1]; ++h) {
+        keep = touched[s.vertex[h]];
+      }
+      if (!keep)
+        continue;
+      for (int h = s.offset[f]; h < s.offset[f+1]; ++h) {
+        const int v = s.vertex[h];
+        if (vertex[v] < 0) {
+          vertex[v] = r.global.size();
+          r.global.push_back(s.global[v]);
+          r.p.push_back(s.p[v]);
+        }
+        halfedge[h] = r.vertex.size();
+        r.vertex.push_back(vertex[v]);
+        r.twin.push_back(s.twin[h]);
+        r.halfedge.push_back(s.halfedge[h]);
+        r.edge.push_back(s.edge[h]);
+        r.first.push_back(s.first[h]);
+      }
+      r.offset.push_back(r.vertex.size());
+      r.face.push_back(s.face[f]);
+      r.inner.push_back(s.inner[f]);
+    }
+    for (std::size_t h = 0; h < r.twin.size(); ++h) {
+      r.twin[h] = r.twin[h] < 0 ? -1 : halfedge[r.twin[h]];
+    }
+  }
+
+  // Runs on the thread pool, so catches nothing and throws nothing itself
+  void refine_patch__(const Mesh& m, const int begin, const int end, const int levels, result_t& result) const {
+    patch_t patch, scratch;
+    extract__(m, begin, end, patch);
+    for (int level = 0; level < levels; ++level) {
+      refine__(patch, counts_[level], scratch);
+      prune__(scratch, patch);
+    }
+    // faces of the patch come first, and their halfedges are contiguous in the output
+    result.firstHalfedge = patch.halfedge[0];
+    result.corner.clear();
+    result.vertex.clear();
+    std::vector<char> written(patch.p.size(), 0);
+    for (int f = 0; f < (int)patch.face.size() && patch.inner[f]; ++f) {
+      for (int h = patch.offset[f]; h < patch.offset[f+1]; ++h) {
+        const int v = patch.vertex[h];
+        result.corner.push_back(patch.global[v]);
+        if (!written[v])
+          result.vertex.push_back(std::make_pair(patch.global[v], patch.p[v]));
+        written[v] = 1;
+      }
+    }
+    std::sort(result.vertex.begin(), result.vertex.end(), [](const std::pair<int, Cvec3f>& a, const std::pair<int, Cvec3f>& b) {
+      return a.first < b.first;
+    });
+  }
+
+  // Vertices go through one window per run of nearby indices
+  void write__(WritableMappedFile& file, const result_t& result) const {
+    int* const corner = reinterpret_cast<int*>(file.map(halfedgeOffset_ + sizeof(int) * result.firstHalfedge, sizeof(int) * result.corner.size()));
+    std::copy(result.corner.begin(), result.corner.end(), corner);
+    const std::vector<std::pair<int, Cvec3f> >& vertex = result.vertex;
+    for (std::size_t i = 0, j; i < vertex.size(); i = j) {
+      for (j = i + 1; j < vertex.size() && vertex[j].first - vertex[j-1].first < (1 << 16); ++j) {}
+      const int base = vertex[i].first;
+      float* const p = reinterpret_cast<float*>(file.map(positionOffset_ + 3 * sizeof(float) * base,
+                                                         3 * sizeof(float) * (vertex[j-1].first - base + 1)));
+      for (std::size_t k = i; k < j; ++k) {
+        for (int c = 0; c < 3; ++c) {
+          p[3 * (vertex[k].first - base) + c] = vertex[k].second[c];
+        }
+      }
+    }
+    file.unmap();
+  }
+};
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <cstddef>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+// A fixed set of worker threads that run index ranges in parallel. The calling
+// thread takes part in the work, so a pool with zero workers (e.g. on a single
+// core machine) simply runs everything inline.
+//
+// run() is not reentrant: a task that calls back into the pool has its nested
+// work executed serially on the current thread. Tasks must not throw.
+class ThreadPool {
+public:
+  // Use numWorkers = -1 to have one worker per hardware thread, minus the caller
+  explicit ThreadPool(int numWorkers = -1)
+    : task_(NULL), taskData_(NULL), numTasks_(0), nextTask_(0), busy_(0), generation_(0), quit_(false), running_(false) {
+    if (numWorkers < 0)
+      numWorkers = std::max(1, (int)std::thread::hardware_concurrency()) - 1;
+    for (int i = 0; i < numWorkers; ++i) {
+      workers_.push_back(std::thread(&ThreadPool::work__, this));
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    wake_.notify_all();
+    for (std::size_t i = 0; i < workers_.size(); ++i) {
+      workers_[i].join();
+    }
+  }
+
+  // Number of threads that execute tasks, including the caller
+  int getNumThreads() const {
+    return workers_.size() + 1;
+  }
+
+  // Number of ranges parallelFor(n, ...) splits [0, n) into
+  int getNumChunks(int n) const {
+    const int grain = 1024;
+    return std::max(1, std::min(4 * getNumThreads(), (n + grain - 1) / grain));
+  }
+
+  // Calls fn(i) for every i in [0, numTasks) and returns once all calls finished.
+  // Does not allocate.
+  template<typename Fn>
+  void run(int numTasks, const Fn& fn) {
+    bool expected = false;
+    if (workers_.empty() || numTasks <= 1 || !running_.compare_exchange_strong(expected, true)) {
+      for (int i = 0; i < numTasks; ++i) {
+        fn(i);
+      }
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &invoke__<Fn>;
+      taskData_ = &fn;
+      numTasks_ = numTasks;
+      nextTask_ = 0;
+      busy_ = workers_.size();
+      ++generation_;
+    }
+    wake_.notify_all();
+    drain__();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this] { return busy_ == 0; });
+    }
+    running_ = false;
+  }
+
+  // Splits [0, n) into getNumChunks(n) contiguous ranges and calls fn(chunk, begin, end)
+  // for each of them. The split only depends on n, so two calls with the same n see
+  // the same ranges (useful for count-then-fill passes).
+  template<typename Fn>
+  void parallelFor(int n, Fn fn) {
+    const int chunks = getNumChunks(n);
+    run(chunks, [&](int c) {
+      fn(c, chunkBegin__(n, chunks, c), chunkBegin__(n, chunks, c + 1));
+    });
+  }
+
+private:
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_, done_;
+  void (*task_)(const void*, int);
+  const void* taskData_;
+  int numTasks_;
+  std::atomic<int> nextTask_;
+  int busy_;
+  unsigned generation_;
+  bool quit_;
+  std::atomic<bool> running_;
+
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator = (const ThreadPool&);
+
+  template<typename Fn>
+  static void invoke__(const void* fn, int i) {
+    (*static_cast<const Fn*>(fn))(i);
+  }
+
+  static int chunkBegin__(int n, int chunks, int c) {
+    return (int)((long long)n * c / chunks);
+  }
+
+  void drain__() {
+    for (int i; (i = nextTask_++) < numTasks_;) {
+      task_(taskData_, i);
+    }
+  }
+
+  void work__() {
+    unsigned seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] { return quit_ || generation_ != seen; });
+        if (quit_)
+          return;
+        seen = generation_;
+      }
+      drain__();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--busy_ == 0)
+          done_.notify_all();
+      }
+    }
+  }
+};
+
+// The pool shared by the mesh processing code
+inline ThreadPool& getThreadPool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+#endif
@@ -0,0 +1,333 @@
+// Headless benchmark of the mesh pipeline, printing a JSON report.
+//
+//   meshbench [-levels n] [-frames n] [-maxfaces n] [-grid n]... [input.mesh]...
+//
+// Every input mesh (cube.mesh when none is given) and every generated n x n quad torus
+// (64, 256 and 1024 when no -grid is given) is loaded, then run through MeshPipeline
+// at subdivision levels 0 to -levels (7), skipping levels that would exceed -maxfaces
+// refined faces (1 << 22). Per mesh it reports the time of Mesh::load(), of building
+// the topology, and of the as-rigid-as-possible deformation of the control mesh. Per
+// level it reports the first frame (stencil and index buffer builds included), then
+// the average over -frames (10) frames of each stage: deform, refine with stencils,
+// refine with subdivideCatmullClark(), and shading, smooth and flat. faces_per_second
+// is the refined faces over the whole steady stencil frame. The peak resident set so
+// far and the heap allocations per steady frame help spot regressions.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#ifndef _WIN32
+#   include <sys/resource.h>
+#endif
+
+#include "../mesh.h"
+#include "../meshpipeline.h"
+#include "../meshdeformer.h"
+#include "../catmullclark.h"
+#include "../threadpool.h"
+
+using namespace std;
+
+// Every heap allocation of the process goes through here. All the replaceable forms
+// without alignment are replaced together, so that each new is paired with a delete
+// of the same family. They stay out of line: inlined into new and delete expressions,
+// their malloc() and free() look to g++ like mismatched allocation and deallocation
+// (-Wmismatched-new-delete).
+#if defined(__GNUC__)
+#   define NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#   define NOINLINE __declspec(noinline)
+#else
+#   define NOINLINE
+#endif
+
+static atomic<long long> g_allocations(0);
+
+static void* countedAlloc(size_t size) noexcept {
+  ++g_allocations;
+  return malloc(size ? size : 1);
+}
+
+NOINLINE void* operator new(size_t size) {
+  if (void* p = countedAlloc(size))
+    return p;
+  throw bad_alloc();
+}
+
+NOINLINE void* operator new[](size_t size) {
+  if (void* p = countedAlloc(size))
+    return p;
+  throw bad_alloc();
+}
+
+NOINLINE void* operator new(size_t size, const nothrow_t&) noexcept {
+  return countedAlloc(size);
+}
+
+NOINLINE void* operator new[](size_t size, const nothrow_t&) noexcept {
+  return countedAlloc(size);
+}
+
+NOINLINE void operator delete(void* p) noexcept {
+  free(p);
+}
+
+NOINLINE void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+NOINLINE void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+NOINLINE void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
+
+NOINLINE void operator delete(void* p, const nothrow_t&) noexcept {
+  free(p);
+}
+
+NOINLINE void operator delete[](void* p, const nothrow_t&) noexcept {
+  free(p);
+}
+
+typedef chrono::steady_clock Clock;
+
+// s as a JSON string literal
+static string quote(const string& s) {
+  string r = "\"";
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '"' || s[i] == '\\')
+      r += '\\';
+    r += s[i];
+  }
+  return r + "\"";
+}
+
+static double msSince(const Clock::time_point& start) {
+  return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+// Peak resident set of the process in megabytes, or -1 where unknown
+static double peakRssMb() {
+#ifdef _WIN32
+  return -1;
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#   ifdef __APPLE__
+  return usage.ru_maxrss / 1048576.0;                      // bytes
+#   else
+  return usage.ru_maxrss / 1024.0;                         // kilobytes
+#   endif
+#endif
+}
+
+// Writes an n x n quad torus as a text .mesh file
+static void writeTorus(const char filename[], const int n) {
+  ofstream f(filename);
+  if (!f)
+    throw runtime_error(string("Cannot create file ") + filename);
+  const double pi = 4 * atan(1.0);
+  f << n * n << " 0 " << n * n << "\n";
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      const double u = 2 * pi * i / n, v = 2 * pi * j / n;
+      f << (2 + cos(v)) * cos(u) << " " << (2 + cos(v)) * sin(u) << " " << sin(v) << "\n";
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      const int i1 = (i + 1) % n, j1 = (j + 1) % n;
+      f << i * n + j << " " << i1 * n + j << " " << i1 * n + j1 << " " << i * n + j1 << "\n";
+    }
+  }
+}
+
+// Positions scaled by a per vertex wave, as in the mesh animation of asst4
+static Cvec3f wave(const int i, const Cvec3f& p, const double t) {
+  return p * (float)(1 + 0.5 * sin(i + t));
+}
+
+struct Options {
+  int levels, frames;
+  long long maxFaces;
+
+  Options() : levels(7), frames(10), maxFaces(1 << 22) {}
+};
+
+// Runs the pipeline frames times at its current settings, adding up the stage timings
+static void runFrames(MeshPipeline& pipeline, const int frames, MeshPipeline::Timings& sum, long long& allocations) {
+  sum = MeshPipeline::Timings();
+  const long long before = g_allocations;
+  for (int frame = 0; frame < frames; ++frame) {
+    const double t = frame * 0.1;
+    pipeline.update([t](int i, const Cvec3f& p) { return wave(i, p, t); }, subdivideCatmullClark);
+    sum.deform += pipeline.getTimings().deform / frames;
+    sum.refine += pipeline.getTimings().refine / frames;
+    sum.shade += pipeline.getTimings().shade / frames;
+  }
+  allocations = (g_allocations - before) / max(frames, 1);
+}
+
+static void benchmark(const string& name, const char filename[], const Options& options, ostream& out) {
+  Clock::time_point start = Clock::now();
+  Mesh mesh;
+  mesh.load(filename);
+  const double loadMs = msSince(start);
+
+  vector<Cvec3f> positions(mesh.getPositions(), mesh.getPositions() + mesh.getNumVertices());
+  vector<int> offsets(mesh.getFaceVertexOffsets(), mesh.getFaceVertexOffsets() + mesh.getNumFaces() + 1);
+  vector<int> indices(mesh.getFaceVertexIndices(), mesh.getFaceVertexIndices() + offsets.back());
+  start = Clock::now();
+  Mesh rebuilt;
+  rebuilt.build(positions, offsets, indices);
+  const double topologyMs = msSince(start);
+
+  // as in asst4: the lowest vertex stays, the highest swings
+  start = Clock::now();
+  MeshDeformer deformer;
+  deformer.setMesh(mesh);
+  vector<int> handles(2, 0);
+  for (int i = 0; i < mesh.getNumVertices(); ++i) {
+    if (positions[i][1] < positions[handles[0]][1])
+      handles[0] = i;
+    if (positions[i][1] > positions[handles[1]][1])
+      handles[1] = i;
+  }
+  deformer.setHandles(handles);
+  const double arapSetupMs = msSince(start);
+  start = Clock::now();
+  for (int frame = 0; frame < options.frames; ++frame) {
+    vector<Cvec3f> handlePositions;
+    handlePositions.push_back(positions[handles[0]]);
+    handlePositions.push_back(positions[handles[1]] + Cvec3f(0.5 * sin(frame * 0.1), 0, 0));
+    deformer.deform(handlePositions);
+  }
+  const double arapMs = msSince(start) / max(options.frames, 1);
+
+  out << "    {\n"
+      << "      \"name\": " << quote(name) << ",\n"
+      << "      \"vertices\": " << mesh.getNumVertices() << ",\n"
+      << "      \"faces\": " << mesh.getNumFaces() << ",\n"
+      << "      \"load_ms\": " << loadMs << ",\n"
+      << "      \"topology_ms\": " << topologyMs << ",\n"
+      << "      \"arap_setup_ms\": " << arapSetupMs << ",\n"
+      << "      \"arap_deform_ms\": " << arapMs << ",\n"
+      << "      \"levels\": [";
+
+  MeshPipeline pipeline;
+  pipeline.setMesh(mesh);
+  long long faces = 0;
+  for (int i = 0; i < mesh.getNumFaces(); ++i) {
+    faces += offsets[i+1] - offsets[i];                     // faces after the first level
+  }
+  for (int level = 0; level <= options.levels; ++level) {
+    const long long refinedFaces = level == 0 ? mesh.getNumFaces() : faces << (2 * (level - 1));
+    if (refinedFaces > options.maxFaces)
+      break;
+    pipeline.setLevels(level);
+    pipeline.setUseStencils(true);
+    pipeline.setFlatShading(false);
+    MeshPipeline::Timings smooth, flat, direct;
+    long long allocations, unused;
+    start = Clock::now();
+    runFrames(pipeline, 1, smooth, unused);
+    const double firstMs = msSince(start);
+    runFrames(pipeline, options.frames, smooth, allocations);
+    const double stencilFrameMs = smooth.deform + smooth.refine + smooth.shade;
+    pipeline.setFlatShading(true);
+    runFrames(pipeline, 1, flat, unused);                  // rebuilds the index buffer
+    runFrames(pipeline, options.frames, flat, unused);
+    pipeline.setFlatShading(false);
+    pipeline.setUseStencils(false);
+    runFrames(pipeline, 1, direct, unused);                // refines the topology once
+    runFrames(pipeline, options.frames, direct, unused);
+
+    out << (level ? ",\n" : "\n")
+        << "        {\n"
+        << "          \"level\": " << level << ",\n"
+        << "          \"faces\": " << pipeline.getRefinedMesh().getNumFaces() << ",\n"
+        << "          \"vertices\": " << pipeline.getRefinedMesh().getNumVertices() << ",\n"
+        << "          \"first_frame_ms\": " << firstMs << ",\n"
+        << "          \"deform_ms\": " << smooth.deform << ",\n"
+        << "          \"refine_stencil_ms\": " << smooth.refine << ",\n"
+        << "          \"refine_direct_ms\": " << direct.refine << ",\n"
+        << "          \"shade_smooth_ms\": " << smooth.shade << ",\n"
+        << "          \"shade_flat_ms\": " << flat.shade << ",\n"
+        << "          \"faces_per_second\": " << (stencilFrameMs > 0 ? refinedFaces / stencilFrameMs * 1000 : 0) << ",\n"
+        << "          \"allocations_per_frame\": " << allocations << ",\n"
+        << "          \"peak_rss_mb\": " << peakRssMb() << "\n"
+        << "        }";
+  }
+  out << "\n      ]\n    }";
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  vector<int> grids;
+  vector<string> files;
+  for (int i = 1; i < argc; ++i) {
+    const bool value = i + 1 < argc;
+    if (value && strcmp(argv[i], "-levels") == 0)
+      options.levels = atoi(argv[++i]);
+    else if (value && strcmp(argv[i], "-frames") == 0)
+      options.frames = atoi(argv[++i]);
+    else if (value && strcmp(argv[i], "-maxfaces") == 0)
+      options.maxFaces = atoll(argv[++i]);
+    else if (value && strcmp(argv[i], "-grid") == 0)
+      grids.push_back(atoi(argv[++i]));
+    else if (argv[i][0] == '-') {
+      cerr << "Usage: " << argv[0] << " [-levels n] [-frames n] [-maxfaces n] [-grid n]... [input.mesh]..." << endl;
+      return 1;
+    }
+    else
+      files.push_back(argv[i]);
+  }
+  if (files.empty())
+    files.push_back("cube.mesh");
+  if (grids.empty()) {
+    grids.push_back(64);
+    grids.push_back(256);
+    grids.push_back(1024);
+  }
+
+  try {
+    ostringstream out;
+    out << "{\n"
+        << "  \"threads\": " << getThreadPool().getNumThreads() << ",\n"
+        << "  \"frames\": " << options.frames << ",\n"
+        << "  \"meshes\": [\n";
+    for (size_t i = 0; i < files.size(); ++i) {
+      benchmark(files[i], files[i].c_str(), options, out);
+      out << ",\n";
+    }
+    for (size_t i = 0; i < grids.size(); ++i) {
+      ostringstream name;
+      name << "torus" << grids[i];
+      const string filename = "meshbench_" + name.str() + ".mesh";
+      writeTorus(filename.c_str(), grids[i]);
+      benchmark(name.str(), filename.c_str(), options, out);
+      remove(filename.c_str());
+      out << (i + 1 < grids.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+    cout << out.str();
+    return 0;
+  }
+  catch (const runtime_error& e) {
+    cerr << "Exception caught: " << e.what() << endl;
+    return 1;
+  }
+}
@@ -0,0 +1,57 @@
+// Converts a text .mesh, Wavefront .obj or PLY file to the binary mesh format read
+// by Mesh::load().
+//
+//   meshconv input.mesh output.meshbin [-nc | -q | -s levels]
+//
+// -nc leaves the halfedge connectivity out of the output, which makes the file
+// smaller but has load() rebuild the connectivity.
+// -q writes the compressed format instead (see Mesh::saveCompressed()), with area
+// weighted vertex normals.
+// -s writes the input subdivided levels times with Catmull-Clark, streamed to the
+// output patch by patch (see StreamingSubdivider), so the result need not fit in RAM.
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+#include "../mesh.h"
+#include "../vertexnormals.h"
+#include "../streamingsubdivider.h"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+  const bool subdivide = argc == 5 && strcmp(argv[3], "-s") == 0;
+  if (argc < 3 || argc > 5 || (argc == 4 && strcmp(argv[3], "-nc") != 0 && strcmp(argv[3], "-q") != 0) ||
+      (argc == 5 && !subdivide)) {
+    cerr << "Usage: " << argv[0] << " input.(mesh|obj|ply) output.meshbin [-nc | -q | -s levels]" << endl;
+    return 1;
+  }
+  try {
+    Mesh mesh;
+    mesh.load(argv[1]);
+    if (subdivide) {
+      StreamingSubdivider subdivider;
+      subdivider.subdivide(mesh, atoi(argv[4]), argv[2]);
+      cout << argv[2] << ": " << mesh.getNumFaces() << " faces subdivided in " << subdivider.getNumPatches() << " patches" << endl;
+      return 0;
+    }
+    if (argc == 4 && strcmp(argv[3], "-q") == 0) {
+      VertexNormals normals;
+      normals.compute(mesh, VertexNormals::AREA_WEIGHTED, [&](int i, const Cvec3f&, const Cvec3f& n) {
+        mesh.getVertex(i).setNormal(Cvec3(n[0], n[1], n[2]));
+      });
+      mesh.saveCompressed(argv[2]);
+    }
+    else {
+      mesh.save(argv[2], argc == 3);
+    }
+    cout << argv[2] << ": " << mesh.getNumVertices() << " vertices, " << mesh.getNumFaces() << " faces, "
+         << mesh.getNumEdges() << " edges" << endl;
+    return 0;
+  }
+  catch (const runtime_error& e) {
+    cerr << "Exception caught: " << e.what() << endl;
+    return 1;
+  }
+}
@@ -0,0 +1,124 @@
+#ifndef VERTEX_H
+#define VERTEX_H
+
+#include "cvec.h"
+#include "geometrymaker.h"
+
+// The vertex types of the predefined geometries in geometry.h, kept free of OpenGL so
+// that code that only fills vertex buffers (MeshPipeline, tools/meshbench) builds
+// without GL headers. Their FORMATs are defined in geometry.cpp.
+
+class VertexFormat;
+
+// First, some predefined vertex formats. It's perfectly easy for you to roll your own.
+// Note that we define assignment operator (=) from GenericVertex
+// of geometrymaker.h so that we can use geometrymaker on any of these format
+
+// A vertex with floating point Position, and Normal;
+struct VertexPN {
+  Cvec3f p, n;
+
+  static const VertexFormat FORMAT;
+
+  VertexPN() {}
+
+  VertexPN(float x, float y, float z,
+           float nx, float ny, float nz)
+    : p(x,y,z), n(nx, ny, nz) {}
+
+  VertexPN(const Cvec3f& pos, const Cvec3f& normal)
+    : p(pos), n(normal) {}
+
+  VertexPN(const Cvec3& pos, const Cvec3& normal)
+    : p(pos[0], pos[1], pos[2]), n(normal[0], normal[1], normal[2]) {}
+
+
+  // Define copy constructor and assignment operator from GenericVertex so we can
+  // use make* functions from geometrymaker.h
+  VertexPN(const GenericVertex& v) {
+    *this = v;
+  }
+
+  VertexPN& operator = (const GenericVertex& v) {
+    p = v.pos;
+    n = v.normal;
+    return *this;
+  }
+
+};
+
+// A vertex with floating point Position, Normal, and one set of teXture Coordinates;
+struct VertexPNX : public VertexPN {
+  Cvec2f x; // texture coordinates
+
+  static const VertexFormat FORMAT;
+
+  VertexPNX() {}
+
+  VertexPNX(float x, float y, float z,
+            float nx, float ny, float nz,
+            float u, float v)
+    : VertexPN(x, y, z, nx, ny, nz), x(u, v) {}
+
+  VertexPNX(const Cvec3f& pos, const Cvec3f& normal, const Cvec2f& texCoords)
+    : VertexPN(pos, normal), x(texCoords) {}
+
+  VertexPNX(const Cvec3& pos, const Cvec3& normal, const Cvec2& texCoords)
+    : VertexPN(pos, normal), x(texCoords[0], texCoords[1]) {}
+
+
+  // Define copy constructor and assignment operator from GenericVertex so we can
+  // use make* functions from geometrymaker.h
+  VertexPNX(const GenericVertex& v) {
+    *this = v;
+  }
+
+  VertexPNX& operator = (const GenericVertex& v) {
+    p = v.pos;
+    n = v.normal;
+    x = v.tex;
+    return *this;
+  }
+};
+
+
+// A vertex with floating point Position, Normal, Tangent, Binormal, teXture Coord
+struct VertexPNTBX : public VertexPNX {
+  Cvec3f t, b; // tangent, binormal
+
+  static const VertexFormat FORMAT;
+
+  VertexPNTBX() {}
+
+  VertexPNTBX(float x, float y, float z,
+              float nx, float ny, float nz,
+              float tx, float ty, float tz,
+              float bx, float by, float bz,
+              float u, float v)
+    : VertexPNX(x, y, z, nx, ny, nz, u, v), t(tx, ty, tz), b(bx, by, bz) {}
+
+  VertexPNTBX(const Cvec3f& pos, const Cvec3f& normal,
+              const Cvec3f& tangent, const Cvec3f& binormal, const Cvec2f& texCoords)
+    : VertexPNX(pos, normal, texCoords), t(tangent), b(binormal) {}
+
+  VertexPNTBX(const Cvec3& pos, const Cvec3& normal,
+              const Cvec3& tangent, const Cvec3& binormal, const Cvec2& texCoords)
+    : VertexPNX(pos, normal, texCoords), t(tangent[0], tangent[1], tangent[2]), b(binormal[0], binormal[1], binormal[2]) {}
+
+  // Define copy constructor and assignment operator from GenericVertex so we can
+  // use make* functions from geometrymaker.h
+  VertexPNTBX(const GenericVertex& v) {
+    *this = v;
+  }
+
+  VertexPNTBX& operator = (const GenericVertex& v) {
+    p = v.pos;
+    n = v.normal;
+    t = v.tangent;
+    b = v.binormal;
+    x = v.tex;
+    return *this;
+  }
+};
+
+#endif
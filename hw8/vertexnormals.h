@@ -0,0 +1,82 @@
+#ifndef VERTEXNORMALS_H
+#define VERTEXNORMALS_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "cvec.h"
+#include "mesh.h"
+#include "threadpool.h"
+
+// Smooth vertex normals from one pass over the flat face list of a mesh. Every face
+// adds its normal to its corners, weighted by the face area or by the corner angle.
+// Each thread accumulates a contiguous range of faces into its own buffer, and a
+// second parallel pass sums the buffers per vertex and normalizes, so no atomics or
+// valence counts are needed. The buffers are kept across calls.
+class VertexNormals {
+public:
+  enum Weighting {
+    AREA_WEIGHTED,
+    ANGLE_WEIGHTED
+  };
+
+  // Calls out(v, position, normal) for every vertex v of m, from several threads.
+  // Vertices that are in no face get a zero normal.
+  template<typename Out>
+  void compute(const Mesh& m, const Weighting weighting, Out out) {
+    ThreadPool& pool = getThreadPool();
+    const int nv = m.getNumVertices(), nf = m.getNumFaces();
+    const int numBuffers = std::min(pool.getNumThreads(), pool.getNumChunks(nf));
+    if ((int)acc_.size() < numBuffers)
+      acc_.resize(numBuffers);
+    const Cvec3f* const p = m.getPositions();
+    const int* const offset = m.getFaceVertexOffsets();
+    const int* const index = m.getFaceVertexIndices();
+
+    pool.run(numBuffers, [&](int t) {
+      std::vector<Cvec3f>& acc = acc_[t];
+      acc.assign(nv, Cvec3f(0));
+      const int begin = (long long)nf * t / numBuffers, end = (long long)nf * (t+1) / numBuffers;
+      for (int f = begin; f < end; ++f) {
+        const int* const v = index + offset[f];
+        const int n = offset[f+1] - offset[f];
+        if (weighting == AREA_WEIGHTED) {
+          Cvec3f normal(0);                                 // twice the vector area of the polygon
+          for (int j = 0, k = n-1; j < n; k = j++) {
+            normal += cross(p[v[k]], p[v[j]]);
+          }
+          for (int j = 0; j < n; ++j) {
+            acc[v[j]] += normal;
+          }
+        }
+        else {
+          for (int j = 0; j < n; ++j) {
+            const Cvec3f& c = p[v[j]];
+            const Cvec3f a = p[v[j+1 < n ? j+1 : 0]] - c, b = p[v[j > 0 ? j-1 : n-1]] - c;
+            const Cvec3f normal = cross(a, b);
+            const float s = norm(normal);
+            if (s > 0)
+              acc[v[j]] += normal * (std::atan2(s, dot(a, b)) / s);
+          }
+        }
+      }
+    });
+
+    pool.parallelFor(nv, [&](int, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        Cvec3f normal = acc_[0][i];
+        for (int t = 1; t < numBuffers; ++t) {
+          normal += acc_[t][i];
+        }
+        const float s = norm(normal);
+        out(i, p[i], s > 0 ? normal / s : normal);
+      }
+    });
+  }
+
+private:
+  std::vector<std::vector<Cvec3f> > acc_;                   // one accumulation buffer per thread
+};
+
+#endif